@@ -0,0 +1,623 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/*
+ * Microbenchmarks for the pieces on the message path: the client 
+ * registry, framing and command parsing, broadcast formatting and 
+ * logging. Every benchmark runs on one thread and then on several 
+ * threads doing the same at once, and reports ns/op as seen by each 
+ * thread and heap allocations/op.
+ *
+ * Allocations are counted by wrapping malloc(), calloc() and realloc()
+ * at link time, see the Makefile. Log output goes to /dev/null.
+ *
+ * Usage: ./bench_micro [threads] [scale]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include "log.h"
+#include "epoch.h"
+#include "llist2.h"
+#include "cmd.h"
+#include "framer.h"
+#include "msg.h"
+#include "outq.h"
+#include "colors.h"
+
+#define MAX_THREADS     16        /* Max. number of benchmark threads */
+#define MAX_EXTRA       1000      /* Entries each thread adds to the registry */
+#define SESSIONS        100       /* Recipients of a broadcast */
+#define FRAME_SIZE      4096      /* Bytes fed to the framer at once */
+
+/* Work of one thread in one benchmark */
+typedef struct bench_run
+{
+	int thread;
+	long size;                    /* Registry size, where it matters */
+	long iterations;
+	double ns;                    /* Time spent in the measured code */
+	long ops;
+} bench_run;
+
+typedef struct benchmark
+{
+	const char *name;
+	void (*body)(bench_run *run);
+	long iterations;              /* Per thread, before scaling */
+	int sized;                    /* Runs at every registry size */
+} benchmark;
+
+
+/* Global vars */
+static unsigned long alloc_count = 0;
+static long registry_size = 0;
+static client_info *registry;     /* Entries present during the benchmark */
+static client_info extras[MAX_THREADS][MAX_EXTRA];
+static const long sizes[] = { 10, 1000, 10000 };
+
+/* Thread pool */
+static pthread_barrier_t start_barrier;
+static pthread_barrier_t done_barrier;
+static pthread_barrier_t round_barrier;  /* Between rounds of async logging */
+static int pool_threads = 1;
+static int active_threads = 1;
+static const benchmark *current = NULL;
+static bench_run runs[MAX_THREADS];
+
+/* Sample traffic: mostly plain chat, some commands and broken commands */
+static const char *lines[] = 
+{
+	"hello everybody",
+	"how is it going?",
+	"/me waves",
+	"/msg alice are you there?",
+	"/nick bob_2012",
+	"/who",
+	"this is a somewhat longer chat line, as people tend to write them",
+	"/nick invalid-nickname",
+	"lol",
+	"Gr\xc3\xbc" "ezi mitenand"
+};
+
+#define LINE_COUNT (sizeof(lines) / sizeof(lines[0]))
+
+static char frame_data[FRAME_SIZE];
+static size_t frame_len = 0;
+static long frame_lines = 0;
+
+/* Prevents the compiler from optimizing the work away */
+static volatile long sink;
+
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void *ptr, size_t size);
+
+
+/*
+ * Counting wrappers, see --wrap in the Makefile.
+ */
+void* __wrap_malloc(size_t size)
+{
+	__sync_fetch_and_add(&alloc_count, 1);
+	return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t nmemb, size_t size)
+{
+	__sync_fetch_and_add(&alloc_count, 1);
+	return __real_calloc(nmemb, size);
+}
+
+void* __wrap_realloc(void *ptr, size_t size)
+{
+	__sync_fetch_and_add(&alloc_count, 1);
+	return __real_realloc(ptr, size);
+}
+
+
+/*
+ * Returns a monotonic timestamp in nanoseconds.
+ */
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/*
+ * Fills the registry with size entries.
+ */
+static void registry_fill(long size)
+{
+	long i = 0;
+
+	registry = (client_info *)calloc(size, sizeof(client_info));
+	for (i = 0; i < size; i++)
+	{
+		registry[i].sockfd = (int)i;
+		snprintf(registry[i].nickname, sizeof(registry[i].nickname), "user%d", (int)i);
+		llist_insert(&registry[i]);
+	}
+	registry_size = size;
+}
+
+
+/*
+ * Empties the registry again.
+ */
+static void registry_empty(void)
+{
+	long i = 0;
+
+	for (i = 0; i < registry_size; i++)
+		llist_remove(&registry[i]);
+	epoch_quiescent();
+	epoch_reclaim();
+	registry_size = 0;
+}
+
+
+/*
+ * Adds entries of the thread to the registry and removes them again. 
+ * Either the inserts or the removes are timed.
+ */
+static void registry_churn(bench_run *run, int time_insert)
+{
+	client_info *mine = extras[run->thread];
+	long batch = (run->size < MAX_EXTRA) ? run->size : MAX_EXTRA;
+	double start = 0;
+	long done = 0;
+	long i = 0;
+
+	for (i = 0; i < batch; i++)
+	{
+		mine[i].sockfd = (int)(run->size + run->thread * MAX_EXTRA + i);
+		snprintf(mine[i].nickname, sizeof(mine[i].nickname), "x%d_%ld", run->thread, i);
+	}
+
+	while (done < run->iterations)
+	{
+		start = now_ns();
+		for (i = 0; i < batch; i++)
+			llist_insert(&mine[i]);
+		if (time_insert)
+			run->ns += now_ns() - start;
+
+		start = now_ns();
+		for (i = 0; i < batch; i++)
+			llist_remove(&mine[i]);
+		if (!time_insert)
+			run->ns += now_ns() - start;
+
+		epoch_quiescent();
+		epoch_reclaim();
+		done += batch;
+	}
+	run->ops = done;
+}
+
+
+static void bench_insert(bench_run *run)
+{
+	registry_churn(run, 1);
+}
+
+
+static void bench_remove(bench_run *run)
+{
+	registry_churn(run, 0);
+}
+
+
+static void bench_find_nick(bench_run *run)
+{
+	unsigned int seed = run->thread + 1;
+	double start = now_ns();
+	long i = 0;
+
+	for (i = 0; i < run->iterations; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		sink += (long)llist_find_by_nickname(registry[(seed >> 8) % run->size].nickname);
+		if ((i & 1023) == 0)
+			epoch_quiescent();
+	}
+	run->ns = now_ns() - start;
+	run->ops = run->iterations;
+}
+
+
+static void bench_find_sockfd(bench_run *run)
+{
+	unsigned int seed = run->thread + 1;
+	double start = now_ns();
+	long i = 0;
+
+	for (i = 0; i < run->iterations; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		sink += (long)llist_find_by_sockfd((int)((seed >> 8) % run->size));
+		if ((i & 1023) == 0)
+			epoch_quiescent();
+	}
+	run->ns = now_ns() - start;
+	run->ops = run->iterations;
+}
+
+
+static void bench_cmd_parse(bench_run *run)
+{
+	size_t lens[LINE_COUNT];
+	command cmd;
+	double start = 0;
+	long i = 0;
+
+	for (i = 0; i < (long)LINE_COUNT; i++)
+		lens[i] = strlen(lines[i]);
+
+	start = now_ns();
+	for (i = 0; i < run->iterations; i++)
+		sink += cmd_parse(lines[i % LINE_COUNT], lens[i % LINE_COUNT], &cmd);
+	run->ns = now_ns() - start;
+	run->ops = run->iterations;
+}
+
+
+/*
+ * Parses a framed line, as process_msg() does.
+ */
+static int parse_line(void *arg, char *line, size_t len, int flags)
+{
+	command cmd;
+
+	sink += cmd_parse(line, len, &cmd) + flags;
+
+	return 0;
+}
+
+
+static void bench_framer(bench_run *run)
+{
+	char buffer[FRAME_SIZE];
+	framer f;
+	double start = 0;
+	long done = 0;
+
+	framer_init(&f);
+	start = now_ns();
+	while (done < run->iterations)
+	{
+		/* The framer terminates lines in place, so start from a copy */
+		memcpy(buffer, frame_data, frame_len);
+		framer_feed(&f, buffer, frame_len, parse_line, NULL);
+		done += frame_lines;
+	}
+	run->ns = now_ns() - start;
+	run->ops = done;
+	framer_clear(&f);
+}
+
+
+static void bench_broadcast(bench_run *run)
+{
+	struct iovec iov[OUTQ_IOV_MAX];
+	outq queues[SESSIONS];
+	size_t len = 0;
+	double start = 0;
+	msg *m = NULL;
+	long i = 0;
+	int j = 0;
+	int n = 0;
+
+	for (j = 0; j < SESSIONS; j++)
+		outq_init(&queues[j]);
+
+	start = now_ns();
+	for (i = 0; i < run->iterations; i++)
+	{
+		m = msg_format("%s%s:%s %s\r\n", color_green, "user42", color_normal, 
+			lines[i % LINE_COUNT]);
+		for (j = 0; j < SESSIONS; j++)
+			outq_push(&queues[j], m);
+		msg_put(m);
+
+		/* Flush into a null sink */
+		for (j = 0; j < SESSIONS; j++)
+		{
+			n = outq_fill_iov(&queues[j], iov, OUTQ_IOV_MAX);
+			for (len = 0; n > 0; n--)
+				len += iov[n - 1].iov_len;
+			outq_consume(&queues[j], len);
+		}
+	}
+	run->ns = now_ns() - start;
+	run->ops = run->iterations;
+}
+
+
+static void bench_log(bench_run *run)
+{
+	double start = now_ns();
+	long i = 0;
+
+	for (i = 0; i < run->iterations; i++)
+		logline(LOG_INFO, "%s: %s", "user42", lines[i % LINE_COUNT]);
+	run->ns = now_ns() - start;
+	run->ops = run->iterations;
+}
+
+
+/*
+ * Logs through the async ring in rounds that fit into the ring together,
+ * and waits for the writer to take every record between rounds. Only the 
+ * logging is timed, so the result is not a measure of dropping messages 
+ * once the writer falls behind.
+ */
+static void bench_log_async(bench_run *run)
+{
+	struct timespec pause = { 0, 100000 };
+	log_stats stats;
+	unsigned long target = 0;
+	double start = 0;
+	long round = LOG_RING_SIZE / active_threads;
+	long done = 0;
+	long i = 0;
+
+	log_get_stats(&stats);
+	target = stats.written + stats.dropped;
+	while (done < run->iterations)
+	{
+		if (round > run->iterations - done)
+			round = run->iterations - done;
+
+		start = now_ns();
+		for (i = done; i < done + round; i++)
+			logline(LOG_INFO, "%s: %s", "user42", lines[i % LINE_COUNT]);
+		run->ns += now_ns() - start;
+		done += round;
+
+		/* Every thread logs as much in every round */
+		target += round * active_threads;
+		pthread_barrier_wait(&round_barrier);
+		if (run->thread == 0)
+		{
+			log_get_stats(&stats);
+			while (stats.written + stats.dropped < target)
+			{
+				nanosleep(&pause, NULL);
+				log_get_stats(&stats);
+			}
+		}
+		pthread_barrier_wait(&round_barrier);
+	}
+	run->ops = run->iterations;
+}
+
+
+static void bench_log_disabled(bench_run *run)
+{
+	double start = now_ns();
+	long i = 0;
+
+	for (i = 0; i < run->iterations; i++)
+		logline(LOG_DEBUG, "%s: %s", "user42", lines[i % LINE_COUNT]);
+	run->ns = now_ns() - start;
+	run->ops = run->iterations;
+}
+
+
+/*
+ * Thread entry point of the pool. Threads stay registered with the 
+ * epoch reclamation all the time and go offline while idle.
+ */
+static void *pool_thread(void *arg)
+{
+	int id = (int)(long)arg;
+
+	epoch_register();
+	while (1)
+	{
+		epoch_offline();
+		pthread_barrier_wait(&start_barrier);
+		epoch_online();
+		if (current == NULL)
+			break;
+		if (id < active_threads)
+			current->body(&runs[id]);
+		epoch_offline();
+		pthread_barrier_wait(&done_barrier);
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Runs a benchmark on a number of threads and prints its results.
+ */
+static void run_benchmark(FILE *out, const benchmark *b, long size, int threads, long scale)
+{
+	char name[64];
+	unsigned long allocs = 0;
+	double ns = 0;
+	long ops = 0;
+	int i = 0;
+
+	for (i = 0; i < threads; i++)
+	{
+		memset(&runs[i], 0, sizeof(bench_run));
+		runs[i].thread = i;
+		runs[i].size = size;
+		runs[i].iterations = b->iterations * scale;
+	}
+	current = b;
+	active_threads = threads;
+	allocs = alloc_count;
+
+	/* The main thread takes part as thread 0 */
+	epoch_offline();
+	pthread_barrier_wait(&start_barrier);
+	epoch_online();
+	b->body(&runs[0]);
+	epoch_offline();
+	pthread_barrier_wait(&done_barrier);
+	epoch_online();
+
+	allocs = alloc_count - allocs;
+	for (i = 0; i < threads; i++)
+	{
+		ns += runs[i].ns;
+		ops += runs[i].ops;
+	}
+
+	if (b->sized)
+		snprintf(name, sizeof(name), "%s/%ld", b->name, size);
+	else
+		snprintf(name, sizeof(name), "%s", b->name);
+	fprintf(out, "%-28s %7d %12.1f %12.3f\n", name, threads, ns / ops, (double)allocs / ops);
+	fflush(out);
+}
+
+
+int main(int argc, char *argv[])
+{
+	static const benchmark registry_benchmarks[] =
+	{
+		{ "llist_insert", bench_insert, 20000, 1 },
+		{ "llist_remove", bench_remove, 20000, 1 },
+		{ "llist_find_by_nickname", bench_find_nick, 1000000, 1 },
+		{ "llist_find_by_sockfd", bench_find_sockfd, 1000000, 1 },
+		{ NULL, NULL, 0, 0 }
+	};
+	static const benchmark other_benchmarks[] =
+	{
+		{ "cmd_parse", bench_cmd_parse, 5000000, 0 },
+		{ "framer_feed+cmd_parse", bench_framer, 2000000, 0 },
+		{ "broadcast_format/100", bench_broadcast, 20000, 0 },
+		{ "logline/disabled", bench_log_disabled, 10000000, 0 },
+		{ "logline/sync", bench_log, 200000, 0 },
+		{ NULL, NULL, 0, 0 }
+	};
+	static const benchmark async_log = { "logline/async", bench_log_async, 200000, 0 };
+	pthread_t threads[MAX_THREADS];
+	log_stats stats;
+	FILE *out = NULL;
+	long scale = 1;
+	size_t len = 0;
+	int counts[2];
+	int i = 0;
+	int j = 0;
+	int k = 0;
+
+	pool_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (pool_threads > 4)
+		pool_threads = 4;
+	if (argc > 1)
+		pool_threads = atoi(argv[1]);
+	if (argc > 2)
+		scale = atol(argv[2]);
+	if ((pool_threads < 1) || (pool_threads > MAX_THREADS) || (scale < 1))
+	{
+		printf("Usage: %s [threads] [scale]\n", argv[0]);
+		return 1;
+	}
+	counts[0] = 1;
+	counts[1] = pool_threads;
+
+	/* Results go to the real stdout, log messages to /dev/null */
+	out = fdopen(dup(STDOUT_FILENO), "w");
+	if ((out == NULL) || (freopen("/dev/null", "w", stdout) == NULL))
+	{
+		perror("Could not redirect log output");
+		return 1;
+	}
+	set_loglevel(LOG_INFO);
+
+	/* A buffer full of pipelined lines for the framer */
+	for (i = 0; ; i++)
+	{
+		len = strlen(lines[i % LINE_COUNT]);
+		if (frame_len + len + 2 > sizeof(frame_data))
+			break;
+		memcpy(frame_data + frame_len, lines[i % LINE_COUNT], len);
+		memcpy(frame_data + frame_len + len, "\r\n", 2);
+		frame_len += len + 2;
+		frame_lines++;
+	}
+
+	llist_init();
+	framer_setup(1024);
+	epoch_register();
+	pthread_barrier_init(&start_barrier, NULL, pool_threads);
+	pthread_barrier_init(&done_barrier, NULL, pool_threads);
+	for (i = 1; i < pool_threads; i++)
+		pthread_create(&threads[i], NULL, pool_thread, (void *)(long)i);
+
+	fprintf(out, "%-28s %7s %12s %12s\n", "benchmark", "threads", "ns/op", "allocs/op");
+	for (k = 0; k < (int)(sizeof(sizes) / sizeof(sizes[0])); k++)
+	{
+		registry_fill(sizes[k]);
+		for (i = 0; registry_benchmarks[i].name != NULL; i++)
+		{
+			for (j = 0; j < ((pool_threads > 1) ? 2 : 1); j++)
+				run_benchmark(out, &registry_benchmarks[i], sizes[k], counts[j], scale);
+		}
+		registry_empty();
+		free(registry);
+	}
+
+	for (i = 0; other_benchmarks[i].name != NULL; i++)
+	{
+		for (j = 0; j < ((pool_threads > 1) ? 2 : 1); j++)
+			run_benchmark(out, &other_benchmarks[i], 0, counts[j], scale);
+	}
+
+	/* Drops would mean the rounds did not fit into the ring */
+	log_start_async();
+	for (j = 0; j < ((pool_threads > 1) ? 2 : 1); j++)
+	{
+		pthread_barrier_init(&round_barrier, NULL, counts[j]);
+		run_benchmark(out, &async_log, 0, counts[j], scale);
+		pthread_barrier_destroy(&round_barrier);
+	}
+	log_stop_async();
+	log_get_stats(&stats);
+	fprintf(out, "\nasync log: %lu messages written, %lu dropped\n", stats.written, stats.dropped);
+
+	/* Release the pool */
+	current = NULL;
+	epoch_offline();
+	pthread_barrier_wait(&start_barrier);
+	for (i = 1; i < pool_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	return 0;
+}
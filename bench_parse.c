@@ -0,0 +1,149 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/*
+ * Microbenchmark for the per-message cost of command parsing. Compares the
+ * former regex based approach of process_msg(), which compiled, executed 
+ * and freed five patterns per chat line, with the command dispatcher.
+ *
+ * Usage: ./bench_parse [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <regex.h>
+#include <time.h>
+#include "cmd.h"
+
+/* Sample traffic: mostly plain chat, some commands and broken commands */
+static const char *lines[] = 
+{
+	"hello everybody",
+	"how is it going?",
+	"/me waves",
+	"/msg alice are you there?",
+	"/nick bob_2012",
+	"/who",
+	"this is a somewhat longer chat line, as people tend to write them",
+	"/nick invalid-nickname",
+	"lol",
+	"/quit"
+};
+
+#define LINE_COUNT (sizeof(lines) / sizeof(lines[0]))
+
+/* Prevents the compiler from optimizing the parsers away */
+static volatile int sink;
+
+
+/*
+ * Parses a line the way process_msg() used to.
+ */
+static int parse_regex(const char *message)
+{
+	regex_t regex_quit;
+	regex_t regex_nick;
+	regex_t regex_msg;
+	regex_t regex_me;
+	regex_t regex_who;
+	regmatch_t groups[3];
+	int type = CMD_NONE;
+
+	regcomp(&regex_quit, "^/quit$", REG_EXTENDED);
+	regcomp(&regex_nick, "^/nick ([a-zA-Z0-9_]{1,19})$", REG_EXTENDED);
+	regcomp(&regex_msg, "^/msg ([a-zA-Z0-9_]{1,19}) (.*)$", REG_EXTENDED);
+	regcomp(&regex_me, "^/me (.*)$", REG_EXTENDED);
+	regcomp(&regex_who, "^/who$", REG_EXTENDED);
+
+	if (regexec(&regex_quit, message, 0, NULL, 0) == 0)
+		type = CMD_QUIT;
+	else if (regexec(&regex_nick, message, 2, groups, 0) == 0)
+		type = CMD_NICK;
+	else if (regexec(&regex_msg, message, 3, groups, 0) == 0)
+		type = CMD_MSG;
+	else if (regexec(&regex_me, message, 2, groups, 0) == 0)
+		type = CMD_ME;
+	else if (regexec(&regex_who, message, 0, NULL, 0) == 0)
+		type = CMD_WHO;
+
+	regfree(&regex_quit);
+	regfree(&regex_nick);
+	regfree(&regex_msg);
+	regfree(&regex_me);
+	regfree(&regex_who);
+
+	return type;
+}
+
+
+/*
+ * Returns a monotonic timestamp in nanoseconds.
+ */
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+int main(int argc, char *argv[])
+{
+	size_t lens[LINE_COUNT];
+	command cmd;
+	long iterations = 20000;
+	long i = 0;
+	size_t j = 0;
+	double start = 0;
+	double regex_ns = 0;
+	double cmd_ns = 0;
+
+	if (argc > 1)
+		iterations = atol(argv[1]);
+
+	/* Both parsers must agree before their speed is of any interest */
+	for (j = 0; j < LINE_COUNT; j++)
+	{
+		lens[j] = strlen(lines[j]);
+		if (parse_regex(lines[j]) != cmd_parse(lines[j], lens[j], &cmd))
+		{
+			printf("Mismatch on line \"%s\"\n", lines[j]);
+			return 1;
+		}
+	}
+
+	start = now_ns();
+	for (i = 0; i < iterations; i++)
+		sink = parse_regex(lines[i % LINE_COUNT]);
+	regex_ns = (now_ns() - start) / iterations;
+
+	start = now_ns();
+	for (i = 0; i < iterations * 100; i++)
+		sink = cmd_parse(lines[i % LINE_COUNT], lens[i % LINE_COUNT], &cmd);
+	cmd_ns = (now_ns() - start) / (iterations * 100);
+
+	printf("regcomp/regexec per message: %10.1f ns/msg\n", regex_ns);
+	printf("command dispatcher:          %10.1f ns/msg\n", cmd_ns);
+	printf("speedup:                     %10.0fx\n", regex_ns / cmd_ns);
+
+	return 0;
+}
@@ -0,0 +1,204 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/*
+ * Throughput benchmark for the line scanner of the receive path. Runs 
+ * every implementation the CPU supports over a buffer of chat traffic 
+ * and reports GB/s, next to plain memchr() for reference. All 
+ * implementations must agree on lines and problems found.
+ *
+ * Usage: ./bench_scan [megabytes] [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "scan.h"
+
+/* Sample traffic: mostly ASCII, some UTF-8 and a few lines to refuse */
+static const char *lines[] = 
+{
+	"hello everybody\r\n",
+	"how is it going?\n",
+	"/me waves\n",
+	"/msg alice are you there?\r\n",
+	"this is a somewhat longer chat line, as people tend to write them\n",
+	"Gr\xc3\xbc" "ezi mitenand, wie gaht's?\n",
+	"\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e\xe3\x81\xae\xe3\x83\x86\xe3\x82\xad\xe3\x82\xb9\xe3\x83\x88\n",
+	"emoji \xf0\x9f\x98\x80 at the end of a line that is mostly ASCII text\n",
+	"lol\n",
+	"\x1b[31mred alert\x1b[0m\n",
+	"overlong \xc0\xaf slash\n",
+	"surrogate \xed\xa0\x80 half\n",
+	"csi \xc2\x9b" "2J clear\n",
+	"bare\rreturn\n"
+};
+
+#define LINE_COUNT (sizeof(lines) / sizeof(lines[0]))
+
+/* Totals of a pass, used to compare implementations */
+typedef struct totals
+{
+	long lines;
+	long control;
+	long utf8;
+} totals;
+
+
+/*
+ * Returns a monotonic timestamp in nanoseconds.
+ */
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/*
+ * Splits the buffer into lines the way the framer does.
+ */
+static void scan_buffer(const char *buf, size_t len, totals *t)
+{
+	scan_state st;
+	size_t pos = 0;
+	size_t n = 0;
+
+	memset(t, 0, sizeof(totals));
+	scan_reset(&st);
+	while (pos < len)
+	{
+		n = scan_line(&st, buf + pos, len - pos);
+		if (pos + n == len)
+			break;
+		t->lines++;
+		if (st.flags & SCAN_CONTROL)
+			t->control++;
+		if (st.flags & SCAN_UTF8)
+			t->utf8++;
+		scan_reset(&st);
+		pos += n + 1;
+	}
+}
+
+
+/*
+ * Splits the buffer into lines without looking at their contents.
+ */
+static void memchr_buffer(const char *buf, size_t len, totals *t)
+{
+	const char *cur = buf;
+	const char *end = buf + len;
+	const char *nl = NULL;
+
+	memset(t, 0, sizeof(totals));
+	while ((nl = memchr(cur, '\n', end - cur)) != NULL)
+	{
+		t->lines++;
+		cur = nl + 1;
+	}
+}
+
+
+int main(int argc, char *argv[])
+{
+	const char *name = NULL;
+	const char *line = NULL;
+	char *buf = NULL;
+	size_t size = 64;
+	size_t len = 0;
+	size_t l = 0;
+	int rounds = 10;
+	int i = 0;
+	int r = 0;
+	double start = 0;
+	double ns = 0;
+	totals ref;
+	totals t;
+
+	if (argc > 1)
+		size = atol(argv[1]);
+	if (argc > 2)
+		rounds = atoi(argv[2]);
+	size *= 1024 * 1024;
+
+	/* Fill the buffer with whole lines, in an ASCII heavy mix */
+	buf = (char *)malloc(size);
+	if (buf == NULL)
+	{
+		printf("Out of memory\n");
+		return 1;
+	}
+	for (i = 0; ; i++)
+	{
+		/* Every 16th line comes from the non-ASCII end of the list */
+		if (i % 16 == 15)
+			line = lines[5 + (i / 16) % (LINE_COUNT - 5)];
+		else
+			line = lines[i % 5];
+		l = strlen(line);
+		if (len + l > size)
+			break;
+		memcpy(buf + len, line, l);
+		len += l;
+	}
+
+	scan_select("scalar");
+	scan_buffer(buf, len, &ref);
+	printf("%.0f MB, %ld lines, %ld with control characters, %ld with invalid UTF-8\n\n",
+		len / 1048576.0, ref.lines, ref.control, ref.utf8);
+
+	start = now_ns();
+	for (r = 0; r < rounds; r++)
+		memchr_buffer(buf, len, &t);
+	ns = (now_ns() - start) / rounds;
+	printf("%-8s %8.2f GB/s  (line ends only)\n", "memchr", len / ns);
+
+	for (i = 0; (name = scan_get_impl_name(i)) != NULL; i++)
+	{
+		if (scan_select(name) != 0)
+		{
+			printf("%-8s      not supported by this CPU\n", name);
+			continue;
+		}
+
+		/* Every implementation must agree before its speed is of any interest */
+		scan_buffer(buf, len, &t);
+		if (memcmp(&t, &ref, sizeof(totals)) != 0)
+		{
+			printf("%s disagrees with scalar: %ld lines, %ld control, %ld UTF-8\n",
+				name, t.lines, t.control, t.utf8);
+			return 1;
+		}
+
+		start = now_ns();
+		for (r = 0; r < rounds; r++)
+			scan_buffer(buf, len, &t);
+		ns = (now_ns() - start) / rounds;
+		printf("%-8s %8.2f GB/s\n", name, len / ns);
+	}
+
+	free(buf);
+
+	return 0;
+}
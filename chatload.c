@@ -0,0 +1,609 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/*
+ * Load generator for CHATSRV. Connects a number of simulated telnet 
+ * clients, lets them chat at configurable rates and measures how long it
+ * takes until their messages arrive at the other clients. Results are 
+ * written as JSON, so that builds can be compared.
+ *
+ * Every message carries a marker with its send time. As all clients run
+ * on the same box, the receiving side can tell the end-to-end latency 
+ * from it. /who is timed by a private message the client sends to itself
+ * right after it, which arrives once the whole listing has been sent.
+ *
+ * Usage: ./chatload -h
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include "hist.h"
+
+#define MAX_THREADS     64        /* Max. number of load threads */
+#define MAX_EVENTS      256       /* Max. number of events per epoll_wait() */
+#define READ_SIZE       16384     /* Receive buffer of a client */
+#define WRITE_SIZE      512       /* Send buffer of a client */
+#define MARKER          "@lt "    /* Starts the timing info in a message */
+
+/* Kinds of traffic */
+#define KIND_BROADCAST  0
+#define KIND_MSG        1
+#define KIND_WHO        2
+#define KIND_COUNT      3
+
+/* Typedefs */
+typedef struct 
+{
+	char *ip;
+	int port;
+	int clients;
+	int threads;
+	double duration;
+	double warmup;
+	double drain;
+	double rate[KIND_COUNT];      /* Per client and second */
+	char *output;
+	int help;
+} load_params;
+
+/* A simulated chat client */
+typedef struct load_client
+{
+	int fd;
+	int id;
+	double next[KIND_COUNT];      /* When to send the next message, in ns */
+	char in[READ_SIZE];
+	size_t in_len;
+	char out[WRITE_SIZE];
+	size_t out_len;
+} load_client;
+
+/* A thread driving a share of the clients */
+typedef struct load_thread
+{
+	pthread_t thread;
+	int epoll_fd;
+	load_client *clients;
+	int count;
+	unsigned int seed;
+	unsigned long long sent[KIND_COUNT];
+	unsigned long long delivered[KIND_COUNT];
+	unsigned long long stalls;    /* Sends skipped, server not reading */
+	unsigned long long errors;
+	hist latency[KIND_COUNT];     /* In ns */
+} load_thread;
+
+
+/* Global vars */
+static load_params params;
+static load_thread threads[MAX_THREADS];
+static pthread_barrier_t start_barrier;
+static double start_ns;           /* Begin of the measurement */
+static const char *kind_names[KIND_COUNT] = { "broadcast", "msg", "who" };
+
+
+/* Function prototypes */
+static int parse_cmd_args(int argc, char *argv[]);
+static void display_help_page(void);
+static double now_ns(void);
+static int connect_client(load_client *lc);
+static void *load_thread_main(void *arg);
+static void send_line(load_thread *t, load_client *lc, int kind, const char *line, size_t len);
+static void send_traffic(load_thread *t, load_client *lc, double now);
+static void read_client(load_thread *t, load_client *lc, int measure);
+static void process_line(load_thread *t, char *line, size_t len, int measure);
+static void write_results(FILE *out, double elapsed);
+
+
+int main(int argc, char *argv[])
+{
+	FILE *out = stdout;
+	double elapsed = 0;
+	int i = 0;
+	int j = 0;
+
+	if ((parse_cmd_args(argc, argv) < 0) || params.help)
+	{
+		display_help_page();
+		exit(params.help ? 0 : 1);
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Deal the clients out to the threads */
+	pthread_barrier_init(&start_barrier, NULL, params.threads + 1);
+	for (i = 0; i < params.threads; i++)
+	{
+		threads[i].count = params.clients / params.threads + (i < params.clients % params.threads);
+		threads[i].clients = (load_client *)calloc(threads[i].count, sizeof(load_client));
+		threads[i].seed = i * 7919 + 1;
+		if (threads[i].clients == NULL)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		for (j = 0; j < threads[i].count; j++)
+			threads[i].clients[j].id = j * params.threads + i;
+		for (j = 0; j < KIND_COUNT; j++)
+			hist_init(&threads[i].latency[j]);
+	}
+
+	/* Connect everybody first, then let them chat */
+	for (i = 0; i < params.threads; i++)
+	{
+		if (pthread_create(&threads[i].thread, NULL, load_thread_main, &threads[i]) != 0)
+		{
+			fprintf(stderr, "Could not start thread %d\n", i);
+			exit(1);
+		}
+	}
+	pthread_barrier_wait(&start_barrier);
+	fprintf(stderr, "%d clients connected, warming up for %.1fs\n", params.clients, params.warmup);
+	start_ns = now_ns() + params.warmup * 1e9;
+	pthread_barrier_wait(&start_barrier);
+
+	for (i = 0; i < params.threads; i++)
+		pthread_join(threads[i].thread, NULL);
+	elapsed = params.duration;
+
+	if (params.output != NULL)
+	{
+		out = fopen(params.output, "w");
+		if (out == NULL)
+		{
+			fprintf(stderr, "Could not open %s: %s\n", params.output, strerror(errno));
+			exit(1);
+		}
+	}
+	write_results(out, elapsed);
+	if (out != stdout)
+		fclose(out);
+
+	return 0;
+}
+
+
+/*
+ * Parses the command line. Returns -1 on invalid arguments.
+ */
+static int parse_cmd_args(int argc, char *argv[])
+{
+	int option_index = 0;
+	int c;
+
+	params.ip = "127.0.0.1";
+	params.port = 5555;
+	params.clients = 100;
+	params.threads = 1;
+	params.duration = 10;
+	params.warmup = 1;
+	params.drain = 1;
+	params.rate[KIND_BROADCAST] = 1;
+	params.rate[KIND_MSG] = 0.5;
+	params.rate[KIND_WHO] = 0.05;
+	params.output = NULL;
+	params.help = 0;
+
+	static struct option long_options[] = 
+	{
+		{ "ip",			required_argument, 0, 'i' },
+		{ "port",		required_argument, 0, 'p' },
+		{ "clients",	required_argument, 0, 'c' },
+		{ "threads",	required_argument, 0, 't' },
+		{ "duration",	required_argument, 0, 'd' },
+		{ "warmup",		required_argument, 0, 'u' },
+		{ "broadcast",	required_argument, 0, 'b' },
+		{ "msg",		required_argument, 0, 'm' },
+		{ "who",		required_argument, 0, 'w' },
+		{ "output",		required_argument, 0, 'o' },
+		{ "help",		no_argument,       0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+
+	while ((c = getopt_long(argc, argv, "i:p:c:t:d:u:b:m:w:o:h", long_options, &option_index)) != -1)
+	{
+		switch (c)
+		{
+			case 'i': params.ip = optarg; break;
+			case 'p': params.port = atoi(optarg); break;
+			case 'c': params.clients = atoi(optarg); break;
+			case 't': params.threads = atoi(optarg); break;
+			case 'd': params.duration = atof(optarg); break;
+			case 'u': params.warmup = atof(optarg); break;
+			case 'b': params.rate[KIND_BROADCAST] = atof(optarg); break;
+			case 'm': params.rate[KIND_MSG] = atof(optarg); break;
+			case 'w': params.rate[KIND_WHO] = atof(optarg); break;
+			case 'o': params.output = optarg; break;
+			case 'h': params.help = 1; break;
+			default: return -1;
+		}
+	}
+
+	if ((params.port < 1) || (params.port > 65535) || (params.clients < 1) || 
+		(params.threads < 1) || (params.threads > MAX_THREADS) || (params.duration <= 0) ||
+		(params.warmup < 0) || (params.rate[KIND_BROADCAST] < 0) || (params.rate[KIND_MSG] < 0) ||
+		(params.rate[KIND_WHO] < 0))
+		return -1;
+	if (params.threads > params.clients)
+		params.threads = params.clients;
+
+	return 0;
+}
+
+
+/*
+ * Display help page.
+ */
+static void display_help_page(void)
+{
+	printf("Usage: chatload [options]\n\n");
+	printf("--ip=<ip address>, -i <ip address>  Address of the chat server. Default is 127.0.0.1.\n");
+	printf("--port=<port>, -p <port>            Port of the chat server. Default is 5555.\n");
+	printf("--clients=<count>, -c <count>       Number of simulated clients. Default is 100.\n");
+	printf("--threads=<count>, -t <count>       Number of load threads. Default is 1.\n");
+	printf("--duration=<secs>, -d <secs>        Length of the measurement. Default is 10.\n");
+	printf("--warmup=<secs>, -u <secs>          Time between connecting and measuring. Default is 1.\n");
+	printf("--broadcast=<rate>, -b <rate>       Broadcasts per client and second. Default is 1.\n");
+	printf("--msg=<rate>, -m <rate>             Private messages per client and second. Default is 0.5.\n");
+	printf("--who=<rate>, -w <rate>             /who requests per client and second. Default is 0.05.\n");
+	printf("--output=<file>, -o <file>          Writes the JSON results to a file instead of stdout.\n");
+	printf("--help, -h                          Displays this help page.\n");
+}
+
+
+/*
+ * Returns a monotonic timestamp in nanoseconds.
+ */
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/*
+ * Connects a client to the server and gives it a nickname. Returns -1 on
+ * errors.
+ */
+static int connect_client(load_client *lc)
+{
+	struct sockaddr_in addr;
+	char line[64];
+	int one = 1;
+	int len = 0;
+
+	lc->fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lc->fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(params.port);
+	addr.sin_addr.s_addr = inet_addr(params.ip);
+	if (connect(lc->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		close(lc->fd);
+		return -1;
+	}
+	setsockopt(lc->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	len = snprintf(line, sizeof(line), "/nick lg%d\r\n", lc->id);
+	if (send(lc->fd, line, len, 0) != len)
+		return -1;
+	fcntl(lc->fd, F_SETFL, fcntl(lc->fd, F_GETFL) | O_NONBLOCK);
+
+	return 0;
+}
+
+
+/*
+ * Thread entry point. Connects the clients of the thread, then has them 
+ * chat until the measurement is over.
+ */
+static void *load_thread_main(void *arg)
+{
+	load_thread *t = (load_thread *)arg;
+	struct epoll_event ev;
+	struct epoll_event events[MAX_EVENTS];
+	load_client *lc = NULL;
+	double now = 0;
+	double stop = 0;
+	int n = 0;
+	int i = 0;
+	int k = 0;
+
+	t->epoll_fd = epoll_create1(0);
+	for (i = 0; i < t->count; i++)
+	{
+		lc = &t->clients[i];
+		if (connect_client(lc) != 0)
+		{
+			fprintf(stderr, "Client %d could not connect: %s\n", lc->id, strerror(errno));
+			exit(1);
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = lc;
+		epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, lc->fd, &ev);
+	}
+	pthread_barrier_wait(&start_barrier);
+	pthread_barrier_wait(&start_barrier);
+
+	/* Spread the first messages over one interval each */
+	for (i = 0; i < t->count; i++)
+	{
+		for (k = 0; k < KIND_COUNT; k++)
+		{
+			if (params.rate[k] > 0)
+				t->clients[i].next[k] = start_ns + (rand_r(&t->seed) / (double)RAND_MAX) * 1e9 / params.rate[k];
+			else
+				t->clients[i].next[k] = -1;
+		}
+	}
+
+	/* Warm up, measure, then collect what is still in flight */
+	stop = start_ns + params.duration * 1e9;
+	while ((now = now_ns()) < stop + params.drain * 1e9)
+	{
+		n = epoll_wait(t->epoll_fd, events, MAX_EVENTS, 1);
+		for (i = 0; i < n; i++)
+			read_client(t, (load_client *)events[i].data.ptr, now >= start_ns);
+
+		now = now_ns();
+		if ((now >= start_ns) && (now < stop))
+		{
+			for (i = 0; i < t->count; i++)
+				send_traffic(t, &t->clients[i], now);
+		}
+	}
+
+	for (i = 0; i < t->count; i++)
+		close(t->clients[i].fd);
+	close(t->epoll_fd);
+
+	return NULL;
+}
+
+
+/*
+ * Sends a line, keeping what the socket does not take for later. If 
+ * output is still pending, the line is skipped.
+ */
+static void send_line(load_thread *t, load_client *lc, int kind, const char *line, size_t len)
+{
+	ssize_t ret = 0;
+
+	if (lc->out_len > 0)
+	{
+		ret = send(lc->fd, lc->out, lc->out_len, 0);
+		if (ret > 0)
+		{
+			memmove(lc->out, lc->out + ret, lc->out_len - ret);
+			lc->out_len -= ret;
+		}
+		if (lc->out_len > 0)
+		{
+			t->stalls++;
+			return;
+		}
+	}
+
+	ret = send(lc->fd, line, len, 0);
+	if (ret < 0)
+	{
+		if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+		{
+			t->errors++;
+			return;
+		}
+		ret = 0;
+	}
+	if ((size_t)ret < len)
+	{
+		memcpy(lc->out, line + ret, len - ret);
+		lc->out_len = len - ret;
+	}
+	t->sent[kind]++;
+}
+
+
+/*
+ * Sends whatever is due for a client.
+ */
+static void send_traffic(load_thread *t, load_client *lc, double now)
+{
+	char line[256];
+	int len = 0;
+	int peer = 0;
+
+	if ((lc->next[KIND_BROADCAST] >= 0) && (now >= lc->next[KIND_BROADCAST]))
+	{
+		len = snprintf(line, sizeof(line), "hello from lg%d " MARKER "%d %.0f\r\n", 
+			lc->id, KIND_BROADCAST, now);
+		send_line(t, lc, KIND_BROADCAST, line, len);
+		lc->next[KIND_BROADCAST] += 1e9 / params.rate[KIND_BROADCAST];
+	}
+
+	if ((lc->next[KIND_MSG] >= 0) && (now >= lc->next[KIND_MSG]))
+	{
+		peer = rand_r(&t->seed) % params.clients;
+		len = snprintf(line, sizeof(line), "/msg lg%d psst " MARKER "%d %.0f\r\n", 
+			peer, KIND_MSG, now);
+		send_line(t, lc, KIND_MSG, line, len);
+		lc->next[KIND_MSG] += 1e9 / params.rate[KIND_MSG];
+	}
+
+	if ((lc->next[KIND_WHO] >= 0) && (now >= lc->next[KIND_WHO]))
+	{
+		len = snprintf(line, sizeof(line), "/who\r\n/msg lg%d " MARKER "%d %.0f\r\n", 
+			lc->id, KIND_WHO, now);
+		send_line(t, lc, KIND_WHO, line, len);
+		lc->next[KIND_WHO] += 1e9 / params.rate[KIND_WHO];
+	}
+}
+
+
+/*
+ * Reads everything available on a client socket and processes the lines
+ * in it.
+ */
+static void read_client(load_thread *t, load_client *lc, int measure)
+{
+	char *cur = NULL;
+	char *nl = NULL;
+	ssize_t ret = 0;
+
+	while (1)
+	{
+		ret = recv(lc->fd, lc->in + lc->in_len, sizeof(lc->in) - lc->in_len, 0);
+		if (ret <= 0)
+		{
+			if ((ret < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+				return;
+			if (ret < 0 && errno == EINTR)
+				continue;
+			t->errors++;
+			epoll_ctl(t->epoll_fd, EPOLL_CTL_DEL, lc->fd, NULL);
+			return;
+		}
+		lc->in_len += ret;
+
+		cur = lc->in;
+		while ((nl = memchr(cur, '\n', lc->in + lc->in_len - cur)) != NULL)
+		{
+			*nl = '\0';
+			process_line(t, cur, nl - cur, measure);
+			cur = nl + 1;
+		}
+
+		/* Keep the incomplete line, unless it fills the whole buffer */
+		lc->in_len -= cur - lc->in;
+		if (lc->in_len == sizeof(lc->in))
+			lc->in_len = 0;
+		memmove(lc->in, cur, lc->in_len);
+	}
+}
+
+
+/*
+ * Records the latency of a message carrying a marker.
+ */
+static void process_line(load_thread *t, char *line, size_t len, int measure)
+{
+	char *marker = NULL;
+	char *end = NULL;
+	double sent = 0;
+	double now = 0;
+	int kind = 0;
+
+	marker = memmem(line, len, MARKER, strlen(MARKER));
+	if ((marker == NULL) || !measure)
+		return;
+
+	kind = (int)strtol(marker + strlen(MARKER), &end, 10);
+	sent = strtod(end, NULL);
+	if ((kind < 0) || (kind >= KIND_COUNT) || (sent <= 0))
+		return;
+
+	now = now_ns();
+	t->delivered[kind]++;
+	hist_record(&t->latency[kind], (unsigned long long)(now > sent ? now - sent : 0));
+}
+
+
+/*
+ * Writes the merged results of all threads as JSON.
+ */
+static void write_results(FILE *out, double elapsed)
+{
+	unsigned long long sent[KIND_COUNT];
+	unsigned long long delivered[KIND_COUNT];
+	unsigned long long stalls = 0;
+	unsigned long long errors = 0;
+	unsigned long long total = 0;
+	hist latency[KIND_COUNT];
+	int i = 0;
+	int k = 0;
+
+	for (k = 0; k < KIND_COUNT; k++)
+	{
+		sent[k] = 0;
+		delivered[k] = 0;
+		hist_init(&latency[k]);
+	}
+	for (i = 0; i < params.threads; i++)
+	{
+		for (k = 0; k < KIND_COUNT; k++)
+		{
+			sent[k] += threads[i].sent[k];
+			delivered[k] += threads[i].delivered[k];
+			hist_merge(&latency[k], &threads[i].latency[k]);
+		}
+		stalls += threads[i].stalls;
+		errors += threads[i].errors;
+	}
+	for (k = 0; k < KIND_COUNT; k++)
+		total += delivered[k];
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"clients\": %d,\n", params.clients);
+	fprintf(out, "  \"threads\": %d,\n", params.threads);
+	fprintf(out, "  \"duration_s\": %.1f,\n", elapsed);
+	fprintf(out, "  \"rates_per_client\": { \"broadcast\": %g, \"msg\": %g, \"who\": %g },\n",
+		params.rate[KIND_BROADCAST], params.rate[KIND_MSG], params.rate[KIND_WHO]);
+	fprintf(out, "  \"sent\": { \"broadcast\": %llu, \"msg\": %llu, \"who\": %llu },\n",
+		sent[KIND_BROADCAST], sent[KIND_MSG], sent[KIND_WHO]);
+	fprintf(out, "  \"expected\": { \"broadcast\": %llu, \"msg\": %llu, \"who\": %llu },\n",
+		sent[KIND_BROADCAST] * params.clients, sent[KIND_MSG], sent[KIND_WHO]);
+	fprintf(out, "  \"delivered\": { \"broadcast\": %llu, \"msg\": %llu, \"who\": %llu },\n",
+		delivered[KIND_BROADCAST], delivered[KIND_MSG], delivered[KIND_WHO]);
+	fprintf(out, "  \"delivered_per_sec\": %.0f,\n", total / elapsed);
+	fprintf(out, "  \"send_stalls\": %llu,\n", stalls);
+	fprintf(out, "  \"errors\": %llu,\n", errors);
+	fprintf(out, "  \"latency_us\": {\n");
+	for (k = 0; k < KIND_COUNT; k++)
+	{
+		fprintf(out, "    \"%s\": { \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f, \"mean\": %.1f }%s\n",
+			kind_names[k],
+			hist_percentile(&latency[k], 50) / 1000.0,
+			hist_percentile(&latency[k], 99) / 1000.0,
+			hist_percentile(&latency[k], 99.9) / 1000.0,
+			latency[k].max / 1000.0,
+			latency[k].count ? latency[k].sum / 1000.0 / latency[k].count : 0,
+			(k < KIND_COUNT - 1) ? "," : "");
+	}
+	fprintf(out, "  }\n");
+	fprintf(out, "}\n");
+}
@@ -17,11 +17,17 @@
  *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
  *****************************************************************************/
 
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -29,11 +35,26 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <signal.h>
-#include <regex.h>
 #include <getopt.h>
 #include <limits.h>
+#include <pthread.h>
 #include "log.h"
 #include "llist2.h"
+#include "worker.h"
+#include "uring.h"
+#include "cmd.h"
+#include "room.h"
+#include "history.h"
+#include "journal.h"
+#include "link.h"
+#include "upgrade.h"
+#include "flood.h"
+#include "framer.h"
+#include "metrics.h"
+#include "stats.h"
+#include "msg.h"
+#include "epoch.h"
+#include "pool.h"
 #include "bool.h"
 #include "colors.h"
 
@@ -41,7 +62,24 @@
 /* Define some constants */
 #define APP_NAME        "CHATSRV" /* Name of applicaton */
 #define APP_VERSION     "0.5"     /* Version of application */
-#define MAX_THREADS     1000      /* Max. number of concurrent chat sessions */
+#define MAX_CLIENTS     65536     /* Max. number of concurrent chat sessions */
+#define MAX_EVENTS      256       /* Max. number of events per epoll_wait() */
+#define RECV_BUFFER_SIZE 4096     /* Size of a single read from a client */
+#define MAX_LINE_LENGTH  4096     /* Upper limit for --maxline */
+#define HISTORY_LINES    15       /* Lines shown by /history without a count */
+#define JOURNAL_WARMUP   3600     /* Seconds of journal put back into the lobby history */
+#define TIMEOUT_MAX      86400    /* Upper limit for --idle, --ping, --stall and --defer-accept */
+#define BACKLOG_MAX      65535    /* Upper limit for --backlog */
+#define ACCEPT_BATCH     64       /* Max. connections accepted per listener event */
+
+/* Policies for clients whose send queue is full */
+#define SLOW_DROP_OLDEST   1      /* Drop the oldest queued messages */
+#define SLOW_DISCONNECT    2      /* Disconnect the client */
+#define SLOW_LAG           3      /* Skip new messages until drained */
+
+/* I/O backends */
+#define IO_BACKEND_SYSCALL 1      /* One send()/recv() per operation */
+#define IO_BACKEND_URING   2      /* Batched submissions through io_uring */
 
 
 /* Typedefs */
@@ -52,30 +90,161 @@ typedef struct
 	int help;
 	int loglevel;
 	int version;
+	int workers;
+	int pin;
+	int io;
+	int sendq;
+	int slow_policy;
+	int log_async;
+	int maxline;
+	int metrics;
+	int stats;
+	int history;
+	int replay;
+	char *journal;
+	int journal_sync;
+	int node;
+	int link_port;
+	char *peers[LINK_MAX_PEERS];
+	int peer_count;
+	int idle;
+	int ping;
+	int stall;
+	int backlog;
+	int defer_accept;
 } cmd_params;
 
+/* A /who or /rooms reply under construction */
+typedef struct
+{
+	client_info *ci;
+	int room;                     /* Room whose users are listed */
+	size_t len;
+	char buffer[1024];
+} client_list;
+
 
 /* Global vars */
 struct sockaddr_in server_address;
-int server_sockfd;
-int server_len, client_len;
+int server_len;
 cmd_params *params;
-struct list_entry list_start;
-int curr_thread_count = 0;
-pthread_mutex_t curr_thread_count_mutex = PTHREAD_MUTEX_INITIALIZER;
+int curr_client_count = 0;
+unsigned long last_conn_id = 0;
+worker *workers[MAX_WORKERS];
+int worker_count = 0;
+
+/* Sessions come from a pool, connection churn does not hit malloc */
+static pool client_pool = POOL_INITIALIZER("client_info", sizeof(client_info));
+
+/* Set by SIGUSR1, the next worker to wake up dumps the server state */
+static volatile sig_atomic_t dump_requested = 0;
+
+/* Set by SIGUSR2, worker 0 hands the server over to a new process */
+static volatile sig_atomic_t upgrade_requested = 0;
+
+/* Workers stop while the server is handed over, see pause_for_upgrade() */
+static pthread_mutex_t upgrade_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t upgrade_cond = PTHREAD_COND_INITIALIZER;
+static int upgrading = 0;
+static int parked = 0;
+
+/* Arguments the server was started with, a new process gets the same */
+static char **saved_argv = NULL;
+
+/* State inherited from the previous process on a hot upgrade */
+static int upgrade_sock = -1;
+static int inherited_listeners[MAX_WORKERS];
+static int inherited_count = 0;
+static int inherited_metrics = -1;
+static int inherited_link = -1;
+
+/* Given up to turn away a connection when descriptors run out */
+static int spare_fd = -1;
+
+/* Worker run by the calling thread */
+static __thread worker *current_worker = NULL;
+
+/* Tags identifying the non-client descriptors in an epoll set */
+static char listener_tag;
+static char wakeup_tag;
 
 
 /* Function prototypes */
 int startup_server(void);
+int open_outputs(void);
+int create_listener(void);
+int tune_listener(int sockfd);
 int parse_cmd_args(int *argc, char *argv[]);
-void proc_client(int *arg);
-void process_msg(char *message, int self_sockfd);
+void raise_fd_limit(void);
+void *worker_thread(void *arg);
+void run_event_loop(worker *w);
+void accept_clients(worker *w);
+int accept_client(worker *w);
+int refuse_client(worker *w);
+client_info* register_client(worker *w, int sockfd, struct sockaddr_in *address, const char *nickname, 
+	const char *room);
+void free_client(void *ci);
+int process_handoffs(worker *w);
+void deliver_local(worker *w, int room, msg *m);
+void finish_iteration(worker *w);
+int flush_client(client_info *ci);
+void flush_clients_batched(worker *w);
+void flush_completed(void *arg, unsigned long long user_data, int res);
+void check_lagged(client_info *ci);
+void publish_stats(worker *w);
+int handle_client_event(worker *w, client_info *ci, uint32_t events);
+int read_client(client_info *ci);
+int check_flood(client_info *ci);
+void flood_dropped(client_info *ci, const char *what);
+int get_flood_kind(int type);
+void pause_expired(void *arg);
+void idle_expired(void *arg);
+void arm_idle_timer(client_info *ci);
+void watch_output(client_info *ci, int wrote);
+void stall_expired(void *arg);
+void read_clients_batched(worker *w, client_info **ready, int count);
+void recv_completed(void *arg, unsigned long long user_data, int res);
+int feed_client(client_info *ci, char *buffer, size_t len);
+int process_line(void *arg, char *line, size_t len, int flags);
+void disconnect_client(client_info *ci);
+int process_msg(char *message, int self_sockfd);
+int send_to_client(client_info *ci, char *buffer, size_t len);
+int queue_msg(client_info *ci, msg *m);
 void send_welcome_msg(int sockfd);
-void send_broadcast_msg(char* format, ...);
+void send_client_list(client_info *ci);
+void append_client_list(list_entry *entry, void *arg);
+void send_room_list(client_info *ci);
+void append_room_list(const char *name, int members, void *arg);
+void append_list_item(client_list *list, const char *item);
+int join_room(client_info *ci, const char *name, size_t len);
+void send_broadcast_msg(int room, char* format, ...);
+void send_chat_msg(int room, char* format, ...);
+void broadcast_msg(int room, unsigned long generation, msg *m);
+int send_history(client_info *ci, int count, int quiet);
+int warm_up_history(void *arg, const journal_entry *entry);
 void send_private_msg(char* nickname, char* format, ...);
+void deliver_private(client_info *ci, msg *m);
+void set_default_nickname(client_info *ci);
+void rename_client(client_info *ci);
+void append_remote_user(const char *nick, int node, void *arg);
+void link_room_received(const char *room, size_t room_len, const char *text, size_t len, int chat);
+void link_private_received(const char *nick, const char *text, size_t len);
+void link_rename_requested(client_info *ci);
 void chomp(char *s);
-void change_nickname(char *oldnickname, char *newnickname);
+int change_nickname(client_info *ci, char *newnickname);
 void shutdown_server(int sig);
+void request_dump(int sig);
+void dump_server_state(void);
+void request_upgrade(int sig);
+void pause_for_upgrade(worker *w);
+void drain_inboxes(worker *w);
+int hot_upgrade(void);
+int send_state(int sock);
+int send_session(int sock, client_info *ci);
+int send_histories(int sock);
+int receive_listeners(int sock);
+int receive_sessions(int sock);
+client_info* restore_session(upgrade_record *rec, char *data, int fd);
 int get_client_info_idx_by_sockfd(int sockfd);
 int get_client_info_idx_by_nickname(char *nickname);
 void display_help_page(void);
@@ -83,6 +252,15 @@ void display_version_info(void);
 void show_gnu_banner(void);
 
 
+/* Events coming in from linked nodes */
+static const link_handlers handlers = 
+{
+	link_room_received,
+	link_private_received,
+	link_rename_requested
+};
+
+
 /*
  * Main program
  */
@@ -90,9 +268,6 @@ int main(int argc, char *argv[])
 {
 	int i = 0;
 	int ret = 0;
-	struct sockaddr_in client_address;
-	int client_sockfd = 0;
-	pthread_t threads[MAX_THREADS];
 			
 	/* Parse commandline args */
 	params = malloc(sizeof(cmd_params));
@@ -113,6 +288,44 @@ int main(int argc, char *argv[])
 			logline(LOG_ERROR, "Error: Invalid port range specified (-p)");
 		if (ret == -6)
 			logline(LOG_ERROR, "Error: Invalid log level option specified (-l).");
+		if (ret == -7)
+			logline(LOG_ERROR, "Error: Invalid number of workers specified (-w).");
+		if (ret == -8)
+			logline(LOG_ERROR, "Error: Invalid I/O backend specified (-I).");
+		if (ret == -9)
+			logline(LOG_ERROR, "Error: Invalid send queue limit specified (-q).");
+		if (ret == -10)
+			logline(LOG_ERROR, "Error: Invalid slow client policy specified (-s).");
+		if (ret == -11)
+			logline(LOG_ERROR, "Error: Invalid log mode specified (-L).");
+		if (ret == -12)
+			logline(LOG_ERROR, "Error: Invalid max. line length specified (-m).");
+		if (ret == -13)
+			logline(LOG_ERROR, "Error: Invalid metrics port specified (-M).");
+		if (ret == -14)
+			logline(LOG_ERROR, "Error: Invalid history size specified (-H).");
+		if (ret == -15)
+			logline(LOG_ERROR, "Error: Invalid number of replayed lines specified (-r).");
+		if (ret == -16)
+			logline(LOG_ERROR, "Error: Invalid journal sync policy specified (-F).");
+		if (ret == -17)
+			logline(LOG_ERROR, "Error: Invalid node id specified (-N).");
+		if (ret == -18)
+			logline(LOG_ERROR, "Error: Invalid link port specified (-k).");
+		if (ret == -19)
+			logline(LOG_ERROR, "Error: Too many peers specified (-E).");
+		if (ret == -20)
+			logline(LOG_ERROR, "Error: Invalid flood limits specified (-f).");
+		if (ret == -21)
+			logline(LOG_ERROR, "Error: Invalid idle timeout specified (-t).");
+		if (ret == -22)
+			logline(LOG_ERROR, "Error: Invalid ping interval specified (-g).");
+		if (ret == -23)
+			logline(LOG_ERROR, "Error: Invalid stall timeout specified (-o).");
+		if (ret == -24)
+			logline(LOG_ERROR, "Error: Invalid listen backlog specified (-B).");
+		if (ret == -25)
+			logline(LOG_ERROR, "Error: Invalid defer accept timeout specified (-D).");
 		logline(LOG_ERROR, "Use the -h option if you need help.");
 		exit(ret);
 	}
@@ -126,13 +339,28 @@ int main(int argc, char *argv[])
 		default: set_loglevel(LOG_ERROR);
 	}
 
-	/* Setup signal handler */
+	/* Setup signal handler. Writes to vanished clients must not kill
+	 * the server, therefore SIGPIPE is ignored.
+	 */
 	signal(SIGINT, shutdown_server);
 	signal(SIGTERM, shutdown_server);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGUSR1, request_dump);
+	signal(SIGUSR2, request_upgrade);
+	saved_argv = argv;
 	
 	/* Show banner and stuff */
 	show_gnu_banner();	
 
+	/* From here on, chat threads hand their log messages to a writer */
+	if (params->log_async && (log_start_async() != 0))
+		logline(LOG_ERROR, "Could not start the log writer, logging synchronously.");
+
+	/* The main thread counts from the start, sessions taken over on a hot
+	 * upgrade are set up before it runs worker 0
+	 */
+	metrics_register();
+
 	/* Startup the server listener */
 	if (startup_server() < 0)
 	{
@@ -149,91 +377,242 @@ int main(int argc, char *argv[])
 		case LOG_DEBUG: logline(LOG_INFO, "Log level set to DEBUG"); break;
 		default: logline(LOG_INFO, "Unknown log level specified"); break;
 	}
+	if (params->loglevel > LOG_COMPILE_LEVEL)
+		logline(LOG_INFO, "Debug messages are not compiled in, rebuild with DEBUG=1 to get them");
 	
-	/* Handle connections */
-	while (1)
+	/* Handle connections. Worker 0 runs on the main thread, all others
+	 * get a thread of their own.
+	 */
+	logline(LOG_INFO, "Waiting for incoming connections on %d worker(s)...", worker_count);
+	for (i = 1; i < worker_count; i++)
 	{
-		logline(LOG_INFO, "Waiting for incoming connection...");
-		
-		/* Accept a client connection */
-		client_len = sizeof(client_address);
-		client_sockfd = accept(server_sockfd, (struct sockaddr *)&client_address, (socklen_t *)&client_len);
+		if (pthread_create(&workers[i]->thread, NULL, worker_thread, workers[i]) != 0)
+		{
+			logline(LOG_ERROR, "Error: Could not start worker %d.", i);
+			exit(-1);
+		}
+	}
+	workers[0]->thread = pthread_self();
+	worker_thread(workers[0]);
+	
+	free(params);
+
+	return 0;
+}
+
+
+/* 
+ * Startup the server listeners, one per worker.
+ */
+int startup_server(void)
+{
+	struct epoll_event ev;
+	int listen_fd = 0;
+	int ret = 0;
+	int i = 0;
+	
+	/* Initialize client_info list */
+	llist_init();
+	room_init();
+	history_setup(params->history);
+	framer_setup(params->maxline);
+	logline(LOG_DEBUG, "startup_server(): Using %s line scanner", scan_get_impl());
+	raise_fd_limit();
+	spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+	/* A process started by a hot upgrade takes over the listeners of its
+	 * predecessor, there is no moment without one
+	 */
+	upgrade_sock = upgrade_inherited();
+	if ((upgrade_sock >= 0) && (receive_listeners(upgrade_sock) != 0))
+	{
+		logline(LOG_ERROR, "Could not take over the listeners of the previous process.");
+		return -9;
+	}
+
+	/* Workers register with the metrics as they start */
+	if ((params->metrics > 0) && (metrics_start(params->metrics, inherited_metrics) != 0))
+	{
+		logline(LOG_ERROR, "Could not serve metrics on port %d.", params->metrics);
+		return -5;
+	}
+
+	/* A process taking over leaves the stats segment and the journal to 
+	 * its predecessor until it has the sessions, see below
+	 */
+	if (upgrade_sock < 0)
+	{
+		ret = open_outputs();
+		if (ret != 0)
+			return ret;
+	}
+
+	/* Linked nodes see the users of this one from the start */
+	if ((params->node > 0) && 
+		(link_start(params->node, params->ip, params->link_port, inherited_link, 
+			params->peers, params->peer_count, &handlers) != 0))
+	{
+		logline(LOG_ERROR, "Could not start linking with other nodes.");
+		return -8;
+	}
 
-		if (client_sockfd > 0)
+	for (i = 0; i < params->workers; i++)
+	{
+		/* An inherited listener keeps its queue, but takes the backlog
+		 * and options given to this process
+		 */
+		if (i < inherited_count)
 		{
-			logline(LOG_INFO, "Server accepted new connection on socket id %d", client_sockfd);
-			
-			/* A connection between a client and the server has been established.
-			 * Now create a new thread and handover the client_sockfd
-			 */
-			pthread_mutex_lock(&curr_thread_count_mutex);
-			if (curr_thread_count < MAX_THREADS)
+			listen_fd = inherited_listeners[i];
+			if (tune_listener(listen_fd) != 0)
+				return -3;
+		}
+		else
+		{
+			listen_fd = create_listener();
+			if (listen_fd < 0)
+				return listen_fd;
+		}
+
+		workers[i] = worker_create(i, listen_fd);
+		if (workers[i] == NULL)
+		{
+			logline(LOG_DEBUG, "Error creating worker %d: %s", i, strerror(errno));
+			return -4;
+		}
+		worker_count++;
+
+		/* Set up the io_uring backend if requested. Kernels without 
+		 * support make us fall back to plain syscalls.
+		 */
+		if (params->io == IO_BACKEND_URING)
+		{
+			workers[i]->ring = uring_create(URING_ENTRIES);
+			if (workers[i]->ring != NULL)
 			{
-				/* Prepare client infos in handy structure */
-				client_info *ci = (client_info *)malloc(sizeof(client_info));
-				ci->sockfd = client_sockfd;
-				ci->address = client_address;
-				sprintf(ci->nickname, "anonymous_%d", client_sockfd);
-				
-				/* Add client info to linked list */
-				llist_insert(&list_start, ci);
-				llist_show(&list_start);
-				
-				/* Pass client info and invoke new thread */	
-				ret = pthread_create(&threads[curr_thread_count],
-					NULL,
-					(void *)&proc_client, 
-					(void *)&client_sockfd); /* only pass socket id ? */
-			
-				if (ret == 0)
-				{
-					pthread_detach(threads[curr_thread_count]);
-					curr_thread_count++;
-										
-					/* Notify server and clients */
-					logline(LOG_INFO, "User %s joined the chat.", ci->nickname);	
-					logline(LOG_DEBUG, "main(): Connections used: %d of %d", curr_thread_count, MAX_THREADS);
-				}
-				else
+				workers[i]->recv_buffers = (char *)malloc(MAX_EVENTS * RECV_BUFFER_SIZE);
+				workers[i]->send_msgs = (struct msghdr *)malloc(URING_ENTRIES * sizeof(struct msghdr));
+				workers[i]->send_iovs = (struct iovec *)malloc(URING_ENTRIES * OUTQ_IOV_MAX * sizeof(struct iovec));
+				if ((workers[i]->recv_buffers == NULL) || (workers[i]->send_msgs == NULL) || 
+					(workers[i]->send_iovs == NULL))
 				{
-					free(ci);
-					close(client_sockfd);
+					free(workers[i]->recv_buffers);
+					free(workers[i]->send_msgs);
+					free(workers[i]->send_iovs);
+					workers[i]->recv_buffers = NULL;
+					workers[i]->send_msgs = NULL;
+					workers[i]->send_iovs = NULL;
+					uring_destroy(workers[i]->ring);
+					workers[i]->ring = NULL;
 				}
 			}
+			if (workers[i]->ring == NULL)
+				logline(LOG_INFO, "io_uring not available, worker %d falls back to syscalls", i);
 			else
-			{
-				logline(LOG_ERROR, "Max. connections reached. Connection limit is %d. Connection dropped.", MAX_THREADS);
-				close(client_sockfd);
-			}
-			pthread_mutex_unlock(&curr_thread_count_mutex);
+				logline(LOG_DEBUG, "startup_server(): Worker %d uses io_uring", i);
 		}
-		else
+
+		/* Each worker owns a listener and its wakeup eventfd, both are
+		 * level-triggered and tagged to tell them apart from clients.
+		 */
+		ev.events = EPOLLIN;
+		ev.data.ptr = &listener_tag;
+		if (epoll_ctl(workers[i]->epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) != 0)
 		{
-			/* Connection could not be established. Post error and exit. */
-			perror(strerror(errno));
-			exit(-3);
+			logline(LOG_DEBUG, "Error calling epoll_ctl(): %s", strerror(errno));
+			return -4;
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = &wakeup_tag;
+		if (epoll_ctl(workers[i]->epoll_fd, EPOLL_CTL_ADD, workers[i]->wake_fd, &ev) != 0)
+		{
+			logline(LOG_DEBUG, "Error calling epoll_ctl(): %s", strerror(errno));
+			return -4;
 		}
 	}
-	
-	free(params);
+
+	/* The sessions of the previous process are served from here on. With
+	 * fewer workers than before, the listeners left over are closed.
+	 */
+	if (upgrade_sock >= 0)
+	{
+		for (i = params->workers; i < inherited_count; i++)
+			close(inherited_listeners[i]);
+		if (receive_sessions(upgrade_sock) != 0)
+		{
+			logline(LOG_ERROR, "Could not take over the sessions of the previous process.");
+			return -10;
+		}
+
+		/* The previous process is gone, ending now would drop everyone */
+		if (open_outputs() != 0)
+			logline(LOG_ERROR, "Carrying on without the stats segment or the journal.");
+	}
 
 	return 0;
 }
 
 
-/* 
- * Startup the server listener.
+/*
+ * Creates the shared stats segment and opens the journal. Recent lines of
+ * the journal go back into the lobby history before new ones are added, 
+ * unless the histories have been handed over by a hot upgrade. A new 
+ * process only gets here once the old one has stopped writing: the stats
+ * segment is recreated for the new pid, and a journal segment created 
+ * before the takeover would be left behind if it failed.
  */
-int startup_server(void)
+int open_outputs(void)
+{
+	int restored = 0;
+
+	if (params->stats && (stats_open(params->port, params->workers) != 0))
+	{
+		logline(LOG_ERROR, "Could not create the shared stats segment: %s", strerror(errno));
+		return -6;
+	}
+
+	if (params->journal != NULL)
+	{
+		if (upgrade_sock < 0)
+		{
+			journal_replay(params->journal, journal_now() - JOURNAL_WARMUP * 1000000000ULL, warm_up_history, &restored);
+			logline(LOG_INFO, "Restored %d line(s) of lobby history from the journal.", restored);
+		}
+		if (journal_open(params->journal, params->journal_sync) != 0)
+		{
+			logline(LOG_ERROR, "Could not open the journal in %s.", params->journal);
+			return -7;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * Creates a non-blocking listening socket. SO_REUSEPORT lets every worker
+ * bind its own listener to the same port and the kernel spreads incoming
+ * connections across them. It is set even for a single worker, so that a
+ * hot upgrade may start more workers next to the inherited listener.
+ */
+int create_listener(void)
 {
 	int optval = 1;
-	
-	/* Initialize client_info list */
-	llist_init(&list_start);
+	int sockfd = 0;
 	
 	/* Create socket */
-	server_sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (setsockopt(server_sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval) != 0)
+	sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sockfd < 0)
+	{
+		logline(LOG_DEBUG, "Error calling socket(): %s", strerror(errno));
+		return -1;
+	}
+	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval) != 0)
+	{
+		logline(LOG_DEBUG, "Error calling setsockopt(): %s", strerror(errno));
+		return -1;
+	}
+	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof optval) != 0)
 	{
 		logline(LOG_DEBUG, "Error calling setsockopt(): %s", strerror(errno));
 		return -1;
@@ -244,23 +623,74 @@ int startup_server(void)
 	server_address.sin_addr.s_addr = inet_addr(params->ip);
 	server_address.sin_port = htons(params->port);
 	server_len = sizeof(server_address);
-	if (bind(server_sockfd, (struct sockaddr *)&server_address, server_len) != 0)
+	if (bind(sockfd, (struct sockaddr *)&server_address, server_len) != 0)
 	{
 		logline(LOG_DEBUG, "Error calling bind(): %s", strerror(errno));
 		return -2;
 	}
 
 	/* Create a connection queue and wait for incoming connections */
-	if (listen(server_sockfd, 5) != 0)
+	if (tune_listener(sockfd) != 0)
+		return -3;
+
+	return sockfd;
+}
+
+
+/*
+ * Sets the accept queue of a listener to --backlog, the kernel caps it at
+ * net.core.somaxconn. Calling listen() again on a listening socket only 
+ * resizes the queue. With --defer-accept, connections are only reported 
+ * once the client has sent something, or the timeout has passed. 
+ * Listeners inherited from older processes may lack SO_REUSEPORT, which 
+ * the listeners of further workers need on it to bind next to them.
+ */
+int tune_listener(int sockfd)
+{
+	int optval = 1;
+
+	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof optval) != 0)
+	{
+		logline(LOG_DEBUG, "Error calling setsockopt(): %s", strerror(errno));
+		return -1;
+	}
+
+	optval = params->defer_accept;
+	if (setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &optval, sizeof optval) != 0)
+	{
+		logline(LOG_DEBUG, "Error calling setsockopt(): %s", strerror(errno));
+		return -1;
+	}
+
+	if (listen(sockfd, params->backlog) != 0)
 	{
 		logline(LOG_DEBUG, "Error calling listen(): %s", strerror(errno));
-		return -3;
+		return -1;
 	}
 
 	return 0;
 }
 
 
+/*
+ * Raises the soft limit of open file descriptors to the hard limit, since
+ * every chat session occupies one descriptor.
+ */
+void raise_fd_limit(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+		return;
+
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl) != 0)
+		logline(LOG_DEBUG, "Error calling setrlimit(): %s", strerror(errno));
+	else
+		logline(LOG_DEBUG, "raise_fd_limit(): Descriptor limit set to %lu", (unsigned long)rl.rlim_cur);
+}
+
+
 /*
  * Parse command line arguments and store them in a global struct.
  */
@@ -275,6 +705,27 @@ int parse_cmd_args(int *argc, char *argv[])
 	params->help = 0;
 	params->loglevel = LOG_INFO;
 	params->version = 0;
+	params->workers = 1;
+	params->pin = 0;
+	params->io = IO_BACKEND_SYSCALL;
+	params->sendq = 262144;
+	params->slow_policy = SLOW_DISCONNECT;
+	params->log_async = 1;
+	params->maxline = 1024;
+	params->metrics = 0;
+	params->stats = 0;
+	params->history = 65536;
+	params->replay = HISTORY_LINES;
+	params->journal = NULL;
+	params->journal_sync = JOURNAL_SYNC_SECOND;
+	params->node = 0;
+	params->link_port = 0;
+	params->peer_count = 0;
+	params->idle = 3600;
+	params->ping = 0;
+	params->stall = 60;
+	params->backlog = SOMAXCONN;
+	params->defer_accept = 0;
 
 	static struct option long_options[] = 
 	{
@@ -283,12 +734,34 @@ int parse_cmd_args(int *argc, char *argv[])
 		{ "help",		no_argument,       0, 'h' },
 		{ "version",	no_argument,       0, 'v' },
 		{ "loglevel",	required_argument, 0, 'l' },
+		{ "workers",	required_argument, 0, 'w' },
+		{ "pin",		no_argument,       0, 'P' },
+		{ "io",			required_argument, 0, 'I' },
+		{ "sendq",		required_argument, 0, 'q' },
+		{ "slow",		required_argument, 0, 's' },
+		{ "log",		required_argument, 0, 'L' },
+		{ "maxline",	required_argument, 0, 'm' },
+		{ "metrics",	required_argument, 0, 'M' },
+		{ "stats",		no_argument,       0, 'S' },
+		{ "history",	required_argument, 0, 'H' },
+		{ "replay",		required_argument, 0, 'r' },
+		{ "journal",	required_argument, 0, 'J' },
+		{ "fsync",		required_argument, 0, 'F' },
+		{ "node",		required_argument, 0, 'N' },
+		{ "link-port",	required_argument, 0, 'k' },
+		{ "peer",		required_argument, 0, 'E' },
+		{ "flood",		required_argument, 0, 'f' },
+		{ "idle",		required_argument, 0, 't' },
+		{ "ping",		required_argument, 0, 'g' },
+		{ "stall",		required_argument, 0, 'o' },
+		{ "backlog",	required_argument, 0, 'B' },
+		{ "defer-accept", required_argument, 0, 'D' },
 		{ 0, 0, 0, 0 }
 	};
 
 	while (1)
 	{
-		c = getopt_long(*argc, argv, "i:p:hvl:", long_options, &option_index);
+		c = getopt_long(*argc, argv, "i:p:hvl:w:PI:q:s:L:m:M:SH:r:J:F:N:k:E:f:t:g:o:B:D:", long_options, &option_index);
 
 		/* Detect the end of the options */
 		if (c == -1)
@@ -309,402 +782,1939 @@ int parse_cmd_args(int *argc, char *argv[])
 	            if ((params->loglevel < 1) || (params->loglevel > 3))
 	            	return -6;
 				break;
+			case 'w':
+				params->workers = atoi(optarg);
+				if ((params->workers < 1) || (params->workers > MAX_WORKERS))
+					return -7;
+				break;
+			case 'P': params->pin = 1; break;
+			case 'I':
+				if (strcmp(optarg, "syscall") == 0)
+					params->io = IO_BACKEND_SYSCALL;
+				else if (strcmp(optarg, "uring") == 0)
+					params->io = IO_BACKEND_URING;
+				else
+					return -8;
+				break;
+			case 'q':
+				params->sendq = atoi(optarg);
+				if (params->sendq < RECV_BUFFER_SIZE)
+					return -9;
+				break;
+			case 's':
+				if (strcmp(optarg, "drop") == 0)
+					params->slow_policy = SLOW_DROP_OLDEST;
+				else if (strcmp(optarg, "disconnect") == 0)
+					params->slow_policy = SLOW_DISCONNECT;
+				else if (strcmp(optarg, "lag") == 0)
+					params->slow_policy = SLOW_LAG;
+				else
+					return -10;
+				break;
+			case 'L':
+				if (strcmp(optarg, "sync") == 0)
+					params->log_async = 0;
+				else if (strcmp(optarg, "async") == 0)
+					params->log_async = 1;
+				else
+					return -11;
+				break;
+			case 'm':
+				params->maxline = atoi(optarg);
+				if ((params->maxline < 64) || (params->maxline > MAX_LINE_LENGTH))
+					return -12;
+				break;
+			case 'S': params->stats = 1; break;
+			case 'M':
+				params->metrics = atoi(optarg);
+				if ((params->metrics < 1) || (params->metrics > 65535))
+					return -13;
+				break;
+			case 'H':
+				params->history = atoi(optarg);
+				if (params->history < 0)
+					return -14;
+				break;
+			case 'r':
+				params->replay = atoi(optarg);
+				if ((params->replay < 0) || (params->replay > HISTORY_SLOTS))
+					return -15;
+				break;
+			case 'J': params->journal = optarg; break;
+			case 'F':
+				if (strcmp(optarg, "never") == 0)
+					params->journal_sync = JOURNAL_SYNC_NONE;
+				else if (strcmp(optarg, "second") == 0)
+					params->journal_sync = JOURNAL_SYNC_SECOND;
+				else if (strcmp(optarg, "batch") == 0)
+					params->journal_sync = JOURNAL_SYNC_BATCH;
+				else
+					return -16;
+				break;
+			case 'N':
+				params->node = atoi(optarg);
+				if ((params->node < 1) || (params->node > LINK_MAX_NODE))
+					return -17;
+				break;
+			case 'k':
+				params->link_port = atoi(optarg);
+				if ((params->link_port < 1) || (params->link_port > 65535))
+					return -18;
+				break;
+			case 'E':
+				if (params->peer_count >= LINK_MAX_PEERS)
+					return -19;
+				params->peers[params->peer_count++] = optarg;
+				break;
+			case 'f':
+				if (flood_setup(optarg) != 0)
+					return -20;
+				break;
+			case 't':
+				params->idle = atoi(optarg);
+				if ((params->idle < 0) || (params->idle > TIMEOUT_MAX))
+					return -21;
+				break;
+			case 'g':
+				params->ping = atoi(optarg);
+				if ((params->ping < 0) || (params->ping > TIMEOUT_MAX))
+					return -22;
+				break;
+			case 'o':
+				params->stall = atoi(optarg);
+				if ((params->stall < 0) || (params->stall > TIMEOUT_MAX))
+					return -23;
+				break;
+			case 'B':
+				params->backlog = atoi(optarg);
+				if ((params->backlog < 1) || (params->backlog > BACKLOG_MAX))
+					return -24;
+				break;
+			case 'D':
+				params->defer_accept = atoi(optarg);
+				if ((params->defer_accept < 0) || (params->defer_accept > TIMEOUT_MAX))
+					return -25;
+				break;
 		}
 	}
 
+	/* Links need to know who they are talking for */
+	if (((params->link_port > 0) || (params->peer_count > 0)) && (params->node == 0))
+		return -17;
+
 	return 0;
 }
 
 
 /*
- * This method is run on a per-connection basis in a separate thred.
+ * Thread entry point of a worker.
  */
-void proc_client(int *arg)
+void *worker_thread(void *arg)
 {
-	char buffer[1024];
-	char message[1024];
-	int ret = 0;
-	int len = 0;
-	int socklen = 0;
-	struct list_entry *list_entry;
-	fd_set readfds;
-	int sockfd = 0;
-	
-	/* Load associated client info */
-	sockfd = *arg;
-	list_entry = llist_find_by_sockfd(&list_start, sockfd);
-	
-	memset(message, 0, 1024);
-	FD_ZERO(&readfds);
-	FD_SET(sockfd, &readfds);
+	worker *w = (worker *)arg;
+	int cpu = 0;
 
-	/* Send welcome message */
-	send_welcome_msg(sockfd);
+	current_worker = w;
+	epoch_register();
+	metrics_register();
 
-	/* Announce to others using broadcast */
-	send_broadcast_msg("%sUser %s joined the chat.%s\r\n", color_magenta, list_entry->client_info->nickname, color_normal);
+	if (params->pin)
+	{
+		cpu = worker_get_cpu(w->id);
+		if ((cpu < 0) || (worker_pin(w, cpu) != 0))
+			logline(LOG_ERROR, "Could not pin worker %d to a CPU.", w->id);
+	}
+
+	run_event_loop(w);
+
+	return NULL;
+}
+
+
+/*
+ * Waits for events on the listener, the wakeup eventfd and all client 
+ * sockets of a worker and dispatches them. A single thread serves every 
+ * chat session owned by the worker this way.
+ */
+void run_event_loop(worker *w)
+{
+	struct epoll_event events[MAX_EVENTS];
+	client_info *ready[MAX_EVENTS];
+	int ready_count = 0;
+	client_info *ci = NULL;
+	long next = -1;
+	int timeout = -1;
+	int i = 0;
+	int n = 0;
 
-	/* Process requests */
 	while (1)
 	{
-		ret = select(FD_SETSIZE, &readfds, (fd_set *)0, 
-			(fd_set *)0, (struct timeval *) 0);
-		if (ret == -1)
+		/* Published statistics are refreshed even while nothing happens,
+		 * timers are run in time
+		 */
+		timeout = params->stats ? 1000 : -1;
+		next = timer_next(&w->timers);
+		if ((next >= 0) && ((timeout < 0) || (next < timeout)))
+			timeout = next;
+
+		/* Nothing read from the registry is held while waiting */
+		epoch_offline();
+		n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, timeout);
+		epoch_online();
+
+		/* One clock read per iteration serves all timers and budgets */
+		timer_run(&w->timers, timer_clock());
+		if (dump_requested && __sync_bool_compare_and_swap(&dump_requested, 1, 0))
+			dump_server_state();
+		if (n < 0)
 		{
-			logline(LOG_ERROR, "Error calling select() on thread.");
-			perror(strerror(errno));
+			if (errno == EINTR)
+				continue;
+			logline(LOG_ERROR, "Error calling epoll_wait(): %s", strerror(errno));
+			exit(-3);
 		}
-		else
-		{
-			/* Read data from stream */
-			memset(buffer, 0, 1024);
-			socklen = sizeof(list_entry->client_info->address);
-			len = recvfrom(sockfd, buffer, sizeof(buffer), 0, 
-				(struct sockaddr *)&list_entry->client_info->address, (socklen_t *)&socklen);
-
-			logline(LOG_DEBUG, "proc_client(): Receive buffer contents = %s", buffer);
 
-			/* Copy receive buffer to message buffer */
-			if (sizeof(message) - strlen(message) > strlen(buffer))
-			{
-				strcat(message, buffer);
-			}
-			
-			/* Check if message buffer contains a full message. A full message
-			 * is recognized by its terminating \n character. If a message
-			 * is found, process it and clear message buffer afterwards.
-			 */
-			char *pos = strstr(message, "\n");
-			if (pos != NULL)
-			{		  		
-				chomp(message);
-				logline(LOG_DEBUG, "proc_client(): Message buffer contents = %s", message);
-				logline(LOG_DEBUG, "proc_client(): Complete message received.");
-
-		  		/* Process message */
-		  		process_msg(message, sockfd);
-		  		memset(message, 0, 1024);	
-			}
+		ready_count = 0;
+		for (i = 0; i < n; i++)
+		{
+			if (events[i].data.ptr == &listener_tag)
+				accept_clients(w);
+			else if (events[i].data.ptr == &wakeup_tag)
+				process_handoffs(w);
 			else
 			{
-				logline(LOG_DEBUG, "proc_client(): Message buffer contents = %s", message);
-				logline(LOG_DEBUG, "proc_client(): Message still incomplete.");
+				ci = (client_info *)events[i].data.ptr;
+				if (handle_client_event(w, ci, events[i].events) > 0)
+					ready[ready_count++] = ci;
 			}
 		}
+
+		/* With io_uring, all readable clients are read in one go */
+		if (ready_count > 0)
+			read_clients_batched(w, ready, ready_count);
+
+		finish_iteration(w);
+		if (params->stats)
+			publish_stats(w);
+
+		/* Workers stop between two iterations for a hot upgrade */
+		if (__atomic_load_n(&upgrading, __ATOMIC_ACQUIRE) || ((w->id == 0) && upgrade_requested))
+			pause_for_upgrade(w);
 	}
 }
 
 
 /*
- * Process a chat message coming from a chat client.
+ * Completes a loop iteration: disconnects clients kicked out on the way,
+ * writes everything queued for the clients and frees clients that have
+ * been disconnected, once no other worker can still be looking at them.
  */
-void process_msg(char *message, int self_sockfd)
+void finish_iteration(worker *w)
 {
-	char buffer[1024];
-	regex_t regex_quit;
-	regex_t regex_nick;
-	regex_t regex_msg;
-	regex_t regex_me;
-	regex_t regex_who;
-	int ret;
-	char newnick[20];
-	char oldnick[20];
-	char priv_nick[20];
-	struct list_entry *list_entry = NULL;
-	struct list_entry *nick_list_entry = NULL;
-	struct list_entry *priv_list_entry = NULL;
-	int processed = FALSE;
-	size_t ngroups = 0;
-	size_t len = 0;
-	regmatch_t groups[3];
-	
-	memset(buffer, 0, 1024);
-	memset(newnick, 0, 20);
-	memset(oldnick, 0, 20);
-	memset(priv_nick, 0, 20);
-	
-	/* Load client info object */
-	list_entry = llist_find_by_sockfd(&list_start, self_sockfd);
-	
-	/* Remove \r\n from message */
-	chomp(message);
-	
-	/* Compile regex patterns */
-	regcomp(&regex_quit, "^/quit$", REG_EXTENDED);
-	regcomp(&regex_nick, "^/nick ([a-zA-Z0-9_]{1,19})$", REG_EXTENDED);
-	regcomp(&regex_msg, "^/msg ([a-zA-Z0-9_]{1,19}) (.*)$", REG_EXTENDED);
-	regcomp(&regex_me, "^/me (.*)$", REG_EXTENDED);
-	regcomp(&regex_who, "^/who$", REG_EXTENDED);
-
-	/* Check if user wants to quit */
-	ret = regexec(&regex_quit, message, 0, NULL, 0);
-	if (ret == 0)
-	{
-		/* Notify */
-		send_broadcast_msg("%sUser %s has left the chat server.%s\r\n", 
-			color_magenta, list_entry->client_info->nickname, color_normal);
-		logline(LOG_INFO, "User %s has left the chat server.", list_entry->client_info->nickname);
-		pthread_mutex_lock(&curr_thread_count_mutex);
-		curr_thread_count--;
-		logline(LOG_DEBUG, "process_msg(): Connections used: %d of %d", curr_thread_count, MAX_THREADS);
-		pthread_mutex_unlock(&curr_thread_count_mutex);
-
-		/* Remove entry from linked list */
-		logline(LOG_DEBUG, "process_msg(): Removing element with sockfd = %d", self_sockfd);
-		llist_remove_by_sockfd(&list_start, self_sockfd);
-
-		/* Disconnect client from server */
-		close(self_sockfd);
-
-		/* Free memory */
-		regfree(&regex_quit);
-		regfree(&regex_nick);
-		regfree(&regex_msg);
-		regfree(&regex_me);
-
-		/* Terminate this thread */		
-		pthread_exit(0);
-	}
-
-	/* Check if user wants to change nick */		
-	ngroups = 2;
-	ret = regexec(&regex_nick, message, ngroups, groups, 0);
-	if (ret == 0)
-	{
-		processed = TRUE;
-		
-		/* Extract nickname */
-		len = groups[1].rm_eo - groups[1].rm_so;
-		strncpy(newnick, message + groups[1].rm_so, len);
-		strcpy(oldnick, list_entry->client_info->nickname);
-		
-		strcpy(buffer, "User ");
-		strcat(buffer, oldnick);
-		strcat(buffer, " is now known as ");
-		strcat(buffer, newnick);
-							
-		/* Change nickname. Check if nickname already exists first. */
-		nick_list_entry = llist_find_by_nickname(&list_start, newnick);
-		if (nick_list_entry == NULL)
-		{
-			change_nickname(oldnick, newnick);
-			send_broadcast_msg("%s%s%s\r\n", color_yellow, buffer, color_normal);
-			logline(LOG_INFO, buffer);
-		}
-		else
-		{
-			send_private_msg(oldnick, "%sCHATSRV: Cannot change nickname. Nickname already in use.%s\r\n", 
-				color_yellow, color_normal);
-			logline(LOG_INFO, "Private message from CHATSRV to %s: Cannot change nickname. Nickname already in use", 
-				oldnick);
-		}
+	client_info *ci = NULL;
+	int i = 0;
+
+	/* Disconnecting may kick further clients, the set grows meanwhile */
+	for (i = 0; i < w->kicked.count; i++)
+	{
+		ci = w->kicked.items[i];
+		if (!(ci->flags & CLIENT_CLOSED))
+			disconnect_client(ci);
 	}
-	
-	/* Check if user wants to transmit a private message to another user */
-	ngroups = 3;
-	ret = regexec(&regex_msg, message, ngroups, groups, 0);
-	if (ret == 0)
+	w->kicked.count = 0;
+
+	/* Flush pending output */
+	if (w->ring != NULL)
 	{
-		processed = TRUE;
-		
-		/* Extract nickname and private message */
-		len = groups[1].rm_eo - groups[1].rm_so;
-		memcpy(priv_nick, message + groups[1].rm_so, len);
-		len = groups[2].rm_eo - groups[2].rm_so;
-		memcpy(buffer, message + groups[2].rm_so, len);
-		
-		/* Check if nickname exists. If yes, send private message to user. 
-		 * If not, ignore message.
-		 */
-		priv_list_entry = llist_find_by_nickname(&list_start, priv_nick);
-		if (priv_list_entry != NULL)
-		{
-			send_private_msg(priv_nick, "%s%s:%s %s%s%s\r\n", color_green, list_entry->client_info->nickname, 
-				color_normal, color_red, buffer, color_normal);
-			logline(LOG_INFO, "Private message from %s to %s: %s", 
-				list_entry->client_info->nickname, priv_nick, buffer);
-		}
+		flush_clients_batched(w);
 	}
-	
-	/* Check if user wants to say something about himself */
-	ngroups = 2;
-	ret = regexec(&regex_me, message, ngroups, groups, 0);
-	if (ret == 0)
+	else
 	{
-		processed = TRUE;
-		
-		strcpy(buffer, list_entry->client_info->nickname);
-		
-		/* Prepare message */
-		len = groups[1].rm_eo - groups[1].rm_so;
-		strcat(buffer, " ");
-		strncat(buffer, message + groups[1].rm_so, len);
-			
-		/* Broadcast message */
-		send_broadcast_msg("%s%s%s\r\n", color_cyan, buffer, color_normal);
-		logline(LOG_INFO, buffer);
+		for (i = 0; i < w->dirty.count; i++)
+		{
+			ci = w->dirty.items[i];
+			ci->flags &= ~CLIENT_DIRTY;
+			if (!(ci->flags & CLIENT_CLOSED))
+				flush_client(ci);
+		}
+		w->dirty.count = 0;
 	}
 
-	/* Check if user wants a listing of currently connected clients */
-	ret = regexec(&regex_who, message, 0, NULL, 0);
-	if (ret == 0)
+	/* Release disconnected clients */
+	while (w->dead != NULL)
 	{
-		processed = TRUE;
-
-		int socklen = sizeof(list_entry->client_info->address);
+		ci = w->dead;
+		w->dead = ci->next_dead;
+		outq_clear(&ci->outq);
+		close(ci->sockfd);
+		epoch_retire(ci, free_client);
+	}
+	epoch_reclaim();
+}
 
-		logline(LOG_INFO, "%s requested the client list", list_entry->client_info->nickname);
 
-		char **nicks = malloc(sizeof(*nicks) * 1000);
-		int i;
-		for (i = 0; i < 1000; i++)
-			nicks[i] = malloc(sizeof(**nicks) * 30);
-		int count = llist_get_nicknames(&list_start, nicks);
+/*
+ * Accepts the connections pending on the listener of a worker. At most
+ * ACCEPT_BATCH are taken per event, so that a reconnect storm cannot 
+ * starve the sessions. The listener is level-triggered and reported again
+ * in the next iteration while connections are left.
+ */
+void accept_clients(worker *w)
+{
+	int i = 0;
 
-		memset(buffer, 0, 1024);
-		for (i = 0; i < count; i++) {
-			sprintf(buffer, "%s%s%s%s", buffer, color_magenta, nicks[i], color_normal);
-			if(i != (count - 1)) sprintf(buffer, "%s, ", buffer);
-			if(i == (count - 1)) sprintf(buffer, "%s\r\n", buffer);
-			free(nicks[i]);
-		}
-		sendto(list_entry->client_info->sockfd, buffer, strlen(buffer), 0,
-				(struct sockaddr *)&(list_entry->client_info->address), (socklen_t)socklen);
-		free(nicks);
-	}
-	
-	/* Broadcast message */
-	if (processed == FALSE)
+	for (i = 0; i < ACCEPT_BATCH; i++)
 	{
-		send_broadcast_msg("%s%s:%s %s\r\n", color_green, list_entry->client_info->nickname, color_normal, message);
-		logline(LOG_INFO, "%s: %s", list_entry->client_info->nickname, message);
+		if (accept_client(w) != 0)
+			break;
 	}
-
-	/* Dump current user list */
-	llist_show(&list_start);
-	
-	/* Free memory */
-	regfree(&regex_quit);
-	regfree(&regex_nick);
-	regfree(&regex_msg);
-	regfree(&regex_me);
-	regfree(&regex_who);
 }
 
 
-/* 
- * Send a welcome message to the chat client after he has connected.
+/*
+ * Accepts a pending connection on the listener of a worker and registers
+ * the new client with its event loop. The socket is non-blocking from the
+ * start. Returns -1 once the queue is empty or nothing can be accepted.
+ */
+int accept_client(worker *w)
+{
+	struct sockaddr_in client_address;
+	socklen_t client_len = 0;
+	int client_sockfd = 0;
+	client_info *ci = NULL;
+
+	/* Accept a client connection */
+	client_len = sizeof(client_address);
+	client_sockfd = accept4(w->listen_fd, (struct sockaddr *)&client_address, &client_len, 
+		SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (client_sockfd < 0)
+	{
+		if ((errno == EINTR) || (errno == ECONNABORTED))
+			return 0;
+		if ((errno == EMFILE) || (errno == ENFILE))
+			return refuse_client(w);
+		if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+			logline(LOG_ERROR, "Error calling accept4(): %s", strerror(errno));
+		return -1;
+	}
+
+	logline(LOG_DEBUG, "Worker %d accepted new connection on socket id %d", w->id, client_sockfd);
+
+	if (curr_client_count >= MAX_CLIENTS)
+	{
+		logline(LOG_ERROR, "Max. connections reached. Connection limit is %d. Connection dropped.", MAX_CLIENTS);
+		metric_inc(METRIC_ACCEPT_DROPS);
+		close(client_sockfd);
+		return 0;
+	}
+
+	/* Every user starts out in the lobby */
+	ci = register_client(w, client_sockfd, &client_address, NULL, ROOM_LOBBY_NAME);
+	if (ci == NULL)
+	{
+		metric_inc(METRIC_ACCEPT_DROPS);
+		return 0;
+	}
+	metric_inc(METRIC_ACCEPTS);
+
+	/* Notify server and clients */
+	logline(LOG_INFO, "User %s joined the chat.", ci->nickname);	
+	logline(LOG_DEBUG, "accept_client(): Connections used: %d of %d", curr_client_count, MAX_CLIENTS);
+	send_welcome_msg(client_sockfd);
+	send_history(ci, params->replay, TRUE);
+	send_broadcast_msg(ci->room, "%sUser %s joined the chat.%s\r\n", color_magenta, ci->nickname, color_normal);
+
+	return 0;
+}
+
+
+/*
+ * Turns away a pending connection while the process is out of file 
+ * descriptors. Left in the queue, it would keep the level-triggered 
+ * listener ready and the worker spinning. The spare descriptor is closed
+ * to make room for accepting and closing the connection, then reopened.
+ * Returns -1 if that failed or another worker holds the spare.
+ */
+int refuse_client(worker *w)
+{
+	int client_sockfd = -1;
+	int fd = -1;
+
+	fd = __atomic_exchange_n(&spare_fd, -1, __ATOMIC_ACQ_REL);
+	if (fd < 0)
+		return -1;
+
+	close(fd);
+	client_sockfd = accept4(w->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (client_sockfd >= 0)
+	{
+		logline(LOG_ERROR, "Out of file descriptors. Connection dropped.");
+		metric_inc(METRIC_ACCEPT_DROPS);
+		close(client_sockfd);
+	}
+	__atomic_store_n(&spare_fd, open("/dev/null", O_RDONLY | O_CLOEXEC), __ATOMIC_RELEASE);
+
+	return (client_sockfd >= 0) ? 0 : -1;
+}
+
+
+/*
+ * Sets up a session for a connected socket and registers it with the 
+ * event loop of a worker, in the given room and under the given nickname,
+ * or a default one if nickname is NULL. Returns NULL and closes the 
+ * socket on errors.
+ */
+client_info* register_client(worker *w, int sockfd, struct sockaddr_in *address, const char *nickname, 
+	const char *room)
+{
+	struct epoll_event ev;
+	client_info *ci = NULL;
+
+	/* Prepare client infos in handy structure */
+	ci = (client_info *)pool_alloc(&client_pool);
+	if (ci == NULL)
+	{
+		logline(LOG_ERROR, "Out of memory. Connection dropped.");
+		close(sockfd);
+		return NULL;
+	}
+	memset(ci, 0, sizeof(client_info));
+	ci->sockfd = sockfd;
+	ci->address = *address;
+	ci->conn_id = __sync_add_and_fetch(&last_conn_id, 1);
+	if (nickname != NULL)
+		strcpy(ci->nickname, nickname);
+	else
+		set_default_nickname(ci);
+	ci->room = -1;
+	flood_init(ci->flood, timer_now(&w->timers));
+	ci->last_input = timer_now(&w->timers);
+	timer_init(&ci->idle_timer, idle_expired, ci);
+	timer_init(&ci->stall_timer, stall_expired, ci);
+	timer_init(&ci->pause_timer, pause_expired, ci);
+	outq_init(&ci->outq);
+	framer_init(&ci->framer);
+	if (worker_add_client(w, ci) != 0)
+	{
+		logline(LOG_ERROR, "Out of memory. Connection dropped.");
+		free_client(ci);
+		close(sockfd);
+		return NULL;
+	}
+
+	if (room_join(ci, room, strlen(room)) < 0)
+	{
+		logline(LOG_ERROR, "Out of memory. Connection dropped.");
+		worker_remove_client(w, ci);
+		free_client(ci);
+		close(sockfd);
+		return NULL;
+	}
+
+	/* Register socket with the event loop. Edge-triggered, so reads must
+	 * always drain the socket. EPOLLOUT reports when a socket that was
+	 * full can take queued output again.
+	 */
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = ci;
+	if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, sockfd, &ev) != 0)
+	{
+		logline(LOG_ERROR, "Error calling epoll_ctl(): %s", strerror(errno));
+		room_leave(ci);
+		worker_remove_client(w, ci);
+		free_client(ci);
+		close(sockfd);
+		return NULL;
+	}
+
+	/* Make the client visible to other users */
+	if (llist_insert(ci) != 0)
+	{
+		logline(LOG_ERROR, "Out of memory. Connection dropped.");
+		epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, sockfd, NULL);
+		room_leave(ci);
+		worker_remove_client(w, ci);
+		free_client(ci);
+		close(sockfd);
+		return NULL;
+	}
+	__sync_add_and_fetch(&curr_client_count, 1);
+	link_user(ci->nickname, room);
+	arm_idle_timer(ci);
+
+	return ci;
+}
+
+
+/*
+ * Returns the memory of a session to its pool.
+ */
+void free_client(void *ci)
+{
+	framer_clear(&((client_info *)ci)->framer);
+	pool_free(&client_pool, ci);
+}
+
+
+/*
+ * Delivers messages handed over by other workers to the sessions owned
+ * by this worker. Returns the number of handoffs taken from the inbox.
+ */
+int process_handoffs(worker *w)
+{
+	handoff *h = NULL;
+	handoff *next = NULL;
+	client_info *ci = NULL;
+	int count = 0;
+
+	h = worker_take_inbox(w);
+	while (h != NULL)
+	{
+		next = h->next;
+
+		if (h->type == HANDOFF_BROADCAST)
+		{
+			/* The room may have been freed in the meantime */
+			if (room_get_generation(h->room) == h->generation)
+				deliver_local(w, h->room, h->msg);
+		}
+		else if (h->type == HANDOFF_PRIVATE)
+		{
+			/* Recipient may have left in the meantime */
+			ci = llist_find_by_sockfd(h->sockfd);
+			if ((ci != NULL) && (ci->conn_id == h->conn_id) && (ci->worker_id == w->id))
+				queue_msg(ci, h->msg);
+		}
+		else if (h->type == HANDOFF_RENAME)
+		{
+			ci = llist_find_by_sockfd(h->sockfd);
+			if ((ci != NULL) && (ci->conn_id == h->conn_id) && (ci->worker_id == w->id))
+				rename_client(ci);
+		}
+
+		handoff_free(h);
+		h = next;
+		count++;
+	}
+
+	return count;
+}
+
+
+/*
+ * Handles readiness events reported for a client socket. With io_uring,
+ * reading is left to the caller and 1 is returned for readable clients.
+ */
+int handle_client_event(worker *w, client_info *ci, uint32_t events)
+{
+	if (ci->flags & CLIENT_CLOSED)
+		return 0;
+
+	/* Socket can take more output */
+	if ((events & EPOLLOUT) && (ci->outq.bytes > 0))
+		worker_mark_dirty(w, ci);
+
+	/* Input stays in the socket until the budget allows for more */
+	if (ci->flags & CLIENT_PAUSED)
+		return 0;
+
+	if (events & EPOLLIN)
+	{
+		if (w->ring != NULL)
+			return 1;
+
+		/* read_client() detects EOF and errors itself */
+		read_client(ci);
+		return 0;
+	}
+
+	if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+	{
+		disconnect_client(ci);
+	}
+
+	return 0;
+}
+
+
+/*
+ * Reads all available data from a client socket and processes complete
+ * messages. Returns -1 if the client has been disconnected.
+ */
+int read_client(client_info *ci)
+{
+	char buffer[RECV_BUFFER_SIZE];
+	ssize_t len = 0;
+
+	while (1)
+	{
+		if (check_flood(ci) != 0)
+			return 0;
+
+		/* Read data from stream */
+		len = recv(ci->sockfd, buffer, sizeof(buffer), 0);
+		if (len < 0)
+		{
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				return 0;
+			if (errno == EINTR)
+				continue;
+			logline(LOG_DEBUG, "read_client(): Error calling recv(): %s", strerror(errno));
+			disconnect_client(ci);
+			return -1;
+		}
+		if (len == 0)
+		{
+			/* Peer closed the connection */
+			disconnect_client(ci);
+			return -1;
+		}
+		metric_add(METRIC_BYTES_IN, len);
+		flood_charge(ci->flood, FLOOD_BYTES, len, timer_now(&current_worker->timers));
+
+		if (feed_client(ci, buffer, len) < 0)
+			return -1;
+	}
+}
+
+
+/*
+ * Pauses reading from a client that has used up its budget of lines or
+ * bytes. Whatever it sends meanwhile waits in the socket, a client that 
+ * keeps flooding fills it up and gets stalled by TCP. Returns -1 if the
+ * client is paused.
+ */
+int check_flood(client_info *ci)
+{
+	unsigned long long now = timer_now(&current_worker->timers);
+	long wait = 0;
+	long bytes_wait = 0;
+
+	wait = flood_wait(ci->flood, FLOOD_LINES, now);
+	bytes_wait = flood_wait(ci->flood, FLOOD_BYTES, now);
+	if (bytes_wait > wait)
+		wait = bytes_wait;
+	if (wait == 0)
+		return 0;
+
+	logline(LOG_DEBUG, "check_flood(): Pausing socket id %d for %ld ms", ci->sockfd, wait);
+	ci->flags |= CLIENT_PAUSED;
+	timer_set(&current_worker->timers, &ci->pause_timer, wait);
+	metric_inc(METRIC_FLOOD_PAUSES);
+
+	return -1;
+}
+
+
+/*
+ * Reads again from a paused client whose budget has recovered.
+ */
+void pause_expired(void *arg)
+{
+	client_info *ci = (client_info *)arg;
+
+	ci->flags &= ~CLIENT_PAUSED;
+	read_client(ci);
+}
+
+
+/*
+ * Disconnects a client that has not sent anything for too long, and pings
+ * one that has been quiet for a while. A ping is a write, so a peer that
+ * has vanished is noticed by TCP and then by the stall timeout.
+ */
+void idle_expired(void *arg)
+{
+	client_info *ci = (client_info *)arg;
+	unsigned long long now = timer_now(&current_worker->timers);
+	unsigned long long silent = now - ci->last_input;
+	char notice[128];
+
+	if ((params->idle > 0) && (silent >= params->idle * 1000ULL))
+	{
+		snprintf(notice, sizeof(notice), "%sCHATSRV: Disconnected after %d seconds without input.%s\r\n", 
+			color_yellow, params->idle, color_normal);
+		send_to_client(ci, notice, strlen(notice));
+		flush_client(ci);
+		logline(LOG_INFO, "User %s has been idle for too long, disconnecting.", ci->nickname);
+		metric_inc(METRIC_TIMEOUTS);
+		worker_mark_kicked(current_worker, ci);
+		return;
+	}
+
+	if ((params->ping > 0) && (silent >= params->ping * 1000ULL) && 
+		(now - ci->last_ping >= params->ping * 1000ULL))
+	{
+		snprintf(notice, sizeof(notice), "%sCHATSRV: Ping.%s\r\n", color_yellow, color_normal);
+		send_to_client(ci, notice, strlen(notice));
+		ci->last_ping = now;
+	}
+
+	arm_idle_timer(ci);
+}
+
+
+/*
+ * Arms the idle timer of a client for the next idle check or ping due.
+ */
+void arm_idle_timer(client_info *ci)
+{
+	unsigned long long now = timer_now(&current_worker->timers);
+	unsigned long long due = 0;
+	unsigned long long ping = 0;
+
+	if (params->idle > 0)
+		due = ci->last_input + params->idle * 1000ULL;
+	if (params->ping > 0)
+	{
+		ping = ((ci->last_ping > ci->last_input) ? ci->last_ping : ci->last_input) + params->ping * 1000ULL;
+		if ((due == 0) || (ping < due))
+			due = ping;
+	}
+	if (due == 0)
+		return;
+
+	timer_set(&current_worker->timers, &ci->idle_timer, (due > now) ? due - now : 0);
+}
+
+
+/*
+ * Watches the output of a client after a flush. Output that makes no 
+ * progress starts the stall timer, wrote tells whether bytes went out.
+ */
+void watch_output(client_info *ci, int wrote)
+{
+	if (params->stall == 0)
+		return;
+
+	if (wrote || !timer_pending(&ci->stall_timer))
+		ci->last_drain = timer_now(&current_worker->timers);
+	if ((ci->outq.bytes > 0) && !timer_pending(&ci->stall_timer))
+		timer_set(&current_worker->timers, &ci->stall_timer, params->stall * 1000UL);
+}
+
+
+/*
+ * Disconnects a client whose output has not drained for too long, it has
+ * stopped reading or vanished without a trace.
+ */
+void stall_expired(void *arg)
+{
+	client_info *ci = (client_info *)arg;
+	unsigned long long now = timer_now(&current_worker->timers);
+	unsigned long long limit = params->stall * 1000ULL;
+
+	if (ci->outq.bytes == 0)
+		return;
+
+	if (now - ci->last_drain < limit)
+	{
+		timer_set(&current_worker->timers, &ci->stall_timer, ci->last_drain + limit - now);
+		return;
+	}
+
+	logline(LOG_INFO, "Output to user %s has stalled, disconnecting.", ci->nickname);
+	metric_inc(METRIC_TIMEOUTS);
+	worker_mark_kicked(current_worker, ci);
+}
+
+
+/*
+ * Counts a line dropped over a budget and tells the client, at most once
+ * a second.
+ */
+void flood_dropped(client_info *ci, const char *what)
+{
+	unsigned long long now = timer_now(&current_worker->timers);
+	char notice[128];
+
+	metric_inc(METRIC_FLOOD_DROPS);
+	logline(LOG_DEBUG, "flood_dropped(): Dropped %s from socket id %d", what, ci->sockfd);
+	if (now - ci->flood_notice < 1000)
+		return;
+
+	ci->flood_notice = now;
+	snprintf(notice, sizeof(notice), "%sCHATSRV: You are sending too fast, %s dropped.%s\r\n", 
+		color_yellow, what, color_normal);
+	send_to_client(ci, notice, strlen(notice));
+}
+
+
+/*
+ * Returns the budget a command is charged to, -1 if none.
+ */
+int get_flood_kind(int type)
+{
+	switch (type)
+	{
+		case CMD_QUIT: return -1;
+		case CMD_MSG: return FLOOD_MSG;
+		case CMD_WHO:
+		case CMD_ROOMS:
+		case CMD_HISTORY: return FLOOD_WHO;
+		default: return FLOOD_CHAT;
+	}
+}
+
+
+/*
+ * Reads from a batch of readable clients through the io_uring of the
+ * worker. One receive per client is submitted with a single system call.
+ * Clients that filled their buffer are read again in another round, since
+ * their socket may hold more data.
+ */
+void read_clients_batched(worker *w, client_info **ready, int count)
+{
+	int results[MAX_EVENTS];
+	char *buffer = NULL;
+	int i = 0;
+	int n = 0;
+
+	while (count > 0)
+	{
+		for (i = 0; i < count; i++)
+		{
+			if ((ready[i]->flags & CLIENT_CLOSED) || (check_flood(ready[i]) != 0))
+				results[i] = -EAGAIN;
+			else
+				uring_prep_recv(w->ring, ready[i]->sockfd, w->recv_buffers + i * RECV_BUFFER_SIZE, 
+					RECV_BUFFER_SIZE, i);
+		}
+		if (uring_submit_and_wait(w->ring, recv_completed, results) < 0)
+		{
+			/* Ring is unusable, read the old-fashioned way */
+			for (i = 0; i < count; i++)
+			{
+				if (!(ready[i]->flags & CLIENT_CLOSED))
+					read_client(ready[i]);
+			}
+			return;
+		}
+
+		n = 0;
+		for (i = 0; i < count; i++)
+		{
+			if ((results[i] == -EAGAIN) || (results[i] == -EWOULDBLOCK))
+				continue;
+			if (results[i] == -EINTR)
+			{
+				ready[n++] = ready[i];
+				continue;
+			}
+			if (results[i] <= 0)
+			{
+				/* Peer closed the connection or error */
+				disconnect_client(ready[i]);
+				continue;
+			}
+
+			buffer = w->recv_buffers + i * RECV_BUFFER_SIZE;
+			metric_add(METRIC_BYTES_IN, results[i]);
+			flood_charge(ready[i]->flood, FLOOD_BYTES, results[i], timer_now(&current_worker->timers));
+			if (feed_client(ready[i], buffer, results[i]) < 0)
+				continue;
+			if (results[i] == RECV_BUFFER_SIZE)
+				ready[n++] = ready[i];
+		}
+		count = n;
+	}
+}
+
+
+/*
+ * Stores the result of a batched receive.
+ */
+void recv_completed(void *arg, unsigned long long user_data, int res)
+{
+	int *results = (int *)arg;
+
+	results[user_data] = res;
+}
+
+
+/*
+ * Passes received data to the line framer of a client, which processes
+ * every line completed by it. Returns -1 if the client has been 
+ * disconnected.
+ */
+int feed_client(client_info *ci, char *buffer, size_t len)
+{
+	logline(LOG_DEBUG, "feed_client(): Received %d bytes from socket id %d", (int)len, ci->sockfd);
+
+	return framer_feed(&ci->framer, buffer, len, process_line, ci);
+}
+
+
+/*
+ * Processes a line received from a client. Lines that are too long or 
+ * carry control characters or invalid UTF-8 are refused, so clients
+ * cannot mess with the terminals of others. Returns -1 if the client has
+ * been disconnected.
+ */
+int process_line(void *arg, char *line, size_t len, int flags)
+{
+	client_info *ci = (client_info *)arg;
+	char notice[128];
+
+	/* A command may have gotten the client kicked out */
+	if (ci->flags & (CLIENT_CLOSED | CLIENT_KICKED))
+		return -1;
+	metric_inc(METRIC_MSGS_IN);
+	ci->lines++;
+	ci->last_input = timer_now(&current_worker->timers);
+
+	/* Lines read beyond the budget are dropped, reading pauses before 
+	 * the next chunk
+	 */
+	if (!flood_allow(ci->flood, FLOOD_LINES, timer_now(&current_worker->timers)))
+	{
+		flood_dropped(ci, "line");
+		return 0;
+	}
+
+	if (flags & FRAMER_TOO_LONG)
+	{
+		logline(LOG_DEBUG, "process_line(): Dropped too long line from socket id %d", ci->sockfd);
+		snprintf(notice, sizeof(notice), "%sCHATSRV: Line too long, the limit is %d characters.%s\r\n", 
+			color_yellow, (int)framer_max_line(), color_normal);
+		send_to_client(ci, notice, strlen(notice));
+		return 0;
+	}
+	if (flags & (SCAN_CONTROL | SCAN_UTF8))
+	{
+		logline(LOG_DEBUG, "process_line(): Dropped line with %s from socket id %d", 
+			(flags & SCAN_CONTROL) ? "control characters" : "invalid UTF-8", ci->sockfd);
+		snprintf(notice, sizeof(notice), "%sCHATSRV: Line dropped, it contains control characters or invalid UTF-8.%s\r\n", 
+			color_yellow, color_normal);
+		send_to_client(ci, notice, strlen(notice));
+		return 0;
+	}
+
+	logline(LOG_DEBUG, "process_line(): Complete message received = %s", line);
+
+	return process_msg(line, ci->sockfd);
+}
+
+
+/*
+ * Removes a client from the chat server, notifies the remaining users and
+ * releases all resources held by the session. The session itself is freed
+ * at the end of the loop iteration.
+ */
+void disconnect_client(client_info *ci)
+{
+	int sockfd = ci->sockfd;
+
+	/* Remove the session from the registry and mark it closed first. It
+	 * is still a member of its room when the farewell goes out, but 
+	 * queue_msg() skips closed sessions, so it does not get it itself.
+	 */
+	logline(LOG_DEBUG, "disconnect_client(): Removing element with sockfd = %d", sockfd);
+	llist_remove(ci);
+	worker_remove_client(current_worker, ci);
+	timer_cancel(&current_worker->timers, &ci->idle_timer);
+	timer_cancel(&current_worker->timers, &ci->stall_timer);
+	timer_cancel(&current_worker->timers, &ci->pause_timer);
+	worker_mark_dead(current_worker, ci);
+	__sync_sub_and_fetch(&curr_client_count, 1);
+	metric_inc(METRIC_DISCONNECTS);
+	logline(LOG_DEBUG, "disconnect_client(): Connections used: %d of %d", curr_client_count, MAX_CLIENTS);
+
+	/* Notify the room, then leave it */
+	send_broadcast_msg(ci->room, "%sUser %s has left the chat server.%s\r\n", 
+		color_magenta, ci->nickname, color_normal);
+	logline(LOG_INFO, "User %s has left the chat server.", ci->nickname);
+	link_part(ci->nickname);
+	room_leave(ci);
+
+	/* Stop watching the socket. It is closed once the session is freed,
+	 * so its id cannot be reused while the session is still around.
+	 */
+	epoll_ctl(current_worker->epoll_fd, EPOLL_CTL_DEL, sockfd, NULL);
+	shutdown(sockfd, SHUT_RDWR);
+}
+
+
+/*
+ * Process a chat message coming from a chat client. Returns -1 if the 
+ * client has left the chat server.
+ */
+int process_msg(char *message, int self_sockfd)
+{
+	char buffer[MAX_LINE_LENGTH + 32];
+	char newnick[20];
+	char oldnick[20];
+	char priv_nick[20];
+	client_info *self = NULL;
+	command cmd;
+	unsigned long long start = 0;
+	int kind = 0;
+	
+	memset(buffer, 0, sizeof(buffer));
+	memset(newnick, 0, 20);
+	memset(oldnick, 0, 20);
+	memset(priv_nick, 0, 20);
+	
+	/* Load client info object */
+	self = llist_find_by_sockfd(self_sockfd);
+	
+	/* Remove \r\n from message */
+	chomp(message);
+	
+	/* Plain chat lines are recognized by their first byte and bypass
+	 * the command parser.
+	 */
+	start = metric_clock();
+	cmd_parse(message, strlen(message), &cmd);
+	metric_time(METRIC_PARSE_TIME, start);
+	metric_inc(METRIC_CMD_BASE + cmd.type);
+
+	/* Every kind of command has a budget of its own, so a flood of one
+	 * kind cannot be multiplied by the number of users
+	 */
+	kind = get_flood_kind(cmd.type);
+	if ((kind >= 0) && !flood_allow(self->flood, kind, timer_now(&current_worker->timers)))
+	{
+		flood_dropped(self, (kind == FLOOD_WHO) ? "request" : "message");
+		return 0;
+	}
+
+	switch (cmd.type)
+	{
+		/* User wants to quit */
+		case CMD_QUIT:
+			/* Notify others and disconnect client from server */
+			disconnect_client(self);
+			return -1;
+
+		/* User wants to change nick */
+		case CMD_NICK:
+			/* Extract nickname */
+			memcpy(newnick, cmd.nick, cmd.nick_len);
+			strcpy(oldnick, self->nickname);
+			
+			strcpy(buffer, "User ");
+			strcat(buffer, oldnick);
+			strcat(buffer, " is now known as ");
+			strcat(buffer, newnick);
+								
+			/* Change nickname, unless it already exists here or on a linked 
+			 * node 
+			 */
+			if ((link_find_user(newnick) == 0) && (change_nickname(self, newnick) == 0))
+			{
+				link_nick(oldnick, newnick);
+				send_broadcast_msg(self->room, "%s%s%s\r\n", color_yellow, buffer, color_normal);
+				logline(LOG_INFO, "%s", buffer);
+			}
+			else
+			{
+				send_private_msg(oldnick, "%sCHATSRV: Cannot change nickname. Nickname already in use.%s\r\n", 
+					color_yellow, color_normal);
+				logline(LOG_INFO, "Private message from CHATSRV to %s: Cannot change nickname. Nickname already in use", 
+					oldnick);
+			}
+			break;
+	
+		/* User wants to transmit a private message to another user */
+		case CMD_MSG:
+			/* Extract nickname and private message */
+			memcpy(priv_nick, cmd.nick, cmd.nick_len);
+			memcpy(buffer, cmd.text, cmd.text_len);
+			
+			/* Check if nickname exists. If yes, send private message to user. 
+			 * If not, ignore message.
+			 */
+			if ((llist_find_by_nickname(priv_nick) != NULL) || (link_find_user(priv_nick) != 0))
+			{
+				send_private_msg(priv_nick, "%s%s:%s %s%s%s\r\n", color_green, self->nickname, 
+					color_normal, color_red, buffer, color_normal);
+				logline(LOG_INFO, "Private message from %s to %s: %s", 
+					self->nickname, priv_nick, buffer);
+			}
+			break;
+	
+		/* User wants to say something about himself */
+		case CMD_ME:
+			strcpy(buffer, self->nickname);
+			
+			/* Prepare message */
+			strcat(buffer, " ");
+			strncat(buffer, cmd.text, cmd.text_len);
+				
+			/* Broadcast message */
+			send_chat_msg(self->room, "%s%s%s\r\n", color_cyan, buffer, color_normal);
+			journal_append(JOURNAL_ME, self->nickname, room_get_name(self->room), cmd.text, cmd.text_len);
+			logline(LOG_INFO, "%s", buffer);
+			break;
+
+		/* User wants a listing of currently connected clients */
+		case CMD_WHO:
+		{
+			logline(LOG_INFO, "%s requested the client list", self->nickname);
+			send_client_list(self);
+			break;
+		}
+
+		/* User wants to move to another room */
+		case CMD_JOIN:
+			if (join_room(self, cmd.nick, cmd.nick_len) != 0)
+			{
+				send_private_msg(self->nickname, "%sCHATSRV: Cannot join room. Too many rooms in use.%s\r\n", 
+					color_yellow, color_normal);
+			}
+			break;
+
+		/* User wants to go back to the lobby */
+		case CMD_PART:
+			join_room(self, ROOM_LOBBY_NAME, strlen(ROOM_LOBBY_NAME));
+			break;
+
+		/* User wants a listing of the rooms in use */
+		case CMD_ROOMS:
+			send_room_list(self);
+			break;
+
+		/* User wants to see what was said recently */
+		case CMD_HISTORY:
+			send_history(self, (cmd.count > 0) ? cmd.count : HISTORY_LINES, FALSE);
+			break;
+	
+		/* Broadcast message */
+		default:
+			send_chat_msg(self->room, "%s%s:%s %s\r\n", color_green, self->nickname, color_normal, message);
+			journal_append(JOURNAL_CHAT, self->nickname, room_get_name(self->room), message, strlen(message));
+			logline(LOG_INFO, "%s: %s", self->nickname, message);
+			break;
+	}
+
+	return 0;
+}
+
+
+/* 
+ * Send a welcome message to the chat client after he has connected.
  */
 void send_welcome_msg(int sockfd)
 {
-	int socklen = 0;
-	struct list_entry *cur = NULL;
-	va_list args;
-	char buffer[1024];
-		
-	cur = llist_find_by_sockfd(&list_start, sockfd);
-	socklen = sizeof(cur->client_info->address);
+	client_info *ci = NULL;
+	va_list args;
+	char buffer[1024];
+		
+	ci = llist_find_by_sockfd(sockfd);
+	if (ci == NULL)
+		return;
+
+	/* Send welcome message to client */
+	memset(buffer, 0, 1024);
+	sprintf(buffer, "%s/---------------------------------------------\\%s\r\n", color_white, color_normal);
+	send_to_client(ci, buffer, strlen(buffer));
+	memset(buffer, 0, 1024);
+	sprintf(buffer, "%s|             W E L C O M E   T O             |%s\r\n", color_white, color_normal);
+	send_to_client(ci, buffer, strlen(buffer));
+	memset(buffer, 0, 1024);
+	sprintf(buffer, "%s|                  %s %s                |%s\r\n", color_white, APP_NAME, APP_VERSION, color_normal);
+	send_to_client(ci, buffer, strlen(buffer));
+	memset(buffer, 0, 1024);
+	sprintf(buffer, "%s|          Written by Andre Gasser 2012       |%s\r\n", color_white, color_normal);
+	send_to_client(ci, buffer, strlen(buffer));
+	memset(buffer, 0, 1024);
+	sprintf(buffer, "%s\\---------------------------------------------/%s\r\n", color_white, color_normal);
+	send_to_client(ci, buffer, strlen(buffer));
+}
+
+
+/*
+ * Sends the nicknames of all users in the room of a client to it. Long 
+ * lists are split into several lines.
+ */
+void send_client_list(client_info *ci)
+{
+	client_list list;
+
+	list.ci = ci;
+	list.room = ci->room;
+	list.len = 0;
+	llist_walk(append_client_list, &list);
+	link_walk_users(room_get_name(ci->room), append_remote_user, &list);
+
+	if (list.len > 0)
+	{
+		memcpy(list.buffer + list.len, "\r\n", 2);
+		send_to_client(ci, list.buffer, list.len + 2);
+	}
+}
+
+
+/*
+ * Appends the nickname of a user in the listed room to a client list 
+ * under construction.
+ */
+void append_client_list(list_entry *entry, void *arg)
+{
+	client_list *list = (client_list *)arg;
+	char item[64];
+
+	if (entry->client_info->room != list->room)
+		return;
+
+	snprintf(item, sizeof(item), "%s%s%s", color_magenta, entry->nickname, color_normal);
+	append_list_item(list, item);
+}
+
+
+/*
+ * Appends a user of a linked node to a client list under construction.
+ */
+void append_remote_user(const char *nick, int node, void *arg)
+{
+	char item[64];
+
+	snprintf(item, sizeof(item), "%s%s%s@%d", color_magenta, nick, color_normal, node);
+	append_list_item((client_list *)arg, item);
+}
+
+
+/*
+ * Sends the rooms in use and their number of users to a client.
+ */
+void send_room_list(client_info *ci)
+{
+	client_list list;
+
+	list.ci = ci;
+	list.room = -1;
+	list.len = 0;
+	room_walk(append_room_list, &list);
+
+	if (list.len > 0)
+	{
+		memcpy(list.buffer + list.len, "\r\n", 2);
+		send_to_client(ci, list.buffer, list.len + 2);
+	}
+}
+
+
+/*
+ * Appends a room to a room list under construction.
+ */
+void append_room_list(const char *name, int members, void *arg)
+{
+	client_list *list = (client_list *)arg;
+	char item[64];
+
+	snprintf(item, sizeof(item), "%s%s%s (%d)", color_magenta, name, color_normal, members);
+	append_list_item(list, item);
+}
+
+
+/*
+ * Appends an item to a list under construction, sending the line 
+ * collected so far when it is full.
+ */
+void append_list_item(client_list *list, const char *item)
+{
+	size_t needed = strlen(item) + 4;
+
+	if ((list->len > 0) && (list->len + needed > sizeof(list->buffer)))
+	{
+		memcpy(list->buffer + list->len, "\r\n", 2);
+		send_to_client(list->ci, list->buffer, list->len + 2);
+		list->len = 0;
+	}
+
+	if (list->len > 0)
+	{
+		memcpy(list->buffer + list->len, ", ", 2);
+		list->len += 2;
+	}
+	memcpy(list->buffer + list->len, item, needed - 4);
+	list->len += needed - 4;
+}
+
+
+/*
+ * Moves a user to another room and lets both rooms know. Returns -1 if 
+ * the room cannot be joined.
+ */
+int join_room(client_info *ci, const char *name, size_t len)
+{
+	char notice[128];
+	char old_name[MAX_ROOM_LEN + 1];
+	unsigned long old_generation = 0;
+	int old_room = ci->room;
+	int room = 0;
+	msg *m = NULL;
+
+	/* Leaving may free the old room, and another worker may reuse it */
+	old_generation = room_get_generation(old_room);
+	snprintf(old_name, sizeof(old_name), "%s", room_get_name(old_room));
+
+	room = room_join(ci, name, len);
+	if (room < 0)
+		return -1;
+
+	if (room == old_room)
+	{
+		snprintf(notice, sizeof(notice), "%sCHATSRV: You are in room %s already.%s\r\n", 
+			color_yellow, room_get_name(room), color_normal);
+		send_to_client(ci, notice, strlen(notice));
+		return 0;
+	}
+
+	if (room_get_generation(old_room) == old_generation)
+	{
+		m = msg_format("%sUser %s has left the room.%s\r\n", color_magenta, ci->nickname, color_normal);
+		if (m != NULL)
+		{
+			broadcast_msg(old_room, old_generation, m);
+			link_room(old_name, m, FALSE);
+			msg_put(m);
+		}
+	}
+	link_user(ci->nickname, room_get_name(room));
+	send_history(ci, params->replay, TRUE);
+	send_broadcast_msg(room, "%sUser %s joined room %s.%s\r\n", color_magenta, ci->nickname, 
+		room_get_name(room), color_normal);
+	logline(LOG_INFO, "User %s joined room %s.", ci->nickname, room_get_name(room));
+
+	return 0;
+}
+
+
+/*
+ * Sends the last lines of the history of its room to a client. They are
+ * queued as they are and go out together with the next flush. Replays 
+ * stay within half the send queue limit, so they cannot get a client 
+ * kicked. Without quiet, an empty history is reported. Returns the number
+ * of lines sent.
+ */
+int send_history(client_info *ci, int count, int quiet)
+{
+	msg *lines[HISTORY_SLOTS];
+	char notice[128];
+	int n = 0;
+	int i = 0;
+
+	if (count > 0)
+		n = history_get(room_get_history(ci->room), count, params->sendq / 2, lines);
+
+	if ((n == 0) && quiet)
+		return 0;
+
+	if (n == 0)
+		snprintf(notice, sizeof(notice), "%sCHATSRV: Nothing has been said in room %s yet.%s\r\n", 
+			color_yellow, room_get_name(ci->room), color_normal);
+	else
+		snprintf(notice, sizeof(notice), "%sCHATSRV: Last %d line(s) in room %s:%s\r\n", 
+			color_yellow, n, room_get_name(ci->room), color_normal);
+	send_to_client(ci, notice, strlen(notice));
+
+	for (i = 0; i < n; i++)
+	{
+		queue_msg(ci, lines[i]);
+		msg_put(lines[i]);
+	}
+
+	return n;
+}
+
+
+/*
+ * Puts a journaled line of the lobby back into its history, formatted 
+ * the way it was sent.
+ */
+int warm_up_history(void *arg, const journal_entry *entry)
+{
+	msg *m = NULL;
+
+	if ((entry->room_len != strlen(ROOM_LOBBY_NAME)) || (memcmp(entry->room, ROOM_LOBBY_NAME, entry->room_len) != 0))
+		return 0;
+
+	if (entry->type == JOURNAL_ME)
+		m = msg_format("%s%.*s %.*s%s\r\n", color_cyan, (int)entry->sender_len, entry->sender, 
+			(int)entry->text_len, entry->text, color_normal);
+	else
+		m = msg_format("%s%.*s:%s %.*s\r\n", color_green, (int)entry->sender_len, entry->sender, 
+			color_normal, (int)entry->text_len, entry->text);
+	if (m == NULL)
+		return 0;
+
+	history_append(room_get_history(ROOM_LOBBY), m);
+	msg_put(m);
+	(*(int *)arg)++;
+
+	return 0;
+}
+
+
+/* 
+ * Sends a notice to all users in a room.
+ */
+void send_broadcast_msg(int room, char* format, ...)
+{
+	va_list args;
+	msg *m = NULL;
+
+	/* Prepare message */
+	va_start(args, format);
+	m = msg_vformat(format, args);
+	va_end(args);
+	if (m == NULL)
+		return;
+
+	broadcast_msg(room, room_get_generation(room), m);
+	link_room(room_get_name(room), m, FALSE);
+	msg_put(m);
+}
+
+
+/*
+ * Sends a chat line to all users in a room and keeps it in the history
+ * of the room.
+ */
+void send_chat_msg(int room, char* format, ...)
+{
+	va_list args;
+	msg *m = NULL;
+
+	/* Prepare message */
+	va_start(args, format);
+	m = msg_vformat(format, args);
+	va_end(args);
+	if (m == NULL)
+		return;
+
+	history_append(room_get_history(room), m);
+	broadcast_msg(room, room_get_generation(room), m);
+	link_room(room_get_name(room), m, TRUE);
+	msg_put(m);
+}
+
+
+/* Send a message out to all users in a room. The message is formatted 
+ * once and shared by all recipients. Members owned by other workers are
+ * reached through their inbox, workers without members in the room are
+ * skipped. The generation the caller saw the room in travels along, so
+ * that a reused room slot does not get the message.
+ */
+void broadcast_msg(int room, unsigned long generation, msg *m)
+{
+	handoff *h = NULL;
+	int i = 0;
+
+	metric_inc(METRIC_BROADCASTS);
+	
+	for (i = 0; i < worker_count; i++)
+	{
+		if (!room_has_members(room, i))
+			continue;
+
+		if (workers[i] == current_worker)
+		{
+			deliver_local(current_worker, room, m);
+		}
+		else
+		{
+			h = handoff_create(HANDOFF_BROADCAST, m);
+			if (h != NULL)
+			{
+				h->room = room;
+				h->generation = generation;
+				worker_post(workers[i], h);
+			}
+		}
+	}
+}
+
+
+/*
+ * Sends a message to the members of a room owned by a worker.
+ */
+void deliver_local(worker *w, int room, msg *m)
+{
+	unsigned long long start = metric_clock();
+	client_set *members = room_get_members(room, w->id);
+	int i = 0;
+
+	for (i = 0; i < members->count; i++)
+	{
+		queue_msg(members->items[i], m);
+	}
+	metric_time(METRIC_FANOUT_TIME, start);
+	metric_record(METRIC_FANOUT_SIZE, members->count);
+}
+
+
+/*
+ * Sends a private message to a user.
+ */
+void send_private_msg(char* nickname, char* format, ...)
+{
+	client_info *ci = NULL;
+	va_list args;
+	msg *m = NULL;
+
+	ci = llist_find_by_nickname(nickname);
+	if ((ci == NULL) && (link_find_user(nickname) == 0))
+		return;
+
+	/* Prepare message */
+	va_start(args, format);
+	m = msg_vformat(format, args);
+	va_end(args);
+	if (m == NULL)
+		return;
+
+	/* Users of linked nodes are reached through their node */
+	if (ci != NULL)
+		deliver_private(ci, m);
+	else
+		link_private(nickname, m);
+
+	msg_put(m);
+}
+
+
+/*
+ * Sends a message to a local user, or hands it over to the owning worker. 
+ * A session found in the registry stays valid until the end of the 
+ * current loop iteration, even if it is disconnected meanwhile.
+ */
+void deliver_private(client_info *ci, msg *m)
+{
+	handoff *h = NULL;
+
+	if ((current_worker != NULL) && (ci->worker_id == current_worker->id))
+	{
+		queue_msg(ci, m);
+	}
+	else
+	{
+		h = handoff_create(HANDOFF_PRIVATE, m);
+		if (h != NULL)
+		{
+			h->sockfd = ci->sockfd;
+			h->conn_id = ci->conn_id;
+			worker_post(workers[ci->worker_id], h);
+		}
+	}
+}
+
+
+/*
+ * Gives a new session its default nickname. Linked nodes add their node
+ * id, so the defaults of different nodes do not clash.
+ */
+void set_default_nickname(client_info *ci)
+{
+	if (link_get_node() > 0)
+		sprintf(ci->nickname, "anonymous_%d_%d", link_get_node(), ci->sockfd);
+	else
+		sprintf(ci->nickname, "anonymous_%d", ci->sockfd);
+}
+
+
+/*
+ * Gives up a nickname claimed by a user of another node and falls back 
+ * to the default one. Called by the worker owning the session.
+ */
+void rename_client(client_info *ci)
+{
+	char oldnick[20];
+	char newnick[20];
+
+	strcpy(oldnick, ci->nickname);
+	snprintf(newnick, sizeof(newnick), "anonymous_%d_%d", link_get_node(), ci->sockfd);
+	if (llist_rename(ci, newnick) != 0)
+	{
+		snprintf(newnick, sizeof(newnick), "anonymous_%d_%lu", link_get_node(), ci->conn_id);
+		if (llist_rename(ci, newnick) != 0)
+			return;
+	}
+
+	link_nick(oldnick, newnick);
+	send_private_msg(newnick, "%sCHATSRV: Nickname %s is in use on another node, you are now %s.%s\r\n", 
+		color_yellow, oldnick, newnick, color_normal);
+	send_broadcast_msg(ci->room, "%sUser %s is now known as %s%s\r\n", color_yellow, oldnick, newnick, color_normal);
+	logline(LOG_INFO, "User %s is now known as %s, the nickname is in use on another node.", oldnick, newnick);
+}
+
+
+/*
+ * Delivers a room message relayed by another node to the local members
+ * of the room. Called on the link thread.
+ */
+void link_room_received(const char *room, size_t room_len, const char *text, size_t len, int chat)
+{
+	unsigned long generation = 0;
+	msg *m = NULL;
+	int id = 0;
+
+	/* Nobody here is in that room */
+	id = room_find(room, room_len, &generation);
+	if (id < 0)
+		return;
+
+	m = msg_format("%.*s\r\n", (int)len, text);
+	if (m == NULL)
+		return;
+
+	/* The room may be freed and its slot reused meanwhile */
+	if (chat && (room_append_history(id, generation, m) != 0))
+	{
+		msg_put(m);
+		return;
+	}
+	broadcast_msg(id, generation, m);
+	msg_put(m);
+}
+
+
+/*
+ * Delivers a private message relayed by another node. Called on the link
+ * thread.
+ */
+void link_private_received(const char *nick, const char *text, size_t len)
+{
+	client_info *ci = NULL;
+	char name[20];
+	msg *m = NULL;
+
+	snprintf(name, sizeof(name), "%s", nick);
+	ci = llist_find_by_nickname(name);
+	if (ci == NULL)
+		return;
+
+	m = msg_format("%.*s\r\n", (int)len, text);
+	if (m == NULL)
+		return;
+
+	deliver_private(ci, m);
+	msg_put(m);
+}
+
+
+/*
+ * Asks the worker owning a session to rename it. Called on the link 
+ * thread.
+ */
+void link_rename_requested(client_info *ci)
+{
+	handoff *h = NULL;
+
+	h = handoff_create(HANDOFF_RENAME, NULL);
+	if (h == NULL)
+		return;
+
+	h->sockfd = ci->sockfd;
+	h->conn_id = ci->conn_id;
+	worker_post(workers[ci->worker_id], h);
+}
+
+
+/*
+ * Queues a copy of a buffer for a client. Returns -1 if the buffer has 
+ * not been queued.
+ */
+int send_to_client(client_info *ci, char *buffer, size_t len)
+{
+	msg *m = NULL;
+	int ret = 0;
+
+	m = msg_create(buffer, len);
+	if (m == NULL)
+		return -1;
+
+	ret = queue_msg(ci, m);
+	msg_put(m);
+
+	return ret;
+}
+
+
+/*
+ * Queues a message for a client, which takes a reference to it. The 
+ * queue is written once the current loop iteration is done or, if the 
+ * socket is full, as soon as it can take more data. Clients exceeding their send queue limit are handled 
+ * according to the slow client policy. Returns -1 if the message has not
+ * been queued.
+ */
+int queue_msg(client_info *ci, msg *m)
+{
+	if (ci->flags & (CLIENT_CLOSED | CLIENT_KICKED))
+		return -1;
+
+	/* A lagged client skips everything until its queue has drained */
+	if (ci->flags & CLIENT_LAGGED)
+	{
+		ci->skipped++;
+		return -1;
+	}
+
+	if (ci->outq.bytes + m->len > (size_t)params->sendq)
+	{
+		switch (params->slow_policy)
+		{
+			case SLOW_DROP_OLDEST:
+				outq_drop_oldest(&ci->outq, params->sendq - m->len);
+				if (ci->outq.bytes + m->len <= (size_t)params->sendq)
+					break;
+				return -1;
+
+			case SLOW_LAG:
+				logline(LOG_INFO, "User %s is lagging behind, skipping messages.", ci->nickname);
+				ci->flags |= CLIENT_LAGGED;
+				ci->skipped = 1;
+				return -1;
+
+			default:
+				logline(LOG_INFO, "User %s exceeded the send queue limit, disconnecting.", ci->nickname);
+				worker_mark_kicked(current_worker, ci);
+				return -1;
+		}
+	}
+
+	if (outq_push(&ci->outq, m) != 0)
+		return -1;
+	worker_mark_dirty(current_worker, ci);
+	metric_inc(METRIC_MSGS_OUT);
+
+	return 0;
+}
+
+
+/*
+ * Writes as much queued output to a client socket as it takes without
+ * blocking. Returns -1 on a socket error, which the read path picks up.
+ */
+int flush_client(client_info *ci)
+{
+	struct iovec iov[OUTQ_IOV_MAX];
+	struct msghdr hdr;
+	unsigned long long start = metric_clock();
+	ssize_t ret = 0;
+	int wrote = FALSE;
 
-	/* Lock entry */
-	pthread_mutex_lock(cur->mutex);
+	while (ci->outq.bytes > 0)
+	{
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.msg_iov = iov;
+		hdr.msg_iovlen = outq_fill_iov(&ci->outq, iov, OUTQ_IOV_MAX);
 
-	/* Send welcome message to client */
-	memset(buffer, 0, 1024);
-	sprintf(buffer, "%s/---------------------------------------------\\%s\r\n", color_white, color_normal);
-	sendto(cur->client_info->sockfd, buffer, strlen(buffer), 0,
-		(struct sockaddr *)&(cur->client_info->address), (socklen_t)socklen);
-	memset(buffer, 0, 1024);
-	sprintf(buffer, "%s|             W E L C O M E   T O             |%s\r\n", color_white, color_normal);
-	sendto(cur->client_info->sockfd, buffer, strlen(buffer), 0,
-		(struct sockaddr *)&(cur->client_info->address), (socklen_t)socklen);
-	memset(buffer, 0, 1024);
-	sprintf(buffer, "%s|                  %s %s                |%s\r\n", color_white, APP_NAME, APP_VERSION, color_normal);
-	sendto(cur->client_info->sockfd, buffer, strlen(buffer), 0,
-		(struct sockaddr *)&(cur->client_info->address), (socklen_t)socklen);
-	memset(buffer, 0, 1024);
-	sprintf(buffer, "%s|          Written by Andre Gasser 2012       |%s\r\n", color_white, color_normal);
-	sendto(cur->client_info->sockfd, buffer, strlen(buffer), 0,
-		(struct sockaddr *)&(cur->client_info->address), (socklen_t)socklen);
-	memset(buffer, 0, 1024);
-	sprintf(buffer, "%s\\---------------------------------------------/%s\r\n", color_white, color_normal);
-	sendto(cur->client_info->sockfd, buffer, strlen(buffer), 0,
-		(struct sockaddr *)&(cur->client_info->address), (socklen_t)socklen);
-		
-	/* Unlock entry */
-	pthread_mutex_unlock(cur->mutex);
+		ret = sendmsg(ci->sockfd, &hdr, MSG_NOSIGNAL);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				break;  /* Wait for EPOLLOUT */
+			return -1;
+		}
+		outq_consume(&ci->outq, ret);
+		metric_add(METRIC_BYTES_OUT, ret);
+		wrote = TRUE;
+	}
+	metric_time(METRIC_SEND_TIME, start);
+
+	check_lagged(ci);
+	watch_output(ci, wrote);
+
+	return 0;
 }
 
 
-/* Send received message out to all available clients, but do
- * not send it to yourself.
+/*
+ * Writes queued output of all dirty clients through the io_uring of the
+ * worker. Each client gets a single sendmsg() per round, and all of them
+ * are submitted in batches of up to URING_ENTRIES. Clients with more 
+ * output than fits a round are flushed again in the next one.
  */
-void send_broadcast_msg(char* format, ...)
+void flush_clients_batched(worker *w)
 {
-	int socklen = 0;
-	//client_info *cur = NULL;
-	struct list_entry *cur = NULL;
-	va_list args;
-	char buffer[1024];
-		
-	memset(buffer, 0, 1024);
+	client_info *batch[URING_ENTRIES];
+	size_t totals[URING_ENTRIES];
+	int results[URING_ENTRIES];
+	client_info *ci = NULL;
+	struct msghdr *hdr = NULL;
+	unsigned long long start = 0;
+	unsigned long long elapsed = 0;
+	int slots = 0;
+	int i = 0;
+	int j = 0;
 
-	/* Prepare message */
-	va_start(args, format);
-	vsprintf(buffer, format, args);
-	va_end(args);
-	
-	cur = &list_start;
-	while (cur != NULL)
+	while (w->dirty.count > 0)
 	{
-		/* Lock entry */
-		pthread_mutex_lock(cur->mutex);
-		
-		/* Send message to client */
-		if (cur->client_info != NULL)
+		/* Prepare one round */
+		slots = 0;
+		while ((w->dirty.count > 0) && (slots < URING_ENTRIES))
 		{
-			socklen = sizeof(cur->client_info->address);
-			sendto(cur->client_info->sockfd, buffer, strlen(buffer), 0,
-				(struct sockaddr *)&(cur->client_info->address), (socklen_t)socklen);
+			ci = w->dirty.items[--w->dirty.count];
+			ci->flags &= ~CLIENT_DIRTY;
+			if ((ci->flags & CLIENT_CLOSED) || (ci->outq.bytes == 0))
+				continue;
+
+			hdr = &w->send_msgs[slots];
+			memset(hdr, 0, sizeof(*hdr));
+			hdr->msg_iov = &w->send_iovs[slots * OUTQ_IOV_MAX];
+			hdr->msg_iovlen = outq_fill_iov(&ci->outq, hdr->msg_iov, OUTQ_IOV_MAX);
+			totals[slots] = 0;
+			for (j = 0; j < (int)hdr->msg_iovlen; j++)
+				totals[slots] += hdr->msg_iov[j].iov_len;
+			uring_prep_sendmsg(w->ring, ci->sockfd, hdr, slots);
+			batch[slots++] = ci;
+		}
+
+		start = metric_clock();
+		if (uring_submit_and_wait(w->ring, flush_completed, results) < 0)
+		{
+			/* Ring is unusable, write the old-fashioned way */
+			for (i = 0; i < slots; i++)
+				flush_client(batch[i]);
+			continue;
+		}
+		elapsed = metric_clock() - start;
+
+		for (i = 0; i < slots; i++)
+		{
+			ci = batch[i];
+
+			/* Errors are picked up by the read path, a full socket 
+			 * reports EPOLLOUT once it can take more.
+			 */
+			if (results[i] <= 0)
+			{
+				watch_output(ci, FALSE);
+				continue;
+			}
+
+			/* A round costs its sessions the same share each */
+			metric_record(METRIC_SEND_TIME, elapsed / slots);
+			metric_add(METRIC_BYTES_OUT, results[i]);
+			outq_consume(&ci->outq, results[i]);
+			if (((size_t)results[i] == totals[i]) && (ci->outq.bytes > 0))
+			{
+				worker_mark_dirty(w, ci);
+			}
+			else
+			{
+				check_lagged(ci);
+				watch_output(ci, TRUE);
+			}
 		}
-		
-		/* Unlock entry */
-		pthread_mutex_unlock(cur->mutex);
-		
-		/* Load next index */
-		cur = cur->next;
 	}
 }
 
 
 /*
- * Sends a private message to a user.
+ * Stores the result of a batched sendmsg().
  */
-void send_private_msg(char* nickname, char* format, ...)
+void flush_completed(void *arg, unsigned long long user_data, int res)
 {
-	int socklen = 0;
-	struct list_entry *cur = NULL;
-	va_list args;
-	char buffer[1024];
-		
-	memset(buffer, 0, 1024);
+	int *results = (int *)arg;
 
-	/* Prepare message */
-	va_start(args, format);
-	vsprintf(buffer, format, args);
-	va_end(args);
-	
-	cur = llist_find_by_nickname(&list_start, nickname);
+	results[user_data] = res;
+}
 
-	/* Lock entry */
-	pthread_mutex_lock(cur->mutex);
 
-	/* Send message to client */
-	socklen = sizeof(cur->client_info->address);
-	sendto(cur->client_info->sockfd, buffer, strlen(buffer), 0,
-		(struct sockaddr *)&(cur->client_info->address), (socklen_t)socklen);
-		
-	/* Unlock entry */
-	pthread_mutex_unlock(cur->mutex);
+/*
+ * Lifts the lagged state of a client whose queue has drained to half its
+ * limit, and tells it how many messages it has missed.
+ */
+void check_lagged(client_info *ci)
+{
+	char notice[128];
+
+	if (!(ci->flags & CLIENT_LAGGED) || (ci->outq.bytes > (size_t)params->sendq / 2))
+		return;
+
+	ci->flags &= ~CLIENT_LAGGED;
+	sprintf(notice, "%sCHATSRV: You were lagging behind, %lu messages skipped.%s\r\n", 
+		color_yellow, ci->skipped, color_normal);
+	send_to_client(ci, notice, strlen(notice));
+}
+
+
+/*
+ * Publishes the counters, send queues and busiest sessions of a worker
+ * to the shared stats segment, about once per second. Only memory is 
+ * written, so publishing costs no system calls.
+ */
+void publish_stats(worker *w)
+{
+	stats_worker *sw = stats_slot(w->id);
+	stats_talker top[STATS_TOP_TALKERS];
+	unsigned long long queued_bytes = 0;
+	unsigned long long queued_sessions = 0;
+	unsigned long long max_queue = 0;
+	unsigned long long lagged = 0;
+	unsigned long long paused = 0;
+	unsigned long long now = 0;
+	unsigned long lines = 0;
+	struct timespec ts;
+	client_info *ci = NULL;
+	int count = 0;
+	int i = 0;
+	int j = 0;
+
+	if (sw == NULL)
+		return;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	if (now - sw->updated < 1000000000ULL)
+		return;
+
+	for (i = 0; i < w->clients.count; i++)
+	{
+		ci = w->clients.items[i];
+		if (ci->outq.bytes > 0)
+			queued_sessions++;
+		queued_bytes += ci->outq.bytes;
+		if (ci->outq.bytes > max_queue)
+			max_queue = ci->outq.bytes;
+		if (ci->flags & CLIENT_LAGGED)
+			lagged++;
+		if (ci->flags & CLIENT_PAUSED)
+			paused++;
+
+		/* Keep the busiest sessions, sorted */
+		lines = ci->lines - ci->lines_seen;
+		ci->lines_seen = ci->lines;
+		if (lines == 0)
+			continue;
+		for (j = count; (j > 0) && (top[j - 1].lines < lines); j--)
+		{
+			if (j < STATS_TOP_TALKERS)
+				top[j] = top[j - 1];
+		}
+		if (j < STATS_TOP_TALKERS)
+		{
+			strcpy(top[j].nickname, ci->nickname);
+			top[j].lines = lines;
+			if (count < STATS_TOP_TALKERS)
+				count++;
+		}
+	}
+
+	stats_write_begin(sw);
+	sw->interval = (sw->updated > 0) ? now - sw->updated : 0;
+	sw->updated = now;
+	sw->sessions = w->clients.count;
+	sw->accepts = metrics_local->counters[METRIC_ACCEPTS];
+	sw->msgs_in = metrics_local->counters[METRIC_MSGS_IN];
+	sw->msgs_out = metrics_local->counters[METRIC_MSGS_OUT];
+	sw->bytes_in = metrics_local->counters[METRIC_BYTES_IN];
+	sw->bytes_out = metrics_local->counters[METRIC_BYTES_OUT];
+	sw->queued_bytes = queued_bytes;
+	sw->queued_sessions = queued_sessions;
+	sw->max_queue = max_queue;
+	sw->lagged = lagged;
+	sw->paused = paused;
+	sw->flood_pauses = metrics_local->counters[METRIC_FLOOD_PAUSES];
+	sw->flood_drops = metrics_local->counters[METRIC_FLOOD_DROPS];
+	sw->talker_count = count;
+	memcpy(sw->talkers, top, count * sizeof(stats_talker));
+	stats_write_end(sw);
 }
 
 
@@ -720,30 +2730,420 @@ void chomp(char *s)
 
 
 /*
- * Changes the nickname of an existing chat user.
+ * Changes the nickname of an existing chat user. Returns -1 if the new
+ * nickname is already in use.
  */
-void change_nickname(char *oldnickname, char *newnickname)
+int change_nickname(client_info *ci, char *newnickname)
 {
-	struct list_entry *list_entry = NULL;
-	client_info *ci_new = NULL;
-	int idx = 0;
-	
-	logline(LOG_DEBUG, "change_nickname(): oldnickname = %s, newnickname = %s", oldnickname, newnickname);
-	
-	/* Load client_info element */
-	list_entry = llist_find_by_nickname(&list_start, oldnickname);
-	
-	/*Lock entry */
-	pthread_mutex_lock(list_entry->mutex);
-	
-	logline(LOG_DEBUG, "change_nickname(): client_info found. client_info->nickname = %s", 
-		list_entry->client_info->nickname);
+	logline(LOG_DEBUG, "change_nickname(): oldnickname = %s, newnickname = %s", ci->nickname, newnickname);
 	
 	/* Update nickname */
-	strcpy(list_entry->client_info->nickname, newnickname);
-	
-	/* Unlock entry */
-	pthread_mutex_unlock(list_entry->mutex);
+	return llist_rename(ci, newnickname);
+}
+
+
+/*
+ * Asks for a dump of the server state, see dump_server_state().
+ */
+void request_dump(int sig)
+{
+	dump_requested = 1;
+}
+
+
+/*
+ * Logs the connected users, memory pool occupancy and logger counters.
+ */
+void dump_server_state(void)
+{
+	log_stats stats;
+
+	logline(LOG_INFO, "Server state requested per SIGUSR1, %d connection(s).", curr_client_count);
+	llist_show();
+	pool_log_stats();
+	log_get_stats(&stats);
+	logline(LOG_INFO, "Log messages written: %lu, dropped: %lu", stats.written, stats.dropped);
+}
+
+
+/*
+ * Asks for a hot upgrade, see pause_for_upgrade(). The signal may be 
+ * delivered to any thread, worker 0 is woken up to start the upgrade.
+ */
+void request_upgrade(int sig)
+{
+	unsigned long long one = 1;
+
+	upgrade_requested = 1;
+	if ((worker_count > 0) && (write(workers[0]->wake_fd, &one, sizeof(one)) < 0))
+		return;
+}
+
+
+/*
+ * Stops a worker while the server is handed over to a new process. Worker
+ * 0 starts the hot upgrade once all other workers have stopped, at the end
+ * of a loop iteration with their output flushed. They go on if the new
+ * process fails to take over.
+ */
+void pause_for_upgrade(worker *w)
+{
+	int i = 0;
+
+	pthread_mutex_lock(&upgrade_mutex);
+	if (w->id != 0)
+	{
+		parked++;
+		pthread_cond_broadcast(&upgrade_cond);
+		epoch_offline();
+		while (upgrading)
+			pthread_cond_wait(&upgrade_cond, &upgrade_mutex);
+		epoch_online();
+		parked--;
+		pthread_mutex_unlock(&upgrade_mutex);
+		return;
+	}
+
+	upgrade_requested = 0;
+	__atomic_store_n(&upgrading, 1, __ATOMIC_RELEASE);
+	for (i = 1; i < worker_count; i++)
+		worker_wake(workers[i]);
+	while (parked < worker_count - 1)
+		pthread_cond_wait(&upgrade_cond, &upgrade_mutex);
+	pthread_mutex_unlock(&upgrade_mutex);
+
+	/* Nothing may be left in flight between the threads */
+	link_pause();
+	drain_inboxes(w);
+	hot_upgrade();
+	link_resume();
+
+	pthread_mutex_lock(&upgrade_mutex);
+	__atomic_store_n(&upgrading, 0, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&upgrade_cond);
+	pthread_mutex_unlock(&upgrade_mutex);
+}
+
+
+/*
+ * Delivers what is still waiting in the inboxes of the workers to their 
+ * sessions, so that it is handed over as queued output. The workers and
+ * the link thread have stopped, the calling worker stands in for each of
+ * them. A rename may post further handoffs, so this goes on until all 
+ * inboxes are empty. Sessions marked dirty are flushed by their worker if
+ * the upgrade fails.
+ */
+void drain_inboxes(worker *w)
+{
+	int count = 0;
+	int i = 0;
+
+	do
+	{
+		count = 0;
+		for (i = 0; i < worker_count; i++)
+		{
+			current_worker = workers[i];
+			count += process_handoffs(workers[i]);
+		}
+	} while (count > 0);
+	current_worker = w;
+}
+
+
+/*
+ * Hands the listeners and sessions over to a new process, started from 
+ * the binary the server was started from, which may have been replaced 
+ * meanwhile. No connection is closed, the new process serves them from
+ * where this one stopped. Only returns if the new process did not take 
+ * over, this one carries on then.
+ */
+int hot_upgrade(void)
+{
+	upgrade_record rec;
+	char data[UPGRADE_DATA_MAX];
+	pid_t pid = 0;
+	int sock = -1;
+	int fd = -1;
+
+	logline(LOG_INFO, "Hot upgrade requested per SIGUSR2, handing over %d connection(s).", curr_client_count);
+	sock = upgrade_spawn(saved_argv, &pid);
+	if (sock < 0)
+	{
+		logline(LOG_ERROR, "Could not start a new server process: %s", strerror(errno));
+		return -1;
+	}
+
+	if ((send_state(sock) != 0) || (upgrade_recv(sock, &rec, data, &fd) != 0) || (rec.type != UPGRADE_READY))
+	{
+		logline(LOG_ERROR, "The new server process did not take over, carrying on.");
+		if (fd >= 0)
+			close(fd);
+		close(sock);
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+
+	/* The new process journals into a segment of its own */
+	journal_close();
+	logline(LOG_INFO, "Process %d has taken over. Byebye.", (int)pid);
+	exit(0);
+}
+
+
+/*
+ * Sends the listeners, sessions and room histories to a new process. The
+ * other workers have stopped, their sessions can be read safely.
+ */
+int send_state(int sock)
+{
+	upgrade_record rec;
+	int i = 0;
+	int j = 0;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = UPGRADE_HELLO;
+	if (upgrade_send(sock, &rec, NULL, 0, -1) != 0)
+		return -1;
+
+	for (i = 0; i < worker_count; i++)
+	{
+		rec.type = UPGRADE_LISTENER;
+		rec.worker = i;
+		if (upgrade_send(sock, &rec, NULL, 0, workers[i]->listen_fd) != 0)
+			return -1;
+	}
+	rec.type = UPGRADE_METRICS;
+	if ((metrics_get_listener() >= 0) && (upgrade_send(sock, &rec, NULL, 0, metrics_get_listener()) != 0))
+		return -1;
+	rec.type = UPGRADE_LINK;
+	if ((link_get_listener() >= 0) && (upgrade_send(sock, &rec, NULL, 0, link_get_listener()) != 0))
+		return -1;
+	rec.type = UPGRADE_END;
+	if (upgrade_send(sock, &rec, NULL, 0, -1) != 0)
+		return -1;
+
+	for (i = 0; i < worker_count; i++)
+	{
+		for (j = 0; j < workers[i]->clients.count; j++)
+		{
+			/* Kicked out while draining, closed when this process ends */
+			if (workers[i]->clients.items[j]->flags & CLIENT_KICKED)
+				continue;
+			if (send_session(sock, workers[i]->clients.items[j]) != 0)
+				return -1;
+		}
+	}
+	if (send_histories(sock) != 0)
+		return -1;
+
+	rec.type = UPGRADE_END;
+	return upgrade_send(sock, &rec, NULL, 0, -1);
+}
+
+
+/*
+ * Sends a session with its socket, its incomplete line and the output 
+ * still queued for it.
+ */
+int send_session(int sock, client_info *ci)
+{
+	upgrade_record rec;
+	outq_chunk *chunk = NULL;
+	size_t off = 0;
+	size_t len = 0;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = UPGRADE_CLIENT;
+	rec.worker = ci->worker_id;
+	rec.discarding = ci->framer.discarding;
+	rec.address = ci->address;
+	strcpy(rec.nickname, ci->nickname);
+	if (ci->room >= 0)
+		snprintf(rec.room, sizeof(rec.room), "%s", room_get_name(ci->room));
+	if (upgrade_send(sock, &rec, ci->framer.partial, ci->framer.len, ci->sockfd) != 0)
+		return -1;
+
+	/* The head of the queue may have been written in part */
+	rec.type = UPGRADE_OUTPUT;
+	off = ci->outq.head_off;
+	for (chunk = ci->outq.head; chunk != NULL; chunk = chunk->next)
+	{
+		while (off < chunk->msg->len)
+		{
+			len = chunk->msg->len - off;
+			if (len > UPGRADE_DATA_MAX)
+				len = UPGRADE_DATA_MAX;
+			if (upgrade_send(sock, &rec, chunk->msg->data + off, len, -1) != 0)
+				return -1;
+			off += len;
+		}
+		off = 0;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Sends the recent lines of every room, oldest first.
+ */
+int send_histories(int sock)
+{
+	msg *lines[HISTORY_SLOTS];
+	upgrade_record rec;
+	int ret = 0;
+	int id = 0;
+	int n = 0;
+	int i = 0;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = UPGRADE_HISTORY;
+	for (id = 0; id < MAX_ROOMS; id++)
+	{
+		if (room_get_name(id)[0] == '\0')
+			continue;
+
+		snprintf(rec.room, sizeof(rec.room), "%s", room_get_name(id));
+		n = history_get(room_get_history(id), HISTORY_SLOTS, (size_t)-1, lines);
+		for (i = 0; i < n; i++)
+		{
+			if ((ret == 0) && (lines[i]->len <= UPGRADE_DATA_MAX))
+				ret = upgrade_send(sock, &rec, lines[i]->data, lines[i]->len, -1);
+			msg_put(lines[i]);
+		}
+	}
+
+	return ret;
+}
+
+
+/*
+ * Takes over the listeners of the previous process, up to the first END 
+ * record. Returns -1 if it has gone or speaks another version.
+ */
+int receive_listeners(int sock)
+{
+	upgrade_record rec;
+	char data[UPGRADE_DATA_MAX];
+	int fd = -1;
+
+	if ((upgrade_recv(sock, &rec, data, &fd) != 0) || (rec.type != UPGRADE_HELLO))
+		return -1;
+
+	while (1)
+	{
+		if (upgrade_recv(sock, &rec, data, &fd) != 0)
+			return -1;
+		if (rec.type == UPGRADE_END)
+			return 0;
+
+		if ((rec.type == UPGRADE_LISTENER) && (fd >= 0) && (inherited_count < MAX_WORKERS))
+			inherited_listeners[inherited_count++] = fd;
+		else if ((rec.type == UPGRADE_METRICS) && (fd >= 0))
+			inherited_metrics = fd;
+		else if ((rec.type == UPGRADE_LINK) && (fd >= 0))
+			inherited_link = fd;
+		else if (fd >= 0)
+			close(fd);
+	}
+}
+
+
+/*
+ * Takes over the sessions and room histories of the previous process, up
+ * to the second END record, and tells it that it may exit. Sessions that
+ * cannot be taken over are closed. Returns -1 if the previous process has
+ * gone meanwhile.
+ */
+int receive_sessions(int sock)
+{
+	upgrade_record rec;
+	char data[UPGRADE_DATA_MAX];
+	client_info *ci = NULL;
+	msg *m = NULL;
+	int sessions = 0;
+	int fd = -1;
+	int id = 0;
+
+	while (1)
+	{
+		if (upgrade_recv(sock, &rec, data, &fd) != 0)
+			return -1;
+		if (rec.type == UPGRADE_END)
+			break;
+
+		switch (rec.type)
+		{
+			case UPGRADE_CLIENT:
+				ci = restore_session(&rec, data, fd);
+				if (ci != NULL)
+					sessions++;
+				break;
+			case UPGRADE_OUTPUT:
+				if (ci != NULL)
+					send_to_client(ci, data, rec.len);
+				break;
+			case UPGRADE_HISTORY:
+				id = room_find(rec.room, strlen(rec.room), NULL);
+				m = msg_create(data, rec.len);
+				if (m == NULL)
+					break;
+				if (id >= 0)
+					history_append(room_get_history(id), m);
+				msg_put(m);
+				break;
+			default:
+				if (fd >= 0)
+					close(fd);
+		}
+	}
+	current_worker = NULL;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = UPGRADE_READY;
+	if (upgrade_send(sock, &rec, NULL, 0, -1) != 0)
+		return -1;
+	close(sock);
+
+	logline(LOG_INFO, "Took over %d connection(s) from the previous process.", sessions);
+
+	return 0;
+}
+
+
+/*
+ * Registers a session handed over by the previous process with the worker
+ * that owned it there, nothing is sent to the user. With fewer workers 
+ * than before, sessions are spread over the ones there are. Returns NULL
+ * if the session cannot be taken over.
+ */
+client_info* restore_session(upgrade_record *rec, char *data, int fd)
+{
+	const char *room = (rec->room[0] != '\0') ? rec->room : ROOM_LOBBY_NAME;
+	client_info *ci = NULL;
+
+	if (fd < 0)
+		return NULL;
+
+	/* Until the workers run, the sessions are set up on their behalf */
+	current_worker = workers[(unsigned int)rec->worker % worker_count];
+	ci = register_client(current_worker, fd, &rec->address, rec->nickname, room);
+	if (ci == NULL)
+		return NULL;
+	metric_inc(METRIC_TAKEN_OVER);
+
+	/* An incomplete line stays incomplete, framing it again just restores
+	 * the state of the framer
+	 */
+	ci->framer.discarding = rec->discarding;
+	if (rec->len > 0)
+		framer_feed(&ci->framer, data, rec->len, process_line, ci);
+
+	logline(LOG_DEBUG, "restore_session(): User %s taken over on socket id %d", ci->nickname, fd);
+
+	return ci;
 }
 
 
@@ -752,7 +3152,10 @@ void change_nickname(char *oldnickname, char *newnickname)
  */
 void shutdown_server(int sig)
 {
-	list_entry *cur = NULL;
+	journal_stats jstats;
+	log_stats stats;
+	int i = 0;
+	int j = 0;
 
 	if ((sig == SIGINT) || (sig == SIGTERM))
 	{
@@ -764,31 +3167,35 @@ void shutdown_server(int sig)
 		/* Close all socket connections immediately */
 		logline(LOG_INFO, "Closing socket connections...");		
 		
-		/* Iterate through client list and shutdown sockets */
-		cur = &list_start;
-		while (cur != NULL)
+		/* Iterate through the sessions of all workers and shutdown sockets */
+		for (i = 0; i < worker_count; i++)
 		{
-			/* Lock entry */
-			pthread_mutex_lock(cur->mutex);
-		
-			/* Send message to client */
-			if (cur->client_info != NULL)
+			for (j = 0; j < workers[i]->clients.count; j++)
 			{
-				close(cur->client_info->sockfd);
+				close(workers[i]->clients.items[j]->sockfd);
 			}
+		}
 		
-			/* Unlock entry */
-			pthread_mutex_unlock(cur->mutex);
-		
-			/* Load next index */
-			cur = cur->next;
-		}		
-		
-		/* Close listener connection */
-		logline(LOG_INFO, "Shutting down listener...");
-		close(server_sockfd);
+		/* Close listener connections */
+		logline(LOG_INFO, "Shutting down listeners...");
+		for (i = 0; i < worker_count; i++)
+		{
+			close(workers[i]->listen_fd);
+		}
 
 		/* Exit process */		
+		journal_close();
+		stats_close();
+		pool_log_stats();
+		if (params->journal != NULL)
+		{
+			journal_get_stats(&jstats);
+			logline(LOG_INFO, "Journal: %lu line(s) written, %lu dropped, %lu segment(s) started.", 
+				jstats.written, jstats.dropped, jstats.segments);
+		}
+		log_get_stats(&stats);
+		if (stats.dropped > 0)
+			logline(LOG_INFO, "%lu log messages were dropped.", stats.dropped);
 		logline(LOG_INFO, "Exiting. Byebye.");
 		exit(0);
 	}
@@ -820,6 +3227,59 @@ void display_help_page(void)
 	printf("                                             1 = ERROR (Log errors only)\n");
 	printf("                                             2 = INFO (Log additional information)\n");
 	printf("                                             3 = DEBUG (Log debug level information)\n");
+	printf("--workers=<count>, -w <count>              Specifies the number of event loop threads.\n");
+	printf("                                           Each worker accepts connections on its own\n");
+	printf("                                           listener. Default is 1.\n");
+	printf("--pin, -P                                  Pins each worker thread to its own CPU.\n");
+	printf("--io=<backend>, -I <backend>               Specifies the I/O backend. Supported are\n");
+	printf("                                           'syscall' (default) and 'uring', which\n");
+	printf("                                           batches sends and receives via io_uring.\n");
+	printf("--sendq=<bytes>, -q <bytes>                Specifies the max. number of bytes queued\n");
+	printf("                                           for a client. Default is 262144.\n");
+	printf("--slow=<policy>, -s <policy>               Specifies how to handle clients exceeding\n");
+	printf("                                           their send queue: 'disconnect' (default),\n");
+	printf("                                           'drop' oldest messages or 'lag' behind.\n");
+	printf("--log=<mode>, -L <mode>                    Specifies how log messages are written:\n");
+	printf("                                           'async' (default) by a background thread,\n");
+	printf("                                           'sync' directly by the chat threads.\n");
+	printf("--maxline=<bytes>, -m <bytes>              Specifies the max. length of a line sent by\n");
+	printf("                                           a client, from 64 to %d. Longer lines\n", MAX_LINE_LENGTH);
+	printf("                                           are dropped. Default is 1024.\n");
+	printf("--metrics=<port>, -M <port>                Serves metrics in the Prometheus text format\n");
+	printf("                                           on 127.0.0.1:<port>/metrics. Off by default.\n");
+	printf("--stats, -S                                Publishes statistics in shared memory for\n");
+	printf("                                           chatsrv-top.\n");
+	printf("--history=<bytes>, -H <bytes>              Specifies how many bytes of recent chat\n");
+	printf("                                           lines every room keeps for /history and\n");
+	printf("                                           replays. 0 disables it. Default is 65536.\n");
+	printf("--replay=<lines>, -r <lines>               Specifies how many recent lines are sent\n");
+	printf("                                           to a user joining a room. Default is %d.\n", HISTORY_LINES);
+	printf("--journal=<dir>, -J <dir>                  Journals chat lines into segment files in\n");
+	printf("                                           <dir>. Off by default.\n");
+	printf("--fsync=<policy>, -F <policy>              Specifies when the journal is synced:\n");
+	printf("                                           never  = left to the kernel\n");
+	printf("                                           second = once per second (default)\n");
+	printf("                                           batch  = after every batch of lines\n");
+	printf("--node=<id>, -N <id>                       Links this server with others as node <id>,\n");
+	printf("                                           from 1 to %d. Off by default.\n", LINK_MAX_NODE);
+	printf("--link-port=<port>, -k <port>              Accepts links from other nodes on <port>.\n");
+	printf("--peer=<host:port>, -E <host:port>         Links with the node at <host:port>. May be\n");
+	printf("                                           given up to %d times.\n", LINK_MAX_PEERS);
+	printf("--flood=<limits>, -f <limits>              Sets the per-user budgets per second as a\n");
+	printf("                                           list like lines=20,bytes=8192,chat=5,msg=10,\n");
+	printf("                                           who=1, 0 lifts a limit, off lifts all.\n");
+	printf("--idle=<secs>, -t <secs>                   Disconnects users who send nothing for\n");
+	printf("                                           <secs>. 0 disables it. Default is 3600.\n");
+	printf("--ping=<secs>, -g <secs>                   Pings users who have been quiet for <secs>.\n");
+	printf("                                           Off by default.\n");
+	printf("--stall=<secs>, -o <secs>                  Disconnects users whose output has not\n");
+	printf("                                           drained for <secs>. 0 disables it.\n");
+	printf("                                           Default is 60.\n");
+	printf("--backlog=<n>, -B <n>                      Specifies how many connections may wait to\n");
+	printf("                                           be accepted. Default is %d.\n", SOMAXCONN);
+	printf("--defer-accept=<secs>, -D <secs>           Holds back connections until the client\n");
+	printf("                                           sends something or <secs> have passed.\n");
+	printf("                                           Off by default.\n");
 	printf("--version, -v                              Displays version information.\n");
 	printf("--help, -h                                 Displays this help page.\n");
 	printf("\n");
@@ -0,0 +1,119 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/*
+ * Searches the journal written by CHATSRV with --journal. The segment 
+ * indexes take it straight to the requested point in time, earlier lines
+ * are not read.
+ *
+ * Usage: ./chatsrv-journal [-d dir] [-s seconds] [-r room] [-u user] [-g text]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include "journal.h"
+
+/* What to look for */
+typedef struct query
+{
+	const char *room;
+	const char *user;
+	const char *text;
+	unsigned long matches;
+} query;
+
+
+/*
+ * Checks whether a string that is not terminated equals a filter.
+ */
+static int field_matches(const char *filter, const char *s, size_t len)
+{
+	return (filter == NULL) || ((strlen(filter) == len) && (memcmp(filter, s, len) == 0));
+}
+
+
+/*
+ * Prints a record if it matches the query.
+ */
+static int print_entry(void *arg, const journal_entry *entry)
+{
+	query *q = (query *)arg;
+	char timestr[32];
+	struct tm tm;
+	time_t secs = entry->time / 1000000000ULL;
+
+	if (!field_matches(q->room, entry->room, entry->room_len) || 
+		!field_matches(q->user, entry->sender, entry->sender_len))
+		return 0;
+	if ((q->text != NULL) && (memmem(entry->text, entry->text_len, q->text, strlen(q->text)) == NULL))
+		return 0;
+
+	localtime_r(&secs, &tm);
+	strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", &tm);
+	if (entry->type == JOURNAL_ME)
+		printf("[%s] #%.*s * %.*s %.*s\n", timestr, (int)entry->room_len, entry->room, 
+			(int)entry->sender_len, entry->sender, (int)entry->text_len, entry->text);
+	else
+		printf("[%s] #%.*s <%.*s> %.*s\n", timestr, (int)entry->room_len, entry->room, 
+			(int)entry->sender_len, entry->sender, (int)entry->text_len, entry->text);
+	q->matches++;
+
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	const char *dir = ".";
+	unsigned long long since = 0;
+	query q;
+	int c;
+
+	memset(&q, 0, sizeof(q));
+	while ((c = getopt(argc, argv, "d:s:r:u:g:h")) != -1)
+	{
+		switch (c)
+		{
+			case 'd': dir = optarg; break;
+			case 's': since = journal_now() - strtoull(optarg, NULL, 10) * 1000000000ULL; break;
+			case 'r': q.room = optarg; break;
+			case 'u': q.user = optarg; break;
+			case 'g': q.text = optarg; break;
+			default:
+				printf("Usage: %s [-d dir] [-s seconds] [-r room] [-u user] [-g text]\n", argv[0]);
+				printf("  -s  Only lines of the last <seconds> seconds\n");
+				printf("  -r  Only lines of a room\n");
+				printf("  -u  Only lines of a user\n");
+				printf("  -g  Only lines containing <text>\n");
+				return (c == 'h') ? 0 : 1;
+		}
+	}
+
+	if (journal_replay(dir, since, print_entry, &q) != 0)
+	{
+		fprintf(stderr, "Cannot read journal directory %s.\n", dir);
+		return 1;
+	}
+
+	return (q.matches > 0) ? 0 : 1;
+}
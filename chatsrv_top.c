@@ -0,0 +1,238 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/*
+ * Live view of a running CHATSRV, started with --stats. Reads the shared
+ * stats segment of the server, so it neither talks to the server nor
+ * makes it do any work.
+ *
+ * Usage: ./chatsrv-top [-p port] [-n refreshes]
+ */
+
+#include <sys/types.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include "stats.h"
+
+#define MAX_TALKERS (STATS_MAX_WORKERS * STATS_TOP_TALKERS)
+
+/* A consistent view of all workers */
+typedef struct snapshot
+{
+	double taken;                 /* Seconds, CLOCK_MONOTONIC */
+	int workers;
+	stats_worker worker[STATS_MAX_WORKERS];
+} snapshot;
+
+/* A top talker with its rate */
+typedef struct talker
+{
+	const char *nickname;
+	double rate;
+} talker;
+
+static snapshot snapshots[2];
+
+
+/*
+ * Returns a monotonic timestamp in seconds.
+ */
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * Copies what all workers have published. Returns -1 if a worker could 
+ * not be read consistently.
+ */
+static int take_snapshot(stats_segment *seg, snapshot *snap)
+{
+	int i = 0;
+
+	snap->taken = now_s();
+	snap->workers = seg->workers;
+	if (snap->workers > STATS_MAX_WORKERS)
+		snap->workers = STATS_MAX_WORKERS;
+
+	for (i = 0; i < snap->workers; i++)
+	{
+		if (stats_read(&seg->worker[i], &snap->worker[i]) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Orders talkers by rate, busiest first.
+ */
+static int compare_talkers(const void *a, const void *b)
+{
+	double ra = ((const talker *)a)->rate;
+	double rb = ((const talker *)b)->rate;
+
+	return (ra < rb) - (ra > rb);
+}
+
+
+/*
+ * Shows the difference between two snapshots.
+ */
+static void show(stats_segment *seg, snapshot *prev, snapshot *cur, int clear)
+{
+	static talker talkers[MAX_TALKERS];
+	const stats_worker *p = NULL;
+	const stats_worker *c = NULL;
+	double elapsed = cur->taken - prev->taken;
+	double interval = 0;
+	unsigned long long sessions = 0;
+	unsigned long long queued = 0;
+	unsigned long long queued_sessions = 0;
+	unsigned long long max_queue = 0;
+	unsigned long long lagged = 0;
+	unsigned long long paused = 0;
+	double accepts = 0;
+	double in = 0;
+	double out = 0;
+	double bytes_in = 0;
+	double bytes_out = 0;
+	double pauses = 0;
+	double drops = 0;
+	long long up = time(NULL) - seg->started;
+	int count = 0;
+	int i = 0;
+	int j = 0;
+
+	for (i = 0; i < cur->workers; i++)
+	{
+		p = &prev->worker[i];
+		c = &cur->worker[i];
+		sessions += c->sessions;
+		queued += c->queued_bytes;
+		queued_sessions += c->queued_sessions;
+		lagged += c->lagged;
+		paused += c->paused;
+		if (c->max_queue > max_queue)
+			max_queue = c->max_queue;
+		accepts += c->accepts - p->accepts;
+		in += c->msgs_in - p->msgs_in;
+		out += c->msgs_out - p->msgs_out;
+		bytes_in += c->bytes_in - p->bytes_in;
+		bytes_out += c->bytes_out - p->bytes_out;
+		pauses += c->flood_pauses - p->flood_pauses;
+		drops += c->flood_drops - p->flood_drops;
+
+		interval = (c->interval > 0) ? c->interval / 1e9 : 1;
+		for (j = 0; j < (int)c->talker_count; j++)
+		{
+			talkers[count].nickname = c->talkers[j].nickname;
+			talkers[count].rate = c->talkers[j].lines / interval;
+			count++;
+		}
+	}
+	qsort(talkers, count, sizeof(talker), compare_talkers);
+
+	if (clear)
+		printf("\033[H\033[2J");
+	printf("chatsrv-top - pid %d, up %lld:%02lld:%02lld, %d worker(s)\n\n", seg->pid, 
+		up / 3600, (up / 60) % 60, up % 60, cur->workers);
+	printf("Sessions: %8llu       Accepts/s: %10.1f\n", sessions, accepts / elapsed);
+	printf("Lines in/s: %6.0f       Msgs out/s: %9.0f\n", in / elapsed, out / elapsed);
+	printf("KB in/s: %9.1f       KB out/s: %11.1f\n", bytes_in / elapsed / 1024, bytes_out / elapsed / 1024);
+	printf("Queued: %10llu B     Sessions queued: %4llu   Deepest: %llu B   Lagged: %llu\n", 
+		queued, queued_sessions, max_queue, lagged);
+	printf("Paused: %10llu       Pauses/s: %11.1f   Drops/s: %.1f\n\n", paused, pauses / elapsed, drops / elapsed);
+
+	printf("%-7s %9s %10s %11s %12s %11s\n", "WORKER", "SESSIONS", "LINES/S", "MSGS OUT/S", "QUEUED B", "DEEPEST B");
+	for (i = 0; i < cur->workers; i++)
+	{
+		p = &prev->worker[i];
+		c = &cur->worker[i];
+		printf("%-7d %9llu %10.0f %11.0f %12llu %11llu\n", i, c->sessions, 
+			(c->msgs_in - p->msgs_in) / elapsed, (c->msgs_out - p->msgs_out) / elapsed,
+			c->queued_bytes, c->max_queue);
+	}
+
+	printf("\n%-20s %10s\n", "TOP TALKERS", "LINES/S");
+	for (i = 0; (i < count) && (i < STATS_TOP_TALKERS); i++)
+		printf("%-20s %10.1f\n", talkers[i].nickname, talkers[i].rate);
+	printf("\n");
+	fflush(stdout);
+}
+
+
+int main(int argc, char *argv[])
+{
+	stats_segment *seg = NULL;
+	int port = 5555;
+	int refreshes = 0;
+	int cur = 0;
+	int n = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "p:n:h")) != -1)
+	{
+		switch (c)
+		{
+			case 'p': port = atoi(optarg); break;
+			case 'n': refreshes = atoi(optarg); break;
+			default:
+				printf("Usage: %s [-p port] [-n refreshes]\n", argv[0]);
+				return (c == 'h') ? 0 : 1;
+		}
+	}
+
+	seg = stats_attach(port);
+	if (seg == NULL)
+	{
+		fprintf(stderr, "No stats for port %d. Is chatsrv running with --stats?\n", port);
+		return 1;
+	}
+
+	while (take_snapshot(seg, &snapshots[cur]) != 0)
+		usleep(1000);
+	for (n = 0; (refreshes == 0) || (n < refreshes); n++)
+	{
+		sleep(1);
+		if ((kill(seg->pid, 0) != 0) && (errno == ESRCH))
+		{
+			fprintf(stderr, "Server has exited.\n");
+			return 1;
+		}
+		if (take_snapshot(seg, &snapshots[!cur]) != 0)
+			continue;
+		show(seg, &snapshots[cur], &snapshots[!cur], isatty(STDOUT_FILENO));
+		cur = !cur;
+	}
+
+	return 0;
+}
@@ -0,0 +1,189 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <string.h>
+#include "cmd.h"
+
+/* Argument syntax of a command */
+#define ARGS_NONE       0         /* No arguments at all */
+#define ARGS_NICK       1         /* A nickname */
+#define ARGS_NICK_TEXT  2         /* A nickname followed by free text */
+#define ARGS_TEXT       3         /* Free text */
+#define ARGS_COUNT      4         /* An optional number */
+
+#define MAX_COUNT_DIGITS 4        /* Max. digits of a number */
+
+typedef struct cmd_def
+{
+	const char *keyword;
+	size_t len;
+	int type;
+	int args;
+} cmd_def;
+
+/* Dispatch table, looked up by keyword */
+static const cmd_def commands[] = 
+{
+	{ "quit",    4, CMD_QUIT,    ARGS_NONE },
+	{ "nick",    4, CMD_NICK,    ARGS_NICK },
+	{ "msg",     3, CMD_MSG,     ARGS_NICK_TEXT },
+	{ "me",      2, CMD_ME,      ARGS_TEXT },
+	{ "who",     3, CMD_WHO,     ARGS_NONE },
+	{ "join",    4, CMD_JOIN,    ARGS_NICK },
+	{ "part",    4, CMD_PART,    ARGS_NONE },
+	{ "rooms",   5, CMD_ROOMS,   ARGS_NONE },
+	{ "history", 7, CMD_HISTORY, ARGS_COUNT },
+	{ NULL,      0, CMD_NONE,    ARGS_NONE }
+};
+
+
+/*
+ * Checks whether a character may be used in a nickname.
+ */
+static int is_nick_char(char c)
+{
+	return ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) || 
+		((c >= '0') && (c <= '9')) || (c == '_');
+}
+
+
+/*
+ * Returns the length of the nickname at the start of s, or 0 if there is
+ * no valid nickname.
+ */
+static size_t scan_nick(const char *s, size_t len)
+{
+	size_t i = 0;
+
+	while ((i < len) && is_nick_char(s[i]))
+		i++;
+
+	if (i > MAX_NICK_LEN)
+		return 0;
+
+	return i;
+}
+
+
+/*
+ * Parses a chat line. Anything not starting with a slash is a plain chat 
+ * line. Lines that look like a command but do not fit its syntax are 
+ * treated as plain chat lines, too. Returns the command type.
+ */
+int cmd_parse(const char *line, size_t len, command *cmd)
+{
+	const cmd_def *def = NULL;
+	const char *args = NULL;
+	size_t args_len = 0;
+	size_t keyword_len = 0;
+	size_t n = 0;
+
+	memset(cmd, 0, sizeof(command));
+	cmd->type = CMD_NONE;
+
+	if ((len == 0) || (line[0] != '/'))
+		return CMD_NONE;
+
+	/* Split off the keyword */
+	while ((keyword_len + 1 < len) && (line[keyword_len + 1] != ' '))
+		keyword_len++;
+
+	for (def = commands; def->keyword != NULL; def++)
+	{
+		if ((def->len == keyword_len) && (memcmp(line + 1, def->keyword, keyword_len) == 0))
+			break;
+	}
+	if (def->keyword == NULL)
+		return CMD_NONE;
+
+	/* Arguments follow the keyword after a single blank */
+	args = line + 1 + keyword_len;
+	args_len = len - 1 - keyword_len;
+
+	switch (def->args)
+	{
+		case ARGS_NONE:
+			if (args_len != 0)
+				return CMD_NONE;
+			break;
+
+		case ARGS_NICK:
+			if ((args_len < 2) || (args[0] != ' '))
+				return CMD_NONE;
+			n = scan_nick(args + 1, args_len - 1);
+			if ((n == 0) || (n != args_len - 1))
+				return CMD_NONE;
+			cmd->nick = args + 1;
+			cmd->nick_len = n;
+			break;
+
+		case ARGS_NICK_TEXT:
+			if ((args_len < 2) || (args[0] != ' '))
+				return CMD_NONE;
+			n = scan_nick(args + 1, args_len - 1);
+			if ((n == 0) || (n + 1 >= args_len) || (args[n + 1] != ' '))
+				return CMD_NONE;
+			cmd->nick = args + 1;
+			cmd->nick_len = n;
+			cmd->text = args + n + 2;
+			cmd->text_len = args_len - n - 2;
+			break;
+
+		case ARGS_TEXT:
+			if ((args_len < 1) || (args[0] != ' '))
+				return CMD_NONE;
+			cmd->text = args + 1;
+			cmd->text_len = args_len - 1;
+			break;
+
+		case ARGS_COUNT:
+			if (args_len == 0)
+				break;
+			if ((args_len < 2) || (args_len > MAX_COUNT_DIGITS + 1) || (args[0] != ' '))
+				return CMD_NONE;
+			for (n = 1; n < args_len; n++)
+			{
+				if ((args[n] < '0') || (args[n] > '9'))
+					return CMD_NONE;
+				cmd->count = cmd->count * 10 + (args[n] - '0');
+			}
+			break;
+	}
+
+	cmd->type = def->type;
+
+	return cmd->type;
+}
+
+
+/*
+ * Returns the keyword of a command type, "chat" for plain chat lines.
+ */
+const char* cmd_get_name(int type)
+{
+	const cmd_def *def = NULL;
+
+	for (def = commands; def->keyword != NULL; def++)
+	{
+		if (def->type == type)
+			return def->keyword;
+	}
+
+	return "chat";
+}
@@ -0,0 +1,57 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef CMD_H
+#define CMD_H
+
+#include <stddef.h>
+
+#define MAX_NICK_LEN    19        /* Max. length of a nickname */
+
+/* Command types */
+#define CMD_NONE        0         /* Plain chat line, or not a valid command */
+#define CMD_QUIT        1         /* /quit */
+#define CMD_NICK        2         /* /nick <nickname> */
+#define CMD_MSG         3         /* /msg <nickname> <message> */
+#define CMD_ME          4         /* /me <message> */
+#define CMD_WHO         5         /* /who */
+#define CMD_JOIN        6         /* /join <room> */
+#define CMD_PART        7         /* /part */
+#define CMD_ROOMS       8         /* /rooms */
+#define CMD_HISTORY     9         /* /history [count] */
+
+#define CMD_COUNT       10
+
+/* A parsed command. Arguments point into the parsed line and are not 
+ * terminated.
+ */
+typedef struct command
+{
+	int type;
+	const char *nick;             /* Nickname, or room name for /join */
+	size_t nick_len;
+	const char *text;
+	size_t text_len;
+	int count;                    /* Optional count, 0 if not given */
+} command;
+
+int cmd_parse(const char *line, size_t len, command *cmd);
+const char* cmd_get_name(int type);
+
+#endif /* CMD_H */
@@ -1,4 +1,4 @@
 #! /bin/sh
 
-tar --create --file=chatsrv-0.5.tar chatsrv.c llist2.c llist2.h log.c log.h bool.h colors.h Makefile COPYING README
+tar --create --file=chatsrv-0.5.tar chatsrv.c pool.c pool.h scan.c scan.h framer.c framer.h epoch.c epoch.h llist2.c llist2.h worker.c worker.h uring.c uring.h msg.c msg.h outq.c outq.h cmd.c cmd.h history.c history.h journal.c journal.h chatsrv_journal.c link.c link.h flood.c flood.h timer.c timer.h upgrade.c upgrade.h room.c room.h chatload.c hist.c hist.h metrics.c metrics.h stats.c stats.h chatsrv_top.c bench_parse.c bench_scan.c bench_micro.c log.c log.h bool.h colors.h Makefile COPYING README
 gzip chatsrv-0.5.tar
@@ -0,0 +1,163 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include "epoch.h"
+#include "pool.h"
+#include "log.h"
+
+/* Memory waiting for its grace period to end */
+typedef struct retired
+{
+	void *ptr;
+	void (*release)(void *);
+	unsigned long epoch;         /* Safe once all threads have seen it */
+	struct retired *next;
+} retired;
+
+static pool retired_pool = POOL_INITIALIZER("retired", sizeof(retired));
+
+/* Global epoch, advanced by every retire */
+static unsigned long global_epoch = 1;
+
+/* Latest epoch seen by each registered thread, 0 while offline */
+static unsigned long thread_epoch[EPOCH_MAX_THREADS];
+static int thread_count = 0;
+
+/* Per thread state */
+static __thread int thread_slot = -1;
+static __thread retired *limbo_head = NULL;
+static __thread retired *limbo_tail = NULL;
+
+
+/*
+ * Registers the calling thread as a reader. It starts out online.
+ */
+void epoch_register(void)
+{
+	int slot = __sync_fetch_and_add(&thread_count, 1);
+
+	if (slot >= EPOCH_MAX_THREADS)
+	{
+		logline(LOG_ERROR, "epoch_register(): Too many threads.");
+		exit(-1);
+	}
+
+	thread_slot = slot;
+	epoch_online();
+}
+
+
+/*
+ * Marks the calling thread as reading shared data again.
+ */
+void epoch_online(void)
+{
+	__atomic_store_n(&thread_epoch[thread_slot], __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST), 
+		__ATOMIC_SEQ_CST);
+	__sync_synchronize();
+}
+
+
+/*
+ * Marks the calling thread as not holding any pointers to shared data, 
+ * e.g. before it blocks.
+ */
+void epoch_offline(void)
+{
+	__sync_synchronize();
+	__atomic_store_n(&thread_epoch[thread_slot], 0, __ATOMIC_SEQ_CST);
+}
+
+
+/*
+ * Announces that the calling thread holds no pointers to shared data.
+ */
+void epoch_quiescent(void)
+{
+	__sync_synchronize();
+	epoch_online();
+}
+
+
+/*
+ * Releases memory that has been unlinked from all shared data once no
+ * thread can still hold a pointer to it. Retired memory is queued on the
+ * calling thread and released by its epoch_reclaim().
+ */
+void epoch_retire(void *ptr, void (*release)(void *))
+{
+	retired *r = NULL;
+
+	r = (retired *)pool_alloc(&retired_pool);
+	if (r == NULL)
+	{
+		logline(LOG_ERROR, "epoch_retire(): Out of memory, leaking %p.", ptr);
+		return;
+	}
+
+	r->ptr = ptr;
+	r->release = release;
+	r->epoch = __sync_add_and_fetch(&global_epoch, 1);
+	r->next = NULL;
+
+	if (limbo_tail != NULL)
+		limbo_tail->next = r;
+	else
+		limbo_head = r;
+	limbo_tail = r;
+}
+
+
+/*
+ * Releases all memory retired by the calling thread whose grace period 
+ * has ended.
+ */
+void epoch_reclaim(void)
+{
+	unsigned long oldest = 0;
+	unsigned long seen = 0;
+	retired *r = NULL;
+	int count = 0;
+	int i = 0;
+
+	if (limbo_head == NULL)
+		return;
+
+	/* Find the oldest epoch any online thread may still be reading in */
+	oldest = (unsigned long)-1;
+	count = __atomic_load_n(&thread_count, __ATOMIC_SEQ_CST);
+	for (i = 0; (i < count) && (i < EPOCH_MAX_THREADS); i++)
+	{
+		seen = __atomic_load_n(&thread_epoch[i], __ATOMIC_SEQ_CST);
+		if ((seen != 0) && (seen < oldest))
+			oldest = seen;
+	}
+
+	/* Epochs are retired in ascending order */
+	while ((limbo_head != NULL) && (limbo_head->epoch <= oldest))
+	{
+		r = limbo_head;
+		limbo_head = r->next;
+		if (limbo_head == NULL)
+			limbo_tail = NULL;
+		r->release(r->ptr);
+		pool_free(&retired_pool, r);
+	}
+}
@@ -0,0 +1,43 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#define EPOCH_MAX_THREADS 72     /* Workers plus helper threads */
+
+/* Quiescent-state based reclamation for data read without locks. 
+ *
+ * Threads reading shared data register once and announce quiescent 
+ * states, points at which they hold no pointers to shared data, e.g.
+ * between two iterations of their event loop. While blocked they go
+ * offline and do not hold anybody up. Memory unlinked by a writer is
+ * retired and released only after every online thread has passed a
+ * quiescent state, so a reader may use whatever it found up to its next
+ * quiescent state without taking a lock.
+ */
+
+void epoch_register(void);
+void epoch_online(void);
+void epoch_offline(void);
+void epoch_quiescent(void);
+void epoch_retire(void *ptr, void (*release)(void *));
+void epoch_reclaim(void);
+
+#endif /* EPOCH_H */
@@ -0,0 +1,170 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include "flood.h"
+#include "bool.h"
+
+/* Budgets per second, by FLOOD_* index. 0 means unlimited. */
+static int rates[FLOOD_BUCKETS] = { 20, 8192, 5, 10, 1 };
+
+/* Names used by flood_setup() */
+static char *const names[] = { "lines", "bytes", "chat", "msg", "who", NULL };
+
+static void refill(bucket *b, int rate, unsigned long long now);
+
+
+/*
+ * Sets the budgets from a list like "lines=20,chat=5". Budgets not named
+ * keep their defaults, "off" lifts all limits. Returns -1 if the list is
+ * invalid.
+ */
+int flood_setup(const char *spec)
+{
+	char buffer[256];
+	char *options = buffer;
+	char *value = NULL;
+	char *end = NULL;
+	long rate = 0;
+	int kind = 0;
+
+	if (strcmp(spec, "off") == 0)
+	{
+		memset(rates, 0, sizeof(rates));
+		return 0;
+	}
+
+	if (strlen(spec) >= sizeof(buffer))
+		return -1;
+	strcpy(buffer, spec);
+
+	while (*options != '\0')
+	{
+		kind = getsubopt(&options, names, &value);
+		if ((kind < 0) || (value == NULL))
+			return -1;
+		rate = strtol(value, &end, 10);
+		if ((end == value) || (*end != '\0') || (rate < 0) || (rate > 1000000000))
+			return -1;
+		rates[kind] = (int)rate;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Returns the budget per second of a kind, 0 if unlimited.
+ */
+int flood_get_rate(int kind)
+{
+	return rates[kind];
+}
+
+
+/*
+ * Fills all buckets of a new session.
+ */
+void flood_init(bucket *buckets, unsigned long long now)
+{
+	int i = 0;
+
+	for (i = 0; i < FLOOD_BUCKETS; i++)
+	{
+		buckets[i].tokens = (long long)rates[i] * 1000 * FLOOD_BURST_SECS;
+		buckets[i].stamp = now;
+	}
+}
+
+
+/*
+ * Adds the budget earned since the last refill, up to a full bucket.
+ */
+static void refill(bucket *b, int rate, unsigned long long now)
+{
+	long long full = (long long)rate * 1000 * FLOOD_BURST_SECS;
+
+	if (now > b->stamp)
+	{
+		b->tokens += (long long)(now - b->stamp) * rate;
+		b->stamp = now;
+	}
+	if (b->tokens > full)
+		b->tokens = full;
+}
+
+
+/*
+ * Charges input that has been received already, even if that runs the
+ * bucket into debt.
+ */
+void flood_charge(bucket *buckets, int kind, long amount, unsigned long long now)
+{
+	bucket *b = &buckets[kind];
+	int rate = rates[kind];
+
+	if (rate == 0)
+		return;
+
+	refill(b, rate, now);
+	b->tokens -= (long long)amount * 1000;
+}
+
+
+/*
+ * Takes one unit of a budget if it is left. Returns FALSE if not, the
+ * bucket is left as it is then.
+ */
+int flood_allow(bucket *buckets, int kind, unsigned long long now)
+{
+	bucket *b = &buckets[kind];
+	int rate = rates[kind];
+
+	if (rate == 0)
+		return TRUE;
+
+	refill(b, rate, now);
+	if (b->tokens < 1000)
+		return FALSE;
+	b->tokens -= 1000;
+
+	return TRUE;
+}
+
+
+/*
+ * Returns the number of ms until a bucket holds at least one unit again,
+ * 0 if it does now.
+ */
+long flood_wait(bucket *buckets, int kind, unsigned long long now)
+{
+	bucket *b = &buckets[kind];
+	int rate = rates[kind];
+
+	if (rate == 0)
+		return 0;
+
+	refill(b, rate, now);
+	if (b->tokens >= 1000)
+		return 0;
+
+	return (long)((1000 - b->tokens + rate - 1) / rate);
+}
@@ -0,0 +1,49 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef FLOOD_H
+#define FLOOD_H
+
+/* Budgets of a session, each with a token bucket */
+#define FLOOD_LINES      0        /* Lines received */
+#define FLOOD_BYTES      1        /* Bytes received */
+#define FLOOD_CHAT       2        /* Lines going to a whole room */
+#define FLOOD_MSG        3        /* Private messages */
+#define FLOOD_WHO        4        /* Listings: /who, /rooms, /history */
+#define FLOOD_BUCKETS    5
+
+#define FLOOD_BURST_SECS 2        /* A full bucket holds two seconds of budget */
+
+/* Budget left in a bucket, in thousandths of a line or byte. Input is 
+ * charged after it has been read, so a bucket may run into debt.
+ */
+typedef struct bucket
+{
+	long long tokens;
+	unsigned long long stamp;     /* Last refill, ms */
+} bucket;
+
+int flood_setup(const char *spec);
+int flood_get_rate(int kind);
+void flood_init(bucket *buckets, unsigned long long now);
+void flood_charge(bucket *buckets, int kind, long amount, unsigned long long now);
+int flood_allow(bucket *buckets, int kind, unsigned long long now);
+long flood_wait(bucket *buckets, int kind, unsigned long long now);
+
+#endif /* FLOOD_H */
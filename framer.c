@@ -0,0 +1,180 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <string.h>
+#include "framer.h"
+#include "pool.h"
+
+/* Incomplete lines are kept in buffers of max_line + 1 bytes */
+static size_t max_line = 1024;
+static pool partial_pool = POOL_INITIALIZER("partial_line", 1025);
+
+static int framer_emit(char *line, size_t len, int flags, framer_line_fn fn, void *arg);
+static int framer_keep(framer *f, const char *data, size_t len);
+
+
+/*
+ * Sets the maximum length of a line, not counting its terminator. Must 
+ * be called before the first line is framed.
+ */
+void framer_setup(size_t max)
+{
+	max_line = max;
+	partial_pool.size = max + 1;
+	scan_init();
+}
+
+
+/*
+ * Returns the maximum length of a line.
+ */
+size_t framer_max_line(void)
+{
+	return max_line;
+}
+
+
+/*
+ * Initializes a framer without any pending data.
+ */
+void framer_init(framer *f)
+{
+	f->partial = NULL;
+	f->len = 0;
+	f->discarding = 0;
+	scan_reset(&f->scan);
+}
+
+
+/*
+ * Hands a line to the callback, stripping a \r in front of the \n. The
+ * terminator is overwritten with a zero.
+ */
+static int framer_emit(char *line, size_t len, int flags, framer_line_fn fn, void *arg)
+{
+	if ((len > 0) && (line[len - 1] == '\r'))
+		len--;
+	line[len] = '\0';
+
+	return fn(arg, line, len, flags);
+}
+
+
+/*
+ * Appends data to the incomplete line. Returns -1 if the line gets too 
+ * long, it is dropped then.
+ */
+static int framer_keep(framer *f, const char *data, size_t len)
+{
+	if (f->len + len > max_line)
+	{
+		framer_clear(f);
+		return -1;
+	}
+
+	if (f->partial == NULL)
+	{
+		f->partial = (char *)pool_alloc(&partial_pool);
+		if (f->partial == NULL)
+			return -1;
+	}
+
+	memcpy(f->partial + f->len, data, len);
+	f->len += len;
+
+	return 0;
+}
+
+
+/*
+ * Feeds received data to the framer and calls fn for every line that is
+ * complete now. The data is scanned once, finding the line ends and 
+ * checking the contents on the way. Lines are passed without being 
+ * copied unless they started in an earlier read. Returns -1 if fn asked
+ * to stop, 0 otherwise.
+ */
+int framer_feed(framer *f, char *data, size_t len, framer_line_fn fn, void *arg)
+{
+	char *cur = data;
+	char *end = data + len;
+	size_t n = 0;
+	int flags = 0;
+	int ret = 0;
+
+	while (cur < end)
+	{
+		n = scan_line(&f->scan, cur, end - cur);
+		if (cur + n == end)
+		{
+			/* No terminator, keep the beginning of the next line */
+			if (!f->discarding && (framer_keep(f, cur, n) != 0))
+			{
+				f->discarding = 1;
+				if (fn(arg, NULL, 0, FRAMER_TOO_LONG) < 0)
+					return -1;
+			}
+			return 0;
+		}
+
+		flags = f->scan.flags;
+		scan_reset(&f->scan);
+
+		if (f->discarding)
+		{
+			f->discarding = 0;
+		}
+		else if (f->partial != NULL)
+		{
+			/* Complete the line left over from earlier reads. Room for
+			 * the zero has been reserved in the buffer.
+			 */
+			if (framer_keep(f, cur, n) != 0)
+				ret = fn(arg, NULL, 0, FRAMER_TOO_LONG);
+			else
+				ret = framer_emit(f->partial, f->len, flags, fn, arg);
+			framer_clear(f);
+		}
+		else if (n > max_line)
+		{
+			ret = fn(arg, NULL, 0, FRAMER_TOO_LONG);
+		}
+		else
+		{
+			ret = framer_emit(cur, n, flags, fn, arg);
+		}
+
+		if (ret < 0)
+			return -1;
+		cur += n + 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Discards pending data.
+ */
+void framer_clear(framer *f)
+{
+	if (f->partial != NULL)
+		pool_free(&partial_pool, f->partial);
+	f->partial = NULL;
+	f->len = 0;
+}
@@ -0,0 +1,55 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef FRAMER_H
+#define FRAMER_H
+
+#include <stddef.h>
+#include "scan.h"
+
+/* Problems with a line, in addition to SCAN_* */
+#define FRAMER_TOO_LONG 0x10      /* Exceeded the max. length and was dropped */
+
+/* Called for every complete line, without its terminator and with a 
+ * terminating zero in place of it. flags tells about control characters
+ * and invalid UTF-8 on the line. line is NULL for a line that has been
+ * dropped for exceeding the maximum length. A negative return value 
+ * stops framing, e.g. because the client is gone.
+ */
+typedef int (*framer_line_fn)(void *arg, char *line, size_t len, int flags);
+
+/* Splits the byte stream of a client into lines. Complete lines are 
+ * handed out right from the receive buffer. Only an incomplete line at 
+ * its end is kept, in a buffer that is allocated while it is needed.
+ */
+typedef struct framer
+{
+	char *partial;               /* Start of an incomplete line, or NULL */
+	size_t len;                  /* Bytes in partial */
+	int discarding;              /* Skipping the rest of a too long line */
+	scan_state scan;             /* Checks of the current line */
+} framer;
+
+void framer_setup(size_t max_line);
+size_t framer_max_line(void);
+void framer_init(framer *f);
+int framer_feed(framer *f, char *data, size_t len, framer_line_fn fn, void *arg);
+void framer_clear(framer *f);
+
+#endif /* FRAMER_H */
@@ -0,0 +1,158 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <string.h>
+#include "hist.h"
+
+static int hist_index(unsigned long long value);
+static unsigned long long hist_value(int index);
+
+
+/*
+ * Initializes an empty histogram.
+ */
+void hist_init(hist *h)
+{
+	memset(h, 0, sizeof(hist));
+	h->min = ~0ULL;
+}
+
+
+/*
+ * Returns the bucket a value is counted in.
+ */
+static int hist_index(unsigned long long value)
+{
+	int exp = 0;
+
+	if (value < HIST_SUB_COUNT)
+		return (int)value;
+
+	exp = 63 - __builtin_clzll(value);
+
+	return ((exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + 
+		(int)((value >> (exp - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1));
+}
+
+
+/*
+ * Returns the value in the middle of a bucket.
+ */
+static unsigned long long hist_value(int index)
+{
+	int exp = 0;
+	unsigned long long sub = 0;
+
+	if (index < HIST_SUB_COUNT)
+		return index;
+
+	exp = (index >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	sub = index & (HIST_SUB_COUNT - 1);
+
+	return ((HIST_SUB_COUNT + sub) << (exp - HIST_SUB_BITS)) + 
+		((1ULL << (exp - HIST_SUB_BITS)) >> 1);
+}
+
+
+/*
+ * Counts a value.
+ */
+void hist_record(hist *h, unsigned long long value)
+{
+	h->counts[hist_index(value)]++;
+	h->count++;
+	h->sum += value;
+	if (value < h->min)
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+}
+
+
+/*
+ * Adds the counts of src to dst.
+ */
+void hist_merge(hist *dst, const hist *src)
+{
+	int i = 0;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->counts[i] += src->counts[i];
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+
+/*
+ * Returns the value below which the given percentage of the recorded 
+ * values lies, or 0 for an empty histogram.
+ */
+unsigned long long hist_percentile(const hist *h, double percentile)
+{
+	unsigned long long rank = 0;
+	unsigned long long seen = 0;
+	unsigned long long value = 0;
+	int i = 0;
+
+	if (h->count == 0)
+		return 0;
+
+	rank = (unsigned long long)(percentile / 100.0 * h->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank > h->count)
+		rank = h->count;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+	{
+		seen += h->counts[i];
+		if (seen >= rank)
+			break;
+	}
+
+	/* The bucket middle may lie outside of what has actually been seen */
+	value = hist_value(i);
+	if (value < h->min)
+		value = h->min;
+	if (value > h->max)
+		value = h->max;
+
+	return value;
+}
+
+
+/*
+ * Returns the number of recorded values up to a limit. Values that share
+ * the bucket of the limit are counted as well.
+ */
+unsigned long long hist_count_below(const hist *h, unsigned long long limit)
+{
+	unsigned long long count = 0;
+	int last = hist_index(limit);
+	int i = 0;
+
+	for (i = 0; i <= last; i++)
+		count += h->counts[i];
+
+	return count;
+}
@@ -0,0 +1,46 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef HIST_H
+#define HIST_H
+
+#define HIST_SUB_BITS   6         /* 64 buckets per power of two, ~1.6% error */
+#define HIST_SUB_COUNT  (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS    ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+/* Histogram of 64 bit values with a fixed relative precision. Values 
+ * below HIST_SUB_COUNT are counted exactly, above that each power of two
+ * is split into HIST_SUB_COUNT buckets. Recording takes no allocation.
+ */
+typedef struct hist
+{
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long long min;
+	unsigned long long max;
+	unsigned long long counts[HIST_BUCKETS];
+} hist;
+
+void hist_init(hist *h);
+void hist_record(hist *h, unsigned long long value);
+void hist_merge(hist *dst, const hist *src);
+unsigned long long hist_percentile(const hist *h, double percentile);
+unsigned long long hist_count_below(const hist *h, unsigned long long limit);
+
+#endif /* HIST_H */
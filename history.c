@@ -0,0 +1,147 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <string.h>
+#include "history.h"
+#include "msg.h"
+
+/* Max. bytes kept per room, 0 disables the history */
+static size_t budget = 0;
+
+
+/*
+ * Sets the number of bytes every room may keep. Must be called before the
+ * first message is appended.
+ */
+void history_setup(size_t bytes)
+{
+	budget = bytes;
+}
+
+
+/*
+ * Returns the number of bytes every room may keep.
+ */
+size_t history_get_budget(void)
+{
+	return budget;
+}
+
+
+/*
+ * Initializes an empty history.
+ */
+void history_init(history *h)
+{
+	memset(h, 0, sizeof(history));
+	pthread_mutex_init(&h->mutex, NULL);
+}
+
+
+/*
+ * Appends a message, dropping the oldest ones once the slots or the byte
+ * budget are used up. Messages larger than the whole budget are not kept.
+ */
+void history_append(history *h, msg *m)
+{
+	msg *dropped[HISTORY_SLOTS];
+	int count = 0;
+	int i = 0;
+
+	if (m->len > budget)
+		return;
+
+	msg_get(m);
+	pthread_mutex_lock(&h->mutex);
+	while ((h->count == HISTORY_SLOTS) || (h->bytes + m->len > budget))
+	{
+		dropped[count++] = h->slots[h->head];
+		h->bytes -= h->slots[h->head]->len;
+		h->slots[h->head] = NULL;
+		h->head = (h->head + 1) % HISTORY_SLOTS;
+		h->count--;
+	}
+	h->slots[(h->head + h->count) % HISTORY_SLOTS] = m;
+	h->count++;
+	h->bytes += m->len;
+	pthread_mutex_unlock(&h->mutex);
+
+	/* Release outside the lock */
+	for (i = 0; i < count; i++)
+		msg_put(dropped[i]);
+}
+
+
+/*
+ * Takes references to the last n messages, as long as they add up to no 
+ * more than max_bytes, and stores them oldest first. Returns the number 
+ * of messages stored. The caller drops the references.
+ */
+int history_get(history *h, int n, size_t max_bytes, msg **out)
+{
+	size_t bytes = 0;
+	unsigned int first = 0;
+	int count = 0;
+	int i = 0;
+
+	if (n > HISTORY_SLOTS)
+		n = HISTORY_SLOTS;
+
+	pthread_mutex_lock(&h->mutex);
+	while ((count < n) && (count < (int)h->count))
+	{
+		first = (h->head + h->count - count - 1) % HISTORY_SLOTS;
+		if (bytes + h->slots[first]->len > max_bytes)
+			break;
+		bytes += h->slots[first]->len;
+		count++;
+	}
+	first = (h->head + h->count - count) % HISTORY_SLOTS;
+	for (i = 0; i < count; i++)
+		out[i] = msg_get(h->slots[(first + i) % HISTORY_SLOTS]);
+	pthread_mutex_unlock(&h->mutex);
+
+	return count;
+}
+
+
+/*
+ * Drops all messages.
+ */
+void history_clear(history *h)
+{
+	msg *dropped[HISTORY_SLOTS];
+	int count = 0;
+	int i = 0;
+
+	pthread_mutex_lock(&h->mutex);
+	while (h->count > 0)
+	{
+		dropped[count++] = h->slots[h->head];
+		h->slots[h->head] = NULL;
+		h->head = (h->head + 1) % HISTORY_SLOTS;
+		h->count--;
+	}
+	h->head = 0;
+	h->bytes = 0;
+	pthread_mutex_unlock(&h->mutex);
+
+	for (i = 0; i < count; i++)
+		msg_put(dropped[i]);
+}
@@ -0,0 +1,51 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define HISTORY_SLOTS   256       /* Max. number of messages kept per room */
+
+struct msg;
+
+/* Recent messages of a room, oldest first. The ring holds a reference to 
+ * each message, which is the very message sent to the members, so 
+ * keeping it costs no copy. Every ring has its own lock, held for a few
+ * pointer updates only.
+ */
+typedef struct history
+{
+	pthread_mutex_t mutex;
+	struct msg *slots[HISTORY_SLOTS];
+	unsigned int head;            /* Slot of the oldest message */
+	unsigned int count;
+	size_t bytes;                 /* Size of all messages kept */
+} history;
+
+void history_setup(size_t budget);
+size_t history_get_budget(void);
+void history_init(history *h);
+void history_append(history *h, struct msg *m);
+int history_get(history *h, int n, size_t max_bytes, struct msg **out);
+void history_clear(history *h);
+
+#endif /* HISTORY_H */
@@ -0,0 +1,756 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include "journal.h"
+#include "msg.h"
+#include "log.h"
+
+#define JOURNAL_NAME_MAX  31      /* Max. length of a sender or room name */
+#define JOURNAL_BATCH     1024    /* Records written between syncs */
+#define JOURNAL_PATH_MAX  4096
+
+/* A record waiting for the writer, same protocol as the log ring */
+typedef struct journal_slot
+{
+	unsigned long seq;
+	int type;
+	unsigned long long time;
+	char sender[JOURNAL_NAME_MAX + 1];
+	char room[JOURNAL_NAME_MAX + 1];
+	msg *text;                    /* NULL if out of memory */
+} journal_slot;
+
+/* The segment being written. Only used by the writer thread. */
+typedef struct journal_segment
+{
+	int fd;
+	char *base;
+	unsigned long number;
+	size_t offset;                /* Where the next record goes */
+	size_t next_index;            /* Next offset to be indexed */
+	size_t synced;                /* Bytes synced so far */
+	unsigned long long last_time;
+} journal_segment;
+
+static int enabled = 0;
+static int stop = 0;
+static int sync_policy = JOURNAL_SYNC_SECOND;
+static char journal_dir[JOURNAL_PATH_MAX];
+static pthread_t writer_thread;
+static int wake_fd = -1;             /* Kept open like the ring */
+static journal_slot *ring = NULL;
+static unsigned long ring_tail = 0;
+static unsigned long ring_head = 0;
+static journal_segment current;
+static unsigned long records_written = 0;
+static unsigned long records_dropped = 0;
+static unsigned long segments_started = 0;
+
+static int list_segments(const char *dir, unsigned long **numbers);
+static int compare_numbers(const void *a, const void *b);
+static int start_segment(journal_segment *seg, unsigned long number);
+static int start_unused_segment(journal_segment *seg, unsigned long number);
+static void finish_segment(journal_segment *seg);
+static void sync_segment(journal_segment *seg);
+static void write_record(journal_slot *slot);
+static void journal_wake(void);
+static void* journal_writer(void *arg);
+static int replay_segment(const char *dir, unsigned long number, unsigned long long since, 
+	journal_fn fn, void *arg);
+
+
+/*
+ * Returns the current time in nanoseconds since the epoch.
+ */
+unsigned long long journal_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/*
+ * Orders segment numbers ascending.
+ */
+static int compare_numbers(const void *a, const void *b)
+{
+	unsigned long na = *(const unsigned long *)a;
+	unsigned long nb = *(const unsigned long *)b;
+
+	return (na > nb) - (na < nb);
+}
+
+
+/*
+ * Collects the numbers of all segments in a directory, oldest first. The
+ * caller frees the array. Returns the number of segments, or -1 if the
+ * directory cannot be read.
+ */
+static int list_segments(const char *dir, unsigned long **numbers)
+{
+	struct dirent *de = NULL;
+	unsigned long *list = NULL;
+	unsigned long *grown = NULL;
+	unsigned long number = 0;
+	char name[32];
+	int capacity = 0;
+	int count = 0;
+	DIR *d = NULL;
+
+	d = opendir(dir);
+	if (d == NULL)
+		return -1;
+
+	while ((de = readdir(d)) != NULL)
+	{
+		if (sscanf(de->d_name, "journal-%8lu.seg", &number) != 1)
+			continue;
+		snprintf(name, sizeof(name), JOURNAL_NAME_FMT, number);
+		if (strcmp(name, de->d_name) != 0)
+			continue;
+
+		if (count == capacity)
+		{
+			capacity = (capacity == 0) ? 64 : capacity * 2;
+			grown = (unsigned long *)realloc(list, capacity * sizeof(unsigned long));
+			if (grown == NULL)
+			{
+				free(list);
+				closedir(d);
+				return -1;
+			}
+			list = grown;
+		}
+		list[count++] = number;
+	}
+	closedir(d);
+
+	if (count > 0)
+		qsort(list, count, sizeof(unsigned long), compare_numbers);
+	*numbers = list;
+
+	return count;
+}
+
+
+/*
+ * Creates and maps a new segment. Returns -2 if the segment exists 
+ * already, -1 on other errors.
+ */
+static int start_segment(journal_segment *seg, unsigned long number)
+{
+	char path[JOURNAL_PATH_MAX + 32];
+	journal_header *header = NULL;
+	int fd = -1;
+
+	snprintf(path, sizeof(path), "%s/" JOURNAL_NAME_FMT, journal_dir, number);
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if ((fd < 0) && (errno == EEXIST))
+	{
+		logline(LOG_DEBUG, "start_segment(): Journal segment %s exists already", path);
+		return -2;
+	}
+	if (fd < 0)
+	{
+		logline(LOG_ERROR, "Cannot create journal segment %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	/* The file is sparse, unwritten parts read as zero */
+	if (ftruncate(fd, JOURNAL_SEGMENT_SIZE) != 0)
+	{
+		logline(LOG_ERROR, "Cannot size journal segment %s: %s", path, strerror(errno));
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+
+	seg->base = (char *)mmap(NULL, JOURNAL_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (seg->base == MAP_FAILED)
+	{
+		logline(LOG_ERROR, "Cannot map journal segment %s: %s", path, strerror(errno));
+		seg->base = NULL;
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+
+	header = (journal_header *)seg->base;
+	header->magic = JOURNAL_MAGIC;
+	header->version = JOURNAL_VERSION;
+	header->segment = number;
+	header->index_count = 0;
+
+	seg->fd = fd;
+	seg->number = number;
+	seg->offset = JOURNAL_HEADER_SIZE;
+	seg->next_index = JOURNAL_HEADER_SIZE;
+	seg->synced = 0;
+	__atomic_add_fetch(&segments_started, 1, __ATOMIC_RELAXED);
+	logline(LOG_DEBUG, "start_segment(): Writing journal segment %s", path);
+
+	return 0;
+}
+
+
+/*
+ * Starts a segment with the given number, or after the last one in the
+ * directory if that number is taken. Another process may be writing the
+ * same directory for a moment, like the two processes of a hot upgrade.
+ * Returns -1 on error.
+ */
+static int start_unused_segment(journal_segment *seg, unsigned long number)
+{
+	unsigned long *numbers = NULL;
+	int count = 0;
+	int ret = 0;
+
+	ret = start_segment(seg, number);
+	if (ret != -2)
+		return ret;
+
+	count = list_segments(journal_dir, &numbers);
+	if (count < 0)
+		return -1;
+	if ((count > 0) && (numbers[count - 1] >= number))
+		number = numbers[count - 1] + 1;
+	free(numbers);
+
+	return (start_segment(seg, number) == 0) ? 0 : -1;
+}
+
+
+/*
+ * Writes back what has been written to the segment so far.
+ */
+static void sync_segment(journal_segment *seg)
+{
+	if ((seg->base == NULL) || (seg->synced == seg->offset))
+		return;
+
+	if (msync(seg->base, seg->offset, MS_SYNC) != 0)
+		logline(LOG_ERROR, "Cannot sync journal segment %lu: %s", seg->number, strerror(errno));
+	seg->synced = seg->offset;
+}
+
+
+/*
+ * Unmaps the segment being written.
+ */
+static void finish_segment(journal_segment *seg)
+{
+	if (seg->base == NULL)
+		return;
+
+	if (sync_policy != JOURNAL_SYNC_NONE)
+		sync_segment(seg);
+	munmap(seg->base, JOURNAL_SEGMENT_SIZE);
+	close(seg->fd);
+	seg->base = NULL;
+	seg->fd = -1;
+}
+
+
+/*
+ * Appends a record to the current segment, moving on to a new segment 
+ * when it is full. The record is published by writing its size last.
+ */
+static void write_record(journal_slot *slot)
+{
+	journal_header *header = NULL;
+	journal_record *rec = NULL;
+	size_t sender_len = strlen(slot->sender);
+	size_t room_len = strlen(slot->room);
+	size_t size = 0;
+	uint32_t count = 0;
+
+	size = offsetof(journal_record, data) + sender_len + room_len + slot->text->len;
+	size = (size + 7) & ~(size_t)7;
+
+	/* No segment is mapped if starting the last one failed */
+	if ((current.base == NULL) || (current.offset + size > JOURNAL_SEGMENT_SIZE))
+	{
+		finish_segment(&current);
+		if (start_unused_segment(&current, current.number + 1) != 0)
+		{
+			__sync_add_and_fetch(&records_dropped, 1);
+			return;
+		}
+	}
+
+	/* Records of several threads may be a little out of order */
+	if (slot->time < current.last_time)
+		slot->time = current.last_time;
+	current.last_time = slot->time;
+
+	rec = (journal_record *)(current.base + current.offset);
+	rec->type = slot->type;
+	rec->sender_len = sender_len;
+	rec->room_len = room_len;
+	rec->time = slot->time;
+	rec->text_len = slot->text->len;
+	memcpy(rec->data, slot->sender, sender_len);
+	memcpy(rec->data + sender_len, slot->room, room_len);
+	memcpy(rec->data + sender_len + room_len, slot->text->data, slot->text->len);
+
+	/* Index the first record in every stride */
+	header = (journal_header *)current.base;
+	count = header->index_count;
+	if ((current.offset >= current.next_index) && (count < JOURNAL_INDEX_MAX))
+	{
+		header->index[count].time = slot->time;
+		header->index[count].offset = current.offset;
+		__atomic_store_n(&header->index_count, count + 1, __ATOMIC_RELEASE);
+		current.next_index = JOURNAL_HEADER_SIZE + 
+			((current.offset - JOURNAL_HEADER_SIZE) / JOURNAL_INDEX_STRIDE + 1) * JOURNAL_INDEX_STRIDE;
+	}
+
+	__atomic_store_n(&rec->size, size, __ATOMIC_RELEASE);
+	current.offset += size;
+	__atomic_add_fetch(&records_written, 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Wakes up the journal writer.
+ */
+static void journal_wake(void)
+{
+	uint64_t one = 1;
+
+	if (write(wake_fd, &one, sizeof(one)) != sizeof(one))
+		return;
+}
+
+
+/*
+ * Thread entry point of the journal writer. Copies queued records into 
+ * the mapped segment and syncs according to the policy. Waits for a 
+ * wakeup when there is nothing to write, or until the next sync is due
+ * if there is unsynced data.
+ */
+static void* journal_writer(void *arg)
+{
+	struct pollfd pfd;
+	journal_slot *slot = NULL;
+	unsigned long long last_sync = 0;
+	unsigned long long now = 0;
+	uint64_t count = 0;
+	int timeout = 0;
+	int stopping = 0;
+	int n = 0;
+
+	pfd.fd = wake_fd;
+	pfd.events = POLLIN;
+
+	while (1)
+	{
+		stopping = __atomic_load_n(&stop, __ATOMIC_ACQUIRE);
+
+		for (n = 0; n < JOURNAL_BATCH; n++)
+		{
+			slot = &ring[ring_head & (JOURNAL_RING_SIZE - 1)];
+			if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ring_head + 1)
+				break;
+
+			if (slot->text != NULL)
+			{
+				write_record(slot);
+				msg_put(slot->text);
+				slot->text = NULL;
+			}
+
+			/* Hand the slot back to the producers */
+			__atomic_store_n(&slot->seq, ring_head + JOURNAL_RING_SIZE, __ATOMIC_RELEASE);
+			__atomic_store_n(&ring_head, ring_head + 1, __ATOMIC_RELAXED);
+		}
+
+		if (sync_policy == JOURNAL_SYNC_BATCH)
+		{
+			sync_segment(&current);
+		}
+		else if (sync_policy == JOURNAL_SYNC_SECOND)
+		{
+			now = journal_now();
+			if (now - last_sync >= 1000000000ULL)
+			{
+				sync_segment(&current);
+				last_sync = now;
+			}
+		}
+
+		if (n > 0)
+			continue;
+		if (stopping)
+			break;
+
+		/* A record published after the check below finds ring_head at 
+		 * its slot and wakes the writer up, see journal_append()
+		 */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		slot = &ring[ring_head & (JOURNAL_RING_SIZE - 1)];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == ring_head + 1)
+			continue;
+
+		timeout = -1;
+		if ((sync_policy == JOURNAL_SYNC_SECOND) && (current.synced != current.offset))
+		{
+			now = journal_now();
+			if (now - last_sync < 1000000000ULL)
+				timeout = (int)((last_sync + 1000000000ULL - now) / 1000000) + 1;
+			else
+				timeout = 0;
+		}
+		if ((poll(&pfd, 1, timeout) > 0) && (read(wake_fd, &count, sizeof(count)) < 0))
+			count = 0;
+	}
+
+	finish_segment(&current);
+
+	return NULL;
+}
+
+
+/*
+ * Starts journaling chat lines into a new segment in a directory. Older 
+ * segments are left as they are. Returns -1 on error.
+ */
+int journal_open(const char *dir, int policy)
+{
+	unsigned long *numbers = NULL;
+	unsigned long next = 1;
+	sigset_t all;
+	sigset_t old;
+	unsigned long i = 0;
+	int count = 0;
+	int ret = 0;
+
+	if (strlen(dir) >= sizeof(journal_dir))
+		return -1;
+	strcpy(journal_dir, dir);
+	sync_policy = policy;
+
+	count = list_segments(dir, &numbers);
+	if (count < 0)
+	{
+		logline(LOG_ERROR, "Cannot read journal directory %s: %s", dir, strerror(errno));
+		return -1;
+	}
+	if (count > 0)
+		next = numbers[count - 1] + 1;
+	free(numbers);
+
+	memset(&current, 0, sizeof(current));
+	current.fd = -1;
+	current.last_time = journal_now();
+	if (start_unused_segment(&current, next) != 0)
+		return -1;
+
+	ring = (journal_slot *)calloc(JOURNAL_RING_SIZE, sizeof(journal_slot));
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if ((ring == NULL) || (wake_fd < 0))
+	{
+		free(ring);
+		if (wake_fd >= 0)
+			close(wake_fd);
+		ring = NULL;
+		wake_fd = -1;
+		finish_segment(&current);
+		return -1;
+	}
+	for (i = 0; i < JOURNAL_RING_SIZE; i++)
+		ring[i].seq = i;
+	ring_head = 0;
+	ring_tail = 0;
+	stop = 0;
+
+	/* Signals are left to the other threads, see log_start_async() */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&writer_thread, NULL, journal_writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0)
+	{
+		free(ring);
+		close(wake_fd);
+		ring = NULL;
+		wake_fd = -1;
+		finish_segment(&current);
+		return -1;
+	}
+
+	__atomic_store_n(&enabled, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+
+/*
+ * Writes out everything still queued and closes the current segment.
+ */
+void journal_close(void)
+{
+	if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE))
+		return;
+
+	__atomic_store_n(&enabled, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+	journal_wake();
+	pthread_join(writer_thread, NULL);
+}
+
+
+/*
+ * Queues a chat line for the journal. The text is copied, names longer 
+ * than JOURNAL_NAME_MAX are cut. The line is dropped and counted if the 
+ * writer falls behind, callers never wait. The writer is only woken up
+ * for a line that went into an empty ring. Returns -1 if the line was 
+ * dropped.
+ */
+int journal_append(int type, const char *sender, const char *room, const char *text, size_t len)
+{
+	journal_slot *slot = NULL;
+	msg *copy = NULL;
+	unsigned long pos = 0;
+	unsigned long seq = 0;
+	long diff = 0;
+
+	if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE))
+		return 0;
+
+	pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+	while (1)
+	{
+		slot = &ring[pos & (JOURNAL_RING_SIZE - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (long)(seq - pos);
+		if (diff == 0)
+		{
+			if (__atomic_compare_exchange_n(&ring_tail, &pos, pos + 1, 0, 
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (diff < 0)
+		{
+			__sync_add_and_fetch(&records_dropped, 1);
+			return -1;
+		}
+		else
+		{
+			pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->type = type;
+	slot->time = journal_now();
+	snprintf(slot->sender, sizeof(slot->sender), "%s", sender);
+	snprintf(slot->room, sizeof(slot->room), "%s", room);
+	copy = msg_create(text, len);
+	if (copy == NULL)
+		__sync_add_and_fetch(&records_dropped, 1);
+	slot->text = copy;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* Pairs with the fence of the writer before it waits */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring_head, __ATOMIC_RELAXED) == pos)
+		journal_wake();
+
+	/* The slot may already be reused once it is published */
+	return (copy != NULL) ? 0 : -1;
+}
+
+
+/*
+ * Calls a function for the records of a segment from a point in time on.
+ * The index tells where to start, records before are not read. Returns 1
+ * if the callback asked to stop, 0 otherwise.
+ */
+static int replay_segment(const char *dir, unsigned long number, unsigned long long since, 
+	journal_fn fn, void *arg)
+{
+	char path[JOURNAL_PATH_MAX + 32];
+	const journal_header *header = NULL;
+	const journal_record *rec = NULL;
+	journal_entry entry;
+	struct stat st;
+	char *base = NULL;
+	size_t offset = JOURNAL_HEADER_SIZE;
+	size_t size = 0;
+	uint32_t count = 0;
+	int lo = 0;
+	int hi = 0;
+	int mid = 0;
+	int ret = 0;
+	int fd = -1;
+
+	snprintf(path, sizeof(path), "%s/" JOURNAL_NAME_FMT, dir, number);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if ((fstat(fd, &st) != 0) || (st.st_size < JOURNAL_HEADER_SIZE) || (st.st_size > JOURNAL_SEGMENT_SIZE))
+	{
+		close(fd);
+		return 0;
+	}
+	base = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return 0;
+
+	header = (const journal_header *)base;
+	if ((header->magic != JOURNAL_MAGIC) || (header->version != JOURNAL_VERSION))
+	{
+		munmap(base, st.st_size);
+		return 0;
+	}
+
+	/* Last indexed record not newer than since */
+	count = __atomic_load_n(&header->index_count, __ATOMIC_ACQUIRE);
+	if (count > JOURNAL_INDEX_MAX)
+		count = JOURNAL_INDEX_MAX;
+	lo = 0;
+	hi = (int)count - 1;
+	while (lo <= hi)
+	{
+		mid = (lo + hi) / 2;
+		if (header->index[mid].time <= since)
+		{
+			offset = header->index[mid].offset;
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid - 1;
+		}
+	}
+
+	while (offset + offsetof(journal_record, data) <= (size_t)st.st_size)
+	{
+		rec = (const journal_record *)(base + offset);
+		size = __atomic_load_n(&rec->size, __ATOMIC_ACQUIRE);
+		if ((size < offsetof(journal_record, data)) || (size % 8 != 0) || (offset + size > (size_t)st.st_size) ||
+			(offsetof(journal_record, data) + rec->sender_len + rec->room_len + rec->text_len > size))
+			break;
+
+		if (rec->time >= since)
+		{
+			entry.type = rec->type;
+			entry.time = rec->time;
+			entry.sender = rec->data;
+			entry.sender_len = rec->sender_len;
+			entry.room = rec->data + rec->sender_len;
+			entry.room_len = rec->room_len;
+			entry.text = rec->data + rec->sender_len + rec->room_len;
+			entry.text_len = rec->text_len;
+			if (fn(arg, &entry) != 0)
+			{
+				ret = 1;
+				break;
+			}
+		}
+		offset += size;
+	}
+
+	munmap(base, st.st_size);
+
+	return ret;
+}
+
+
+/*
+ * Calls a function for every record in a journal directory written at or
+ * after since, oldest first. Segments and records before since are 
+ * skipped with the help of the segment indexes, not read. Returns -1 if 
+ * the directory cannot be read.
+ */
+int journal_replay(const char *dir, unsigned long long since, journal_fn fn, void *arg)
+{
+	char path[JOURNAL_PATH_MAX + 32];
+	unsigned long *numbers = NULL;
+	journal_header header;
+	int start = 0;
+	int count = 0;
+	int fd = -1;
+	int i = 0;
+
+	count = list_segments(dir, &numbers);
+	if (count < 0)
+		return -1;
+	if (count == 0)
+	{
+		free(numbers);
+		return 0;
+	}
+
+	/* Newest segment starting no later than since */
+	for (i = count - 1; i > 0; i--)
+	{
+		snprintf(path, sizeof(path), "%s/" JOURNAL_NAME_FMT, dir, numbers[i]);
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			continue;
+		if ((pread(fd, &header, sizeof(header), 0) == sizeof(header)) && (header.magic == JOURNAL_MAGIC) &&
+			(header.index_count > 0) && (header.index[0].time <= since))
+		{
+			close(fd);
+			break;
+		}
+		close(fd);
+	}
+	start = i;
+
+	for (i = start; i < count; i++)
+	{
+		if (replay_segment(dir, numbers[i], since, fn, arg) != 0)
+			break;
+	}
+	free(numbers);
+
+	return 0;
+}
+
+
+/*
+ * Reports how many records the journal has written and dropped.
+ */
+void journal_get_stats(journal_stats *stats)
+{
+	stats->written = __atomic_load_n(&records_written, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&records_dropped, __ATOMIC_RELAXED);
+	stats->segments = __atomic_load_n(&segments_started, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,112 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define JOURNAL_MAGIC        0x4a524e4c  /* "JRNL" */
+#define JOURNAL_VERSION      1
+#define JOURNAL_SEGMENT_SIZE (16 * 1024 * 1024)  /* Size of a segment file */
+#define JOURNAL_HEADER_SIZE  4096     /* Segment header, holds the index */
+#define JOURNAL_INDEX_MAX    254      /* Index entries per segment */
+#define JOURNAL_INDEX_STRIDE ((JOURNAL_SEGMENT_SIZE - JOURNAL_HEADER_SIZE) / JOURNAL_INDEX_MAX)
+#define JOURNAL_RING_SIZE    4096     /* Records buffered for the writer, power of 2 */
+#define JOURNAL_NAME_FMT     "journal-%08lu.seg"
+
+/* Record types */
+#define JOURNAL_CHAT         1        /* Chat line */
+#define JOURNAL_ME           2        /* /me line */
+
+/* Sync policies */
+#define JOURNAL_SYNC_NONE    1        /* Leave writing back to the kernel */
+#define JOURNAL_SYNC_SECOND  2        /* msync() at most once per second */
+#define JOURNAL_SYNC_BATCH   3        /* msync() after every batch */
+
+/* Entry of the sparse time index. The first record starting in every 
+ * stride of a segment is indexed.
+ */
+typedef struct journal_index
+{
+	uint64_t time;                /* Nanoseconds since the epoch */
+	uint32_t offset;              /* Offset of the record in the segment */
+	uint32_t reserved;
+} journal_index;
+
+/* Start of every segment file. Records follow at JOURNAL_HEADER_SIZE. */
+typedef struct journal_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t segment;             /* Number of the segment */
+	uint32_t index_count;         /* Index entries in use */
+	uint32_t reserved;
+	journal_index index[JOURNAL_INDEX_MAX];
+} journal_header;
+
+/* A record as stored. Sender, room and text follow the header without 
+ * terminators, the record is padded to 8 bytes. size is written last, a 
+ * record with size 0 has not been completed.
+ */
+typedef struct journal_record
+{
+	uint32_t size;                /* Bytes up to the next record */
+	uint8_t type;
+	uint8_t sender_len;
+	uint8_t room_len;
+	uint8_t reserved;
+	uint64_t time;                /* Nanoseconds since the epoch, never decreasing */
+	uint32_t text_len;
+	char data[];
+} journal_record;
+
+/* A record handed to a replay callback. Strings are not terminated. */
+typedef struct journal_entry
+{
+	int type;
+	unsigned long long time;
+	const char *sender;
+	size_t sender_len;
+	const char *room;
+	size_t room_len;
+	const char *text;
+	size_t text_len;
+} journal_entry;
+
+/* Counters of the journal writer */
+typedef struct journal_stats
+{
+	unsigned long written;        /* Records written out */
+	unsigned long dropped;        /* Records lost because the ring was full */
+	unsigned long segments;       /* Segments started */
+} journal_stats;
+
+/* Replay callback, returns non-zero to stop */
+typedef int (*journal_fn)(void *arg, const journal_entry *entry);
+
+int journal_open(const char *dir, int sync_policy);
+void journal_close(void);
+int journal_append(int type, const char *sender, const char *room, const char *text, size_t len);
+int journal_replay(const char *dir, unsigned long long since, journal_fn fn, void *arg);
+unsigned long long journal_now(void);
+void journal_get_stats(journal_stats *stats);
+
+#endif /* JOURNAL_H */
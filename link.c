@@ -0,0 +1,1228 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "link.h"
+#include "llist2.h"
+#include "room.h"
+#include "msg.h"
+#include "epoch.h"
+#include "metrics.h"
+#include "log.h"
+#include "bool.h"
+
+#define LINK_USER_BUCKETS 4096    /* Buckets of the remote user table, power of 2 */
+#define LINK_EVENTS       64      /* Max. number of events per epoll_wait() */
+#define LINK_ENTRY_HEADER 8       /* Target node and length of an outbox entry */
+
+/* A user on another node */
+typedef struct remote_user
+{
+	char nickname[20];
+	char room[MAX_ROOM_LEN + 1];
+	int node;
+	struct remote_user *next;
+} remote_user;
+
+struct peer_link;
+
+/* A node to connect to */
+typedef struct peer
+{
+	char host[256];
+	char port[8];
+	struct peer_link *link;       /* NULL while not connected */
+	time_t next_attempt;
+} peer;
+
+/* A connection to another node. Only used by the link thread. */
+typedef struct peer_link
+{
+	int fd;                       /* -1 if the slot is free */
+	int node;                     /* Node at the other end, 0 until HELLO */
+	int connected;                /* FALSE while connect() is in progress */
+	peer *peer;                   /* Peer connected to, NULL if accepted */
+	char in[LINK_LINE_MAX];       /* Incomplete line received so far */
+	size_t in_len;
+	char *out;                    /* Output not written yet */
+	size_t out_off;
+	size_t out_len;
+	size_t out_cap;
+} peer_link;
+
+static int enabled = 0;
+static int node_id = 0;
+static const link_handlers *handlers = NULL;
+static int epoll_fd = -1;
+static int listen_fd = -1;
+static int wake_fd = -1;
+static peer peers[LINK_MAX_PEERS];
+static int peer_count = 0;
+static peer_link links[LINK_MAX_LINKS];
+
+/* Tags identifying the non-link descriptors in the epoll set */
+static char listener_tag;
+static char wakeup_tag;
+
+/* Users of other nodes, looked up by nickname */
+static remote_user *users[LINK_USER_BUCKETS];
+static pthread_mutex_t users_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Lines queued by the workers, each prefixed with its target node (0 for
+ * all nodes) and length. The link thread takes the whole buffer at once.
+ */
+static pthread_mutex_t outbox_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *outbox = NULL;
+static size_t outbox_len = 0;
+static size_t outbox_cap = 0;
+static unsigned long outbox_dropped = 0;
+
+/* The link thread stops while the server is handed over, see link_pause() */
+static pthread_mutex_t pause_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pause_cond = PTHREAD_COND_INITIALIZER;
+static int pause_requested = 0;
+static int paused = 0;
+
+static void outbox_push(int target, const char *format, ...);
+static unsigned int users_hash(const char *nick);
+static void users_set(const char *nick, int node, const char *room);
+static void users_remove(const char *nick, int node);
+static void users_rename(const char *oldnick, const char *newnick, int node);
+static void users_purge(int node);
+static void link_queue(peer_link *l, const char *data, size_t len);
+static void link_queue_line(peer_link *l, const char *format, ...);
+static int link_flush(peer_link *l);
+static void link_drop(peer_link *l, const char *reason);
+static void link_up(peer_link *l);
+static void link_sync_user(list_entry *entry, void *arg);
+static void link_hello(peer_link *l, int node);
+static void link_check_claim(const char *nick, int node);
+static void link_process_line(peer_link *l, char *line);
+static void link_read(peer_link *l);
+static peer_link* link_add(int fd, peer *p, int connected);
+static void link_connect(peer *p);
+static void link_accept(void);
+static void link_distribute(char *buffer, size_t len);
+static void link_park(void);
+static void* link_thread(void *arg);
+static int link_listen(const char *ip, int port);
+
+
+/*
+ * Queues a protocol line for other nodes. Workers never wait for the 
+ * network, if the link thread falls behind, lines are dropped.
+ */
+static void outbox_push(int target, const char *format, ...)
+{
+	char line[LINK_LINE_MAX];
+	uint32_t len = 0;
+	uint64_t one = 1;
+	va_list args;
+	size_t needed = 0;
+	size_t capacity = 0;
+	char *grown = NULL;
+	int was_empty = FALSE;
+	int n = 0;
+
+	va_start(args, format);
+	n = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	if ((n < 0) || (n >= (int)sizeof(line)))
+		return;
+	len = n;
+
+	pthread_mutex_lock(&outbox_mutex);
+	needed = outbox_len + LINK_ENTRY_HEADER + len;
+	if (needed > outbox_cap)
+	{
+		capacity = (outbox_cap == 0) ? 65536 : outbox_cap;
+		while (capacity < needed)
+			capacity *= 2;
+		grown = (needed <= LINK_BUFFER_MAX) ? (char *)realloc(outbox, capacity) : NULL;
+		if (grown == NULL)
+		{
+			outbox_dropped++;
+			pthread_mutex_unlock(&outbox_mutex);
+			return;
+		}
+		outbox = grown;
+		outbox_cap = capacity;
+	}
+	was_empty = (outbox_len == 0);
+	memcpy(outbox + outbox_len, &target, sizeof(int));
+	memcpy(outbox + outbox_len + 4, &len, sizeof(uint32_t));
+	memcpy(outbox + outbox_len + LINK_ENTRY_HEADER, line, len);
+	outbox_len = needed;
+	pthread_mutex_unlock(&outbox_mutex);
+
+	if (was_empty)
+	{
+		if (write(wake_fd, &one, sizeof(one)) != sizeof(one))
+			logline(LOG_DEBUG, "outbox_push(): Could not wake the link thread");
+	}
+}
+
+
+/*
+ * Returns the bucket of a nickname in the remote user table.
+ */
+static unsigned int users_hash(const char *nick)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*nick != '\0')
+	{
+		hash = (hash ^ (unsigned char)*nick) * 16777619u;
+		nick++;
+	}
+
+	return hash & (LINK_USER_BUCKETS - 1);
+}
+
+
+/*
+ * Records that a node holds a nickname and which room the user is in. A
+ * later claim by another node takes over the entry.
+ */
+static void users_set(const char *nick, int node, const char *room)
+{
+	remote_user *u = NULL;
+	unsigned int bucket = users_hash(nick);
+
+	pthread_mutex_lock(&users_mutex);
+	for (u = users[bucket]; u != NULL; u = u->next)
+	{
+		if (strcmp(u->nickname, nick) == 0)
+			break;
+	}
+	if (u == NULL)
+	{
+		u = (remote_user *)malloc(sizeof(remote_user));
+		if (u == NULL)
+		{
+			pthread_mutex_unlock(&users_mutex);
+			return;
+		}
+		snprintf(u->nickname, sizeof(u->nickname), "%s", nick);
+		u->next = users[bucket];
+		users[bucket] = u;
+	}
+	u->node = node;
+	snprintf(u->room, sizeof(u->room), "%s", room);
+	pthread_mutex_unlock(&users_mutex);
+}
+
+
+/*
+ * Forgets a nickname, unless another node has claimed it since.
+ */
+static void users_remove(const char *nick, int node)
+{
+	remote_user **prev = &users[users_hash(nick)];
+	remote_user *u = NULL;
+
+	pthread_mutex_lock(&users_mutex);
+	for (u = *prev; u != NULL; prev = &u->next, u = u->next)
+	{
+		if (strcmp(u->nickname, nick) == 0)
+		{
+			if (u->node == node)
+			{
+				*prev = u->next;
+				free(u);
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&users_mutex);
+}
+
+
+/*
+ * Moves the entry of a user to a new nickname, keeping the room.
+ */
+static void users_rename(const char *oldnick, const char *newnick, int node)
+{
+	char room[MAX_ROOM_LEN + 1];
+	remote_user *u = NULL;
+
+	strcpy(room, ROOM_LOBBY_NAME);
+	pthread_mutex_lock(&users_mutex);
+	for (u = users[users_hash(oldnick)]; u != NULL; u = u->next)
+	{
+		if ((strcmp(u->nickname, oldnick) == 0) && (u->node == node))
+		{
+			strcpy(room, u->room);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&users_mutex);
+
+	users_remove(oldnick, node);
+	users_set(newnick, node, room);
+}
+
+
+/*
+ * Forgets all users of a node.
+ */
+static void users_purge(int node)
+{
+	remote_user **prev = NULL;
+	remote_user *u = NULL;
+	int i = 0;
+
+	pthread_mutex_lock(&users_mutex);
+	for (i = 0; i < LINK_USER_BUCKETS; i++)
+	{
+		prev = &users[i];
+		while ((u = *prev) != NULL)
+		{
+			if (u->node == node)
+			{
+				*prev = u->next;
+				free(u);
+			}
+			else
+			{
+				prev = &u->next;
+			}
+		}
+	}
+	pthread_mutex_unlock(&users_mutex);
+}
+
+
+/*
+ * Returns the node holding a nickname, or 0 if no other node does.
+ */
+int link_find_user(const char *nick)
+{
+	remote_user *u = NULL;
+	int node = 0;
+
+	if (!enabled)
+		return 0;
+
+	pthread_mutex_lock(&users_mutex);
+	for (u = users[users_hash(nick)]; u != NULL; u = u->next)
+	{
+		if (strcmp(u->nickname, nick) == 0)
+		{
+			node = u->node;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&users_mutex);
+
+	return node;
+}
+
+
+/*
+ * Calls a function for every user of other nodes in a room. The table 
+ * is locked in the meantime. Returns the number of users.
+ */
+int link_walk_users(const char *room, void (*fn)(const char *nick, int node, void *arg), void *arg)
+{
+	remote_user *u = NULL;
+	int count = 0;
+	int i = 0;
+
+	if (!enabled)
+		return 0;
+
+	pthread_mutex_lock(&users_mutex);
+	for (i = 0; i < LINK_USER_BUCKETS; i++)
+	{
+		for (u = users[i]; u != NULL; u = u->next)
+		{
+			if (strcmp(u->room, room) == 0)
+			{
+				fn(u->nickname, u->node, arg);
+				count++;
+			}
+		}
+	}
+	pthread_mutex_unlock(&users_mutex);
+
+	return count;
+}
+
+
+/*
+ * Returns the id of this node, 0 if federation is off.
+ */
+int link_get_node(void)
+{
+	return node_id;
+}
+
+
+/*
+ * Tells the other nodes that a local user is in a room, after connecting
+ * or moving.
+ */
+void link_user(const char *nick, const char *room)
+{
+	if (enabled)
+		outbox_push(0, "USER %s %s\n", nick, room);
+}
+
+
+/*
+ * Tells the other nodes that a local user has left.
+ */
+void link_part(const char *nick)
+{
+	if (enabled)
+		outbox_push(0, "PART %s\n", nick);
+}
+
+
+/*
+ * Tells the other nodes that a local user has changed nickname.
+ */
+void link_nick(const char *oldnick, const char *newnick)
+{
+	if (enabled)
+		outbox_push(0, "NICK %s %s\n", oldnick, newnick);
+}
+
+
+/*
+ * Relays a formatted room message to the other nodes.
+ */
+void link_room(const char *room, msg *m, int chat)
+{
+	size_t len = m->len;
+
+	if (!enabled || (room[0] == '\0'))
+		return;
+
+	/* Lines are terminated by the protocol */
+	if ((len >= 2) && (m->data[len - 2] == '\r') && (m->data[len - 1] == '\n'))
+		len -= 2;
+	outbox_push(0, "%s %s %.*s\n", chat ? "CHAT" : "NOTE", room, (int)len, m->data);
+}
+
+
+/*
+ * Relays a formatted private message to the node holding a nickname. 
+ * Returns -1 if no other node holds it.
+ */
+int link_private(const char *nick, msg *m)
+{
+	size_t len = m->len;
+	int node = 0;
+
+	node = link_find_user(nick);
+	if (node == 0)
+		return -1;
+
+	if ((len >= 2) && (m->data[len - 2] == '\r') && (m->data[len - 1] == '\n'))
+		len -= 2;
+	outbox_push(node, "MSG %s %.*s\n", nick, (int)len, m->data);
+
+	return 0;
+}
+
+
+/*
+ * Appends output for a link. A link that cannot keep up is dropped, it 
+ * catches up with a fresh sync after reconnecting.
+ */
+static void link_queue(peer_link *l, const char *data, size_t len)
+{
+	size_t capacity = 0;
+	char *grown = NULL;
+
+	if (l->out_off == l->out_len)
+	{
+		l->out_off = 0;
+		l->out_len = 0;
+	}
+
+	if (l->out_len + len > l->out_cap)
+	{
+		if (l->out_len - l->out_off + len > LINK_BUFFER_MAX)
+		{
+			link_drop(l, "peer too slow");
+			return;
+		}
+		if (l->out_off > 0)
+		{
+			memmove(l->out, l->out + l->out_off, l->out_len - l->out_off);
+			l->out_len -= l->out_off;
+			l->out_off = 0;
+		}
+		capacity = (l->out_cap == 0) ? 65536 : l->out_cap;
+		while (capacity < l->out_len + len)
+			capacity *= 2;
+		if (capacity != l->out_cap)
+		{
+			grown = (char *)realloc(l->out, capacity);
+			if (grown == NULL)
+			{
+				link_drop(l, "out of memory");
+				return;
+			}
+			l->out = grown;
+			l->out_cap = capacity;
+		}
+	}
+
+	memcpy(l->out + l->out_len, data, len);
+	l->out_len += len;
+}
+
+
+/*
+ * Formats a line into the output of a link.
+ */
+static void link_queue_line(peer_link *l, const char *format, ...)
+{
+	char line[LINK_LINE_MAX];
+	va_list args;
+	int n = 0;
+
+	va_start(args, format);
+	n = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	if ((n > 0) && (n < (int)sizeof(line)))
+		link_queue(l, line, n);
+}
+
+
+/*
+ * Writes as much output as the socket takes. Returns -1 if the link has
+ * been dropped.
+ */
+static int link_flush(peer_link *l)
+{
+	ssize_t ret = 0;
+
+	while ((l->fd >= 0) && l->connected && (l->out_off < l->out_len))
+	{
+		ret = send(l->fd, l->out + l->out_off, l->out_len - l->out_off, MSG_NOSIGNAL);
+		if (ret < 0)
+		{
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				return 0;
+			if (errno == EINTR)
+				continue;
+			link_drop(l, strerror(errno));
+			return -1;
+		}
+		l->out_off += ret;
+	}
+
+	return (l->fd >= 0) ? 0 : -1;
+}
+
+
+/*
+ * Closes a link and forgets the users learned through it. Links to 
+ * configured peers are retried later.
+ */
+static void link_drop(peer_link *l, const char *reason)
+{
+	if (l->fd < 0)
+		return;
+
+	if (l->node > 0)
+	{
+		logline(LOG_INFO, "Link to node %d closed: %s", l->node, reason);
+		users_purge(l->node);
+	}
+	else
+	{
+		logline(LOG_DEBUG, "link_drop(): Link on socket id %d closed: %s", l->fd, reason);
+	}
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, l->fd, NULL);
+	close(l->fd);
+	free(l->out);
+	if (l->peer != NULL)
+	{
+		l->peer->link = NULL;
+		l->peer->next_attempt = time(NULL) + LINK_RETRY_SECS;
+	}
+	memset(l, 0, sizeof(peer_link));
+	l->fd = -1;
+}
+
+
+/*
+ * Announces this node and all its users on a link that has just been 
+ * established.
+ */
+static void link_up(peer_link *l)
+{
+	link_queue_line(l, "HELLO %d\n", node_id);
+	llist_walk(link_sync_user, l);
+}
+
+
+/*
+ * Announces a local user on a new link.
+ */
+static void link_sync_user(list_entry *entry, void *arg)
+{
+	peer_link *l = (peer_link *)arg;
+	const char *room = ROOM_LOBBY_NAME;
+	int id = entry->client_info->room;
+
+	/* Read without the owner's knowledge, an odd name is fixed by the 
+	 * next move of the user 
+	 */
+	if ((id >= 0) && (room_get_name(id)[0] != '\0'))
+		room = room_get_name(id);
+
+	if (l->fd >= 0)
+		link_queue_line(l, "USER %s %s\n", entry->nickname, room);
+}
+
+
+/*
+ * Accepts the node id sent by the other end. Of two links between the 
+ * same nodes, both ends keep the one opened by the lower node id.
+ */
+static void link_hello(peer_link *l, int node)
+{
+	int keep_outgoing = (node_id < node);
+	int i = 0;
+
+	if ((node < 1) || (node > LINK_MAX_NODE) || (node == node_id) || (l->node != 0))
+	{
+		link_drop(l, "bad HELLO");
+		return;
+	}
+
+	for (i = 0; i < LINK_MAX_LINKS; i++)
+	{
+		if ((links[i].fd >= 0) && (&links[i] != l) && (links[i].node == node))
+		{
+			if ((l->peer != NULL) == keep_outgoing)
+			{
+				link_drop(&links[i], "duplicate link");
+			}
+			else
+			{
+				link_drop(l, "duplicate link");
+				return;
+			}
+		}
+	}
+
+	l->node = node;
+	logline(LOG_INFO, "Linked with node %d.", node);
+}
+
+
+/*
+ * Resolves a nickname claimed by another node while a local user holds 
+ * it. The user on the higher node id gives way, both ends apply the same
+ * rule.
+ */
+static void link_check_claim(const char *nick, int node)
+{
+	client_info *ci = NULL;
+	char name[20];
+
+	if (node_id < node)
+		return;
+
+	snprintf(name, sizeof(name), "%s", nick);
+	ci = llist_find_by_nickname(name);
+	if (ci != NULL)
+		handlers->rename(ci);
+}
+
+
+/*
+ * Splits off the next blank separated field of a line.
+ */
+static char* next_field(char **s)
+{
+	char *field = *s;
+	char *blank = strchr(field, ' ');
+
+	if (blank != NULL)
+	{
+		*blank = '\0';
+		*s = blank + 1;
+	}
+	else
+	{
+		*s = field + strlen(field);
+	}
+
+	return field;
+}
+
+
+/*
+ * Handles a protocol line received from another node.
+ */
+static void link_process_line(peer_link *l, char *line)
+{
+	char *rest = line;
+	char *cmd = next_field(&rest);
+	char *nick = NULL;
+	char *arg = NULL;
+
+	if (strcmp(cmd, "HELLO") == 0)
+	{
+		link_hello(l, atoi(rest));
+		return;
+	}
+	if (l->node == 0)
+	{
+		link_drop(l, "no HELLO");
+		return;
+	}
+
+	if (strcmp(cmd, "USER") == 0)
+	{
+		nick = next_field(&rest);
+		arg = next_field(&rest);
+		users_set(nick, l->node, arg);
+		link_check_claim(nick, l->node);
+	}
+	else if (strcmp(cmd, "PART") == 0)
+	{
+		users_remove(rest, l->node);
+	}
+	else if (strcmp(cmd, "NICK") == 0)
+	{
+		nick = next_field(&rest);
+		arg = next_field(&rest);
+		users_rename(nick, arg, l->node);
+		link_check_claim(arg, l->node);
+	}
+	else if ((strcmp(cmd, "CHAT") == 0) || (strcmp(cmd, "NOTE") == 0))
+	{
+		arg = next_field(&rest);
+		handlers->room(arg, strlen(arg), rest, strlen(rest), cmd[0] == 'C');
+	}
+	else if (strcmp(cmd, "MSG") == 0)
+	{
+		nick = next_field(&rest);
+		handlers->private_msg(nick, rest, strlen(rest));
+	}
+	else
+	{
+		logline(LOG_DEBUG, "link_process_line(): Unknown command %s from node %d", cmd, l->node);
+	}
+}
+
+
+/*
+ * Reads everything available on a link and handles complete lines.
+ */
+static void link_read(peer_link *l)
+{
+	char *line = NULL;
+	char *end = NULL;
+	size_t used = 0;
+	ssize_t n = 0;
+
+	while (l->fd >= 0)
+	{
+		n = recv(l->fd, l->in + l->in_len, sizeof(l->in) - l->in_len, 0);
+		if (n == 0)
+		{
+			link_drop(l, "closed by peer");
+			return;
+		}
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+				link_drop(l, strerror(errno));
+			return;
+		}
+		l->in_len += n;
+
+		used = 0;
+		while ((l->fd >= 0) && ((end = memchr(l->in + used, '\n', l->in_len - used)) != NULL))
+		{
+			line = l->in + used;
+			*end = '\0';
+			used = end - l->in + 1;
+			link_process_line(l, line);
+		}
+		if (l->fd < 0)
+			return;
+
+		if (used > 0)
+		{
+			memmove(l->in, l->in + used, l->in_len - used);
+			l->in_len -= used;
+		}
+		else if (l->in_len == sizeof(l->in))
+		{
+			link_drop(l, "line too long");
+			return;
+		}
+	}
+}
+
+
+/*
+ * Takes a connected socket into a free link slot. Returns NULL if all 
+ * slots are in use.
+ */
+static peer_link* link_add(int fd, peer *p, int connected)
+{
+	struct epoll_event ev;
+	peer_link *l = NULL;
+	int optval = 1;
+	int i = 0;
+
+	for (i = 0; i < LINK_MAX_LINKS; i++)
+	{
+		if (links[i].fd < 0)
+		{
+			l = &links[i];
+			break;
+		}
+	}
+	if (l == NULL)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+	memset(l, 0, sizeof(peer_link));
+	l->fd = fd;
+	l->peer = p;
+	l->connected = connected;
+
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = l;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+	{
+		close(fd);
+		l->fd = -1;
+		return NULL;
+	}
+	if (p != NULL)
+		p->link = l;
+	if (connected)
+		link_up(l);
+
+	return l;
+}
+
+
+/*
+ * Starts connecting to a peer.
+ */
+static void link_connect(peer *p)
+{
+	struct addrinfo hints;
+	struct addrinfo *res = NULL;
+	int fd = -1;
+	int ret = 0;
+
+	p->next_attempt = time(NULL) + LINK_RETRY_SECS;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(p->host, p->port, &hints, &res) != 0)
+	{
+		logline(LOG_ERROR, "Cannot resolve peer %s.", p->host);
+		return;
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+	{
+		freeaddrinfo(res);
+		return;
+	}
+	ret = connect(fd, res->ai_addr, res->ai_addrlen);
+	freeaddrinfo(res);
+	if ((ret != 0) && (errno != EINPROGRESS))
+	{
+		logline(LOG_DEBUG, "link_connect(): Cannot connect to %s:%s: %s", p->host, p->port, strerror(errno));
+		close(fd);
+		return;
+	}
+
+	link_add(fd, p, ret == 0);
+}
+
+
+/*
+ * Accepts links opened by other nodes.
+ */
+static void link_accept(void)
+{
+	int fd = -1;
+
+	while (1)
+	{
+		fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+		if (fd < 0)
+		{
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+				logline(LOG_ERROR, "Error accepting a link: %s", strerror(errno));
+			return;
+		}
+		if (link_add(fd, NULL, TRUE) == NULL)
+			logline(LOG_ERROR, "Too many links, link dropped.");
+	}
+}
+
+
+/*
+ * Copies the lines taken from the outbox to the links they are meant 
+ * for. Links still waiting for the HELLO of their peer are left out, they
+ * get a full sync instead.
+ */
+static void link_distribute(char *buffer, size_t len)
+{
+	size_t pos = 0;
+	uint32_t n = 0;
+	int target = 0;
+	int i = 0;
+
+	while (pos + LINK_ENTRY_HEADER <= len)
+	{
+		memcpy(&target, buffer + pos, sizeof(int));
+		memcpy(&n, buffer + pos + 4, sizeof(uint32_t));
+		pos += LINK_ENTRY_HEADER;
+
+		for (i = 0; i < LINK_MAX_LINKS; i++)
+		{
+			if ((links[i].fd >= 0) && (links[i].node > 0) && ((target == 0) || (links[i].node == target)))
+				link_queue(&links[i], buffer + pos, n);
+		}
+		pos += n;
+	}
+}
+
+
+/*
+ * Thread entry point of the link thread. Owns all links, relays what 
+ * the workers queue and hands incoming events to the handlers. 
+ */
+static void* link_thread(void *arg)
+{
+	struct epoll_event events[LINK_EVENTS];
+	struct epoll_event *ev = NULL;
+	peer_link *l = NULL;
+	char *buffer = NULL;
+	size_t buffer_len = 0;
+	size_t buffer_cap = 0;
+	uint64_t count = 0;
+	socklen_t len = 0;
+	time_t now = 0;
+	int drained = 0;
+	int err = 0;
+	int i = 0;
+	int n = 0;
+
+	epoch_register();
+	metrics_register();
+
+	while (1)
+	{
+		epoch_offline();
+		n = epoll_wait(epoll_fd, events, LINK_EVENTS, 1000);
+		epoch_online();
+
+		for (i = 0; i < n; i++)
+		{
+			ev = &events[i];
+			if (ev->data.ptr == &listener_tag)
+			{
+				link_accept();
+			}
+			else if (ev->data.ptr == &wakeup_tag)
+			{
+				if (read(wake_fd, &count, sizeof(count)) < 0)
+					count = 0;
+			}
+			else
+			{
+				l = (peer_link *)ev->data.ptr;
+				if (l->fd < 0)
+					continue;
+
+				/* Outgoing connection completed */
+				if (!l->connected && (ev->events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+				{
+					len = sizeof(err);
+					if ((getsockopt(l->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0) || (err != 0))
+					{
+						link_drop(l, strerror(err));
+						continue;
+					}
+					l->connected = TRUE;
+					link_up(l);
+				}
+
+				if (ev->events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+					link_read(l);
+			}
+		}
+
+		/* Take all queued lines at once, swapping buffers */
+		pthread_mutex_lock(&outbox_mutex);
+		if (outbox_len > 0)
+		{
+			char *swap = outbox;
+			size_t swap_cap = outbox_cap;
+
+			buffer_len = outbox_len;
+			outbox = buffer;
+			outbox_cap = buffer_cap;
+			outbox_len = 0;
+			buffer = swap;
+			buffer_cap = swap_cap;
+		}
+		pthread_mutex_unlock(&outbox_mutex);
+		if (buffer_len > 0)
+		{
+			link_distribute(buffer, buffer_len);
+			buffer_len = 0;
+		}
+
+		/* One write per link for everything gathered */
+		for (i = 0; i < LINK_MAX_LINKS; i++)
+		{
+			if (links[i].fd >= 0)
+				link_flush(&links[i]);
+		}
+
+		now = time(NULL);
+		for (i = 0; i < peer_count; i++)
+		{
+			if ((peers[i].link == NULL) && (now >= peers[i].next_attempt))
+				link_connect(&peers[i]);
+		}
+
+		epoch_quiescent();
+
+		/* Lines queued before the pause have been written out, unless
+		 * more came in, which have woken the thread up again
+		 */
+		if (__atomic_load_n(&pause_requested, __ATOMIC_ACQUIRE))
+		{
+			pthread_mutex_lock(&outbox_mutex);
+			drained = (outbox_len == 0);
+			pthread_mutex_unlock(&outbox_mutex);
+			if (drained)
+				link_park();
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Waits on the link thread until link_resume() is called.
+ */
+static void link_park(void)
+{
+	pthread_mutex_lock(&pause_mutex);
+	paused = 1;
+	pthread_cond_broadcast(&pause_cond);
+	epoch_offline();
+	while (pause_requested)
+		pthread_cond_wait(&pause_cond, &pause_mutex);
+	epoch_online();
+	paused = 0;
+	pthread_mutex_unlock(&pause_mutex);
+}
+
+
+/*
+ * Stops the link thread for a hot upgrade, once the lines queued for 
+ * other nodes have been written. Nothing relayed by other nodes reaches
+ * the workers after that.
+ */
+void link_pause(void)
+{
+	uint64_t one = 1;
+
+	if (!enabled)
+		return;
+
+	pthread_mutex_lock(&pause_mutex);
+	__atomic_store_n(&pause_requested, 1, __ATOMIC_RELEASE);
+	if (write(wake_fd, &one, sizeof(one)) != sizeof(one))
+		logline(LOG_DEBUG, "link_pause(): Could not wake the link thread");
+	while (!paused)
+		pthread_cond_wait(&pause_cond, &pause_mutex);
+	pthread_mutex_unlock(&pause_mutex);
+}
+
+
+/*
+ * Lets the link thread go on after link_pause().
+ */
+void link_resume(void)
+{
+	if (!enabled)
+		return;
+
+	pthread_mutex_lock(&pause_mutex);
+	__atomic_store_n(&pause_requested, 0, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&pause_cond);
+	pthread_mutex_unlock(&pause_mutex);
+}
+
+
+/*
+ * Starts the link thread. Links are accepted on ip:port if port is not 
+ * 0, or on fd, a listener inherited from a previous process on a hot 
+ * upgrade. They are opened to every peer given as host:port. Returns -1
+ * on errors.
+ */
+int link_start(int node, const char *ip, int port, int fd, char **peer_list, int count, 
+	const link_handlers *h)
+{
+	struct epoll_event ev;
+	sigset_t all;
+	sigset_t old;
+	pthread_t thread;
+	char *colon = NULL;
+	int ret = 0;
+	int i = 0;
+
+	node_id = node;
+	handlers = h;
+	for (i = 0; i < LINK_MAX_LINKS; i++)
+		links[i].fd = -1;
+
+	for (i = 0; (i < count) && (i < LINK_MAX_PEERS); i++)
+	{
+		colon = strrchr(peer_list[i], ':');
+		if ((colon == NULL) || (colon - peer_list[i] >= (int)sizeof(peers[i].host)) || 
+			(strlen(colon + 1) >= sizeof(peers[i].port)))
+		{
+			logline(LOG_ERROR, "Invalid peer %s, expected host:port.", peer_list[i]);
+			return -1;
+		}
+		memcpy(peers[i].host, peer_list[i], colon - peer_list[i]);
+		peers[i].host[colon - peer_list[i]] = '\0';
+		strcpy(peers[i].port, colon + 1);
+		peers[i].link = NULL;
+		peers[i].next_attempt = 0;
+	}
+	peer_count = i;
+
+	epoll_fd = epoll_create1(0);
+	wake_fd = eventfd(0, EFD_NONBLOCK);
+	if ((epoll_fd < 0) || (wake_fd < 0))
+		return -1;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &wakeup_tag;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+	if ((fd >= 0) || (port > 0))
+	{
+		listen_fd = (fd >= 0) ? fd : link_listen(ip, port);
+		if (listen_fd < 0)
+			return -1;
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.ptr = &listener_tag;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+	}
+
+	/* Signals are left to the workers */
+	enabled = 1;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&thread, NULL, link_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0)
+	{
+		enabled = 0;
+		return -1;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
+
+
+/*
+ * Returns the listener for links, -1 if there is none.
+ */
+int link_get_listener(void)
+{
+	return listen_fd;
+}
+
+
+/*
+ * Binds the listener for links to ip:port. Returns -1 on errors.
+ */
+static int link_listen(const char *ip, int port)
+{
+	struct sockaddr_in addr;
+	int optval = 1;
+	int fd = 0;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = (ip != NULL) ? inet_addr(ip) : htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) || (listen(fd, 16) != 0))
+	{
+		logline(LOG_ERROR, "Cannot accept links on port %d: %s", port, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
@@ -0,0 +1,60 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef LINK_H
+#define LINK_H
+
+#include <stddef.h>
+
+#define LINK_MAX_PEERS    16        /* Max. number of peers to connect to */
+#define LINK_MAX_LINKS    32        /* Max. number of links, both directions */
+#define LINK_MAX_NODE     255       /* Node ids run from 1 to 255 */
+#define LINK_LINE_MAX     8192      /* Max. length of a protocol line */
+#define LINK_BUFFER_MAX   (4 * 1024 * 1024)  /* Output a link may hold back */
+#define LINK_RETRY_SECS   2         /* Delay between connection attempts */
+
+struct msg;
+struct client_info;
+
+/* Called on the link thread for events coming in from other nodes */
+typedef struct link_handlers
+{
+	/* A message for the members of a room, chat lines go to the history */
+	void (*room)(const char *room, size_t room_len, const char *text, size_t len, int chat);
+	/* A private message for a local user */
+	void (*private_msg)(const char *nick, const char *text, size_t len);
+	/* Another node has claimed the nickname of a local user first */
+	void (*rename)(struct client_info *ci);
+} link_handlers;
+
+int link_start(int node, const char *ip, int port, int fd, char **peers, int peer_count, 
+	const link_handlers *handlers);
+int link_get_listener(void);
+void link_pause(void);
+void link_resume(void);
+int link_get_node(void);
+void link_user(const char *nick, const char *room);
+void link_part(const char *nick);
+void link_nick(const char *oldnick, const char *newnick);
+void link_room(const char *room, struct msg *m, int chat);
+int link_private(const char *nick, struct msg *m);
+int link_find_user(const char *nick);
+int link_walk_users(const char *room, void (*fn)(const char *nick, int node, void *arg), void *arg);
+
+#endif /* LINK_H */
@@ -20,332 +20,444 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <netinet/in.h>
 #include "llist2.h"
+#include "epoch.h"
+#include "pool.h"
 #include "log.h"
 
+#define NICK_INDEX_MIN   1024      /* Initial number of nickname slots */
+#define FD_INDEX_MIN     1024      /* Initial number of socket slots */
+
+/* Marks a nickname slot whose record has been removed */
+#define NICK_TOMBSTONE   ((list_entry *)-1)
+
+/* Records by nickname. Open addressing with linear probing, the size is
+ * always a power of two.
+ */
+typedef struct nick_table
+{
+	unsigned int size;
+	list_entry *slots[];
+} nick_table;
+
+/* Sessions by socket id */
+typedef struct fd_table
+{
+	int size;
+	client_info *slots[];
+} fd_table;
+
+/* The registry. There is only one per process. Readers load the table 
+ * pointers and slots without locking. Writers are serialized by 
+ * registry_lock, store slots atomically and replace a table as a whole
+ * when it grows, retiring the old one.
+ */
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static nick_table *nick_index = NULL;
+static fd_table *fd_index = NULL;
+static unsigned int nick_used = 0;             /* Records plus tombstones */
+static int client_count = 0;
+
+static pool entry_pool = POOL_INITIALIZER("list_entry", sizeof(list_entry));
+
+static unsigned int nick_hash(const char *nickname);
+static list_entry* entry_create(client_info *element, const char *nickname);
+static void entry_free(void *entry);
+static nick_table* nick_table_create(unsigned int size);
+static int nick_index_add(list_entry *entry);
+static list_entry* nick_index_remove(client_info *element, list_entry *keep);
+static list_entry* nick_index_find(nick_table *table, const char *nickname);
+static int fd_index_set(int sockfd, client_info *element);
+
 
 /*
- * Initializes the first element of the list.
+ * Initializes the registry.
  */
-void llist_init(list_entry *list_start)
+void llist_init(void)
 {
-	list_start->client_info = NULL;
-	list_start->next = NULL;
-	list_start->mutex = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));	
-	pthread_mutex_init(list_start->mutex, NULL);
+	nick_index = nick_table_create(NICK_INDEX_MIN);
+	fd_index = (fd_table *)calloc(1, sizeof(fd_table) + FD_INDEX_MIN * sizeof(client_info *));
+	fd_index->size = FD_INDEX_MIN;
 }
 
 
 /*
- * Inserts a new client_info element at the end of the list.
+ * FNV-1a hash of a nickname.
  */
-int llist_insert(list_entry *list_start, client_info *element)
+static unsigned int nick_hash(const char *nickname)
 {
-	list_entry *cur, *prev;
-	int inserted = FALSE;
+	unsigned int hash = 2166136261u;
 
-	cur = prev = list_start;
-	
-	while (cur != NULL)
+	while (*nickname != '\0')
 	{
-		/* Lock entry */
-		pthread_mutex_lock(cur->mutex);	
-	
-		/* Delete client_info data if sockfd matches */
-		if (cur->client_info == NULL)
-		{
-			cur->client_info = element;
-			pthread_mutex_unlock(cur->mutex);
-			inserted = TRUE;
-			break;
-		}
-	
-		/* Unlock entry */
-		pthread_mutex_unlock(cur->mutex);
-	
-		/* Load next entry */
-		prev = cur;
-		cur = cur->next;
-	}
-	
-	/* During iteration through list, no existing element could be reused.
-	 * We therefore need to append a new list_entry to the list.
-	 */
-	if (inserted == FALSE)
-	{
-		/* Lock last entry again */
-		pthread_mutex_lock(prev->mutex);
-	
-		/* Create new list entry */	
-		list_entry *new_entry = (list_entry *)malloc(sizeof(list_entry));
-		new_entry->client_info = element;
-		new_entry->next = NULL;
-		new_entry->mutex = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));	
-		pthread_mutex_init(new_entry->mutex, NULL);
-	
-		/* Append entry */
-		prev->next = new_entry;
-		
-		/* Unlock list entry */
-		pthread_mutex_unlock(prev->mutex);
-	
-		inserted = TRUE;
+		hash ^= (unsigned char)*nickname++;
+		hash *= 16777619u;
 	}
 
-	if (inserted == TRUE)
-	{
-		return 0;
-	}
-	else
-	{
-		return -1;
-	}
+	return hash;
 }
 
 
 /*
- * Removes a client_info element by sockfd.
+ * Creates the registry record of a session under a nickname.
  */
-int llist_remove_by_sockfd(list_entry *list_start, int sockfd)
+static list_entry* entry_create(client_info *element, const char *nickname)
 {
-	list_entry *cur;
+	list_entry *entry = NULL;
 
-	cur = list_start;
-	
-	while (cur != NULL)
+	entry = (list_entry *)pool_alloc(&entry_pool);
+	if (entry == NULL)
+		return NULL;
+
+	entry->client_info = element;
+	strncpy(entry->nickname, nickname, sizeof(entry->nickname) - 1);
+	entry->nickname[sizeof(entry->nickname) - 1] = '\0';
+	entry->hash = nick_hash(entry->nickname);
+
+	return entry;
+}
+
+
+/*
+ * Releases a registry record.
+ */
+static void entry_free(void *entry)
+{
+	pool_free(&entry_pool, entry);
+}
+
+
+/*
+ * Allocates an empty nickname table.
+ */
+static nick_table* nick_table_create(unsigned int size)
+{
+	nick_table *table = NULL;
+
+	table = (nick_table *)calloc(1, sizeof(nick_table) + size * sizeof(list_entry *));
+	if (table != NULL)
+		table->size = size;
+
+	return table;
+}
+
+
+/*
+ * Adds a record to the nickname index. When the table gets half full, a
+ * new one without tombstones is built and published, doubled in size if
+ * needed. Caller holds registry_lock. Returns -1 if out of memory.
+ */
+static int nick_index_add(list_entry *entry)
+{
+	nick_table *old = nick_index;
+	nick_table *table = nick_index;
+	list_entry *cur = NULL;
+	unsigned int live = 0;
+	unsigned int i = 0;
+	unsigned int j = 0;
+
+	if ((nick_used + 1) * 2 > old->size)
 	{
-		/* Lock entry */
-		pthread_mutex_lock(cur->mutex);	
-	
-		/* Need to check if there's client in node */
-		if (cur->client_info != NULL)
+		for (i = 0; i < old->size; i++)
 		{
+			if ((old->slots[i] != NULL) && (old->slots[i] != NICK_TOMBSTONE))
+				live++;
+		}
 
-			/* Delete client_info data if sockfd matches */
-			if (cur->client_info->sockfd == sockfd)
-			{
-				cur->client_info = NULL;
-				pthread_mutex_unlock(cur->mutex);
-				break;
-			}
+		table = nick_table_create((live + 1) * 4 > old->size ? old->size * 2 : old->size);
+		if (table == NULL)
+			return -1;
 
+		for (i = 0; i < old->size; i++)
+		{
+			cur = old->slots[i];
+			if ((cur == NULL) || (cur == NICK_TOMBSTONE))
+				continue;
+			j = cur->hash & (table->size - 1);
+			while (table->slots[j] != NULL)
+				j = (j + 1) & (table->size - 1);
+			table->slots[j] = cur;
 		}
-	
-		/* Unlock entry */
-		pthread_mutex_unlock(cur->mutex);
-	
-		/* Load next entry */
-		cur = cur->next;
+		nick_used = live;
+
+		__atomic_store_n(&nick_index, table, __ATOMIC_RELEASE);
+		epoch_retire(old, free);
 	}
 
+	i = entry->hash & (table->size - 1);
+	while ((table->slots[i] != NULL) && (table->slots[i] != NICK_TOMBSTONE))
+		i = (i + 1) & (table->size - 1);
+	if (table->slots[i] == NULL)
+		nick_used++;
+	__atomic_store_n(&table->slots[i], entry, __ATOMIC_RELEASE);
+
 	return 0;
 }
 
 
 /*
- * Find a client_info element by sockfd.
+ * Removes the record of a session from the nickname index and returns 
+ * it. A record to keep, if any, is skipped. Caller holds registry_lock
+ * and retires the record.
  */
-list_entry* llist_find_by_sockfd(list_entry *list_start, int sockfd)
+static list_entry* nick_index_remove(client_info *element, list_entry *keep)
 {
-	list_entry *cur;
+	nick_table *table = nick_index;
+	unsigned int i = nick_hash(element->nickname) & (table->size - 1);
+	list_entry *cur = NULL;
 
-	cur = list_start;
-	
-	while (cur != NULL)
+	while ((cur = table->slots[i]) != NULL)
 	{
-		/* Lock entry */
-		pthread_mutex_lock(cur->mutex);	
-
-		/* Need to check if there's client in node */
-		if (cur->client_info != NULL)
+		if ((cur != NICK_TOMBSTONE) && (cur != keep) && (cur->client_info == element))
 		{
-	
-			/* Delete client_info data if sockfd matches */
-			if (cur->client_info->sockfd == sockfd)
-			{
-				pthread_mutex_unlock(cur->mutex);
-				return cur;
-			}
-
+			__atomic_store_n(&table->slots[i], NICK_TOMBSTONE, __ATOMIC_RELEASE);
+			return cur;
 		}
-
-		/* Unlock entry */
-		pthread_mutex_unlock(cur->mutex);
-	
-		/* Load next entry */
-		cur = cur->next;
+		i = (i + 1) & (table->size - 1);
 	}
-	
+
 	return NULL;
 }
 
 
-list_entry* llist_find_by_nickname(list_entry *list_start, char *nickname)
+/*
+ * Looks up a record by nickname.
+ */
+static list_entry* nick_index_find(nick_table *table, const char *nickname)
 {
-	list_entry *cur;
+	unsigned int hash = nick_hash(nickname);
+	unsigned int i = hash & (table->size - 1);
+	list_entry *cur = NULL;
 
-	cur = list_start;
-	
-	while (cur != NULL)
+	while ((cur = __atomic_load_n(&table->slots[i], __ATOMIC_ACQUIRE)) != NULL)
 	{
-		/* Lock entry */
-		pthread_mutex_lock(cur->mutex);	
-
-		/* Need to check if there's client in node */
-		if (cur->client_info != NULL)
+		if ((cur != NICK_TOMBSTONE) && (cur->hash == hash) && 
+			(strcmp(cur->nickname, nickname) == 0))
 		{
-	
-			/* Delete client_info data if sockfd matches */
-			if (strcmp(cur->client_info->nickname, nickname) == 0)
-			{
-				pthread_mutex_unlock(cur->mutex);
-				return cur;
-			}
-
+			return cur;
 		}
-	
-		/* Unlock entry */
-		pthread_mutex_unlock(cur->mutex);
-	
-		/* Load next entry */
-		cur = cur->next;
+		i = (i + 1) & (table->size - 1);
 	}
-	
+
 	return NULL;
 }
 
 
 /*
- * Replace a client_info element by sockfd.
+ * Stores a session in its socket slot, growing the table as needed. 
+ * Caller holds registry_lock. Returns -1 if out of memory.
  */
-int llist_change_by_sockfd(list_entry *list_start, client_info *element, int sockfd)
+static int fd_index_set(int sockfd, client_info *element)
 {
-	list_entry *cur;
+	fd_table *old = fd_index;
+	fd_table *table = fd_index;
+	int size = old->size;
 
-	cur = list_start;
-	
-	while (cur != NULL)
+	if (sockfd < 0)
+		return -1;
+
+	if (sockfd >= old->size)
 	{
-		/* Lock entry */
-		pthread_mutex_lock(cur->mutex);	
+		while (sockfd >= size)
+			size *= 2;
+		table = (fd_table *)calloc(1, sizeof(fd_table) + size * sizeof(client_info *));
+		if (table == NULL)
+			return -1;
+		table->size = size;
+		memcpy(table->slots, old->slots, old->size * sizeof(client_info *));
+
+		__atomic_store_n(&fd_index, table, __ATOMIC_RELEASE);
+		epoch_retire(old, free);
+	}
 
-		/* Need to check if there's client in node */
-		if (cur->client_info != NULL)
-		{
-	
-			/* Delete client_info data if sockfd matches */
-			if (cur->client_info->sockfd == sockfd)
-			{
-				cur->client_info = element;
-				pthread_mutex_unlock(cur->mutex);
-				return 0;
-			}
+	__atomic_store_n(&table->slots[sockfd], element, __ATOMIC_RELEASE);
 
-		}
-	
-		/* Unlock entry */
-		pthread_mutex_unlock(cur->mutex);
-	
-		/* Load next entry */
-		cur = cur->next;
+	return 0;
+}
+
+
+/*
+ * Publishes a new session under its socket id and nickname.
+ */
+int llist_insert(client_info *element)
+{
+	list_entry *entry = NULL;
+
+	entry = entry_create(element, element->nickname);
+	if (entry == NULL)
+		return -1;
+
+	pthread_mutex_lock(&registry_lock);
+
+	if (fd_index_set(element->sockfd, element) != 0)
+	{
+		pthread_mutex_unlock(&registry_lock);
+		entry_free(entry);
+		return -1;
 	}
+	if (nick_index_add(entry) != 0)
+	{
+		__atomic_store_n(&fd_index->slots[element->sockfd], NULL, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&registry_lock);
+		entry_free(entry);
+		return -1;
+	}
+	__sync_add_and_fetch(&client_count, 1);
+
+	pthread_mutex_unlock(&registry_lock);
 
 	return 0;
 }
 
 
 /*
- * Display elements in linked list.
+ * Withdraws a session from the registry. The caller must not free it 
+ * before its grace period has ended.
  */
-int llist_show(list_entry *list_start)
+int llist_remove(client_info *element)
 {
-	list_entry *cur;
+	list_entry *entry = NULL;
 
-	cur = list_start;
-	
-	logline(LOG_DEBUG, "---------- Client List Dump Begin ----------");
-	while (cur != NULL)
+	pthread_mutex_lock(&registry_lock);
+
+	if ((element->sockfd >= 0) && (element->sockfd < fd_index->size) &&
+		(fd_index->slots[element->sockfd] == element))
 	{
-		/* Lock entry */
-		pthread_mutex_lock(cur->mutex);
-		
-		/* Display client info */
-		if (cur->client_info != NULL)
-		{
-			logline(LOG_DEBUG, "sockfd = %d, nickname = %s", cur->client_info->sockfd, cur->client_info->nickname);
-		}
-		
-		/* Unlock entry */
-		pthread_mutex_unlock(cur->mutex);
-		
-		/* Load next entry */
-		cur = cur->next;
+		__atomic_store_n(&fd_index->slots[element->sockfd], NULL, __ATOMIC_RELEASE);
+		__sync_sub_and_fetch(&client_count, 1);
 	}
-	logline(LOG_DEBUG, "----------- Client List Dump End -----------");
-	
+
+	entry = nick_index_remove(element, NULL);
+	if (entry != NULL)
+		epoch_retire(entry, entry_free);
+
+	pthread_mutex_unlock(&registry_lock);
+
 	return 0;
 }
 
 
 /*
- * Get number of client_info elements in list.
+ * Find a session by socket id.
  */
-int llist_get_count(list_entry *list_start)
+client_info* llist_find_by_sockfd(int sockfd)
 {
-	list_entry *cur;
-	int count = 0;
+	fd_table *table = __atomic_load_n(&fd_index, __ATOMIC_ACQUIRE);
 
-	cur = list_start;
-	
-	while (cur != NULL)
+	if ((sockfd < 0) || (sockfd >= table->size))
+		return NULL;
+
+	return __atomic_load_n(&table->slots[sockfd], __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Find a session by nickname.
+ */
+client_info* llist_find_by_nickname(char *nickname)
+{
+	list_entry *entry = NULL;
+
+	entry = nick_index_find(__atomic_load_n(&nick_index, __ATOMIC_ACQUIRE), nickname);
+	if (entry == NULL)
+		return NULL;
+
+	return entry->client_info;
+}
+
+
+/*
+ * Changes the nickname of a session. Checking for a collision and 
+ * renaming happen as one step, so two users can never end up with the 
+ * same nickname. Only the worker owning the session may rename it. 
+ * Returns -1 if the nickname is already in use.
+ */
+int llist_rename(client_info *element, char *nickname)
+{
+	list_entry *entry = NULL;
+	list_entry *old = NULL;
+
+	entry = entry_create(element, nickname);
+	if (entry == NULL)
+		return -1;
+
+	pthread_mutex_lock(&registry_lock);
+
+	if ((nick_index_find(nick_index, entry->nickname) != NULL) || (nick_index_add(entry) != 0))
+	{
+		pthread_mutex_unlock(&registry_lock);
+		entry_free(entry);
+		return -1;
+	}
+
+	/* The new record is in place, withdraw the old one */
+	old = nick_index_remove(element, entry);
+	if (old != NULL)
+		epoch_retire(old, entry_free);
+	strcpy(element->nickname, entry->nickname);
+
+	pthread_mutex_unlock(&registry_lock);
+
+	return 0;
+}
+
+
+/*
+ * Display the registered sessions. Walks the whole registry, so it is 
+ * meant for dumps on demand only.
+ */
+int llist_show(void)
+{
+	nick_table *table = __atomic_load_n(&nick_index, __ATOMIC_ACQUIRE);
+	list_entry *cur = NULL;
+	unsigned int i = 0;
+
+	logline(LOG_INFO, "---------- Client List Dump Begin ----------");
+	for (i = 0; i < table->size; i++)
 	{
-		/* Lock entry */
-		pthread_mutex_lock(cur->mutex);		
-		
-		/* Increase count if client_info not null */
-		if (cur->client_info != NULL)
+		cur = __atomic_load_n(&table->slots[i], __ATOMIC_ACQUIRE);
+		if ((cur != NULL) && (cur != NICK_TOMBSTONE))
 		{
-			count++;
+			logline(LOG_INFO, "sockfd = %d, nickname = %s", cur->client_info->sockfd, cur->nickname);
 		}
-		
-		/* Unlock entry */
-		pthread_mutex_unlock(cur->mutex);
-		
-		/* Load next entry */	
-		cur = cur->next;
 	}
+	logline(LOG_INFO, "----------- Client List Dump End -----------");
 	
-	return count;
+	return 0;
 }
 
+
 /*
- * Build string array of currently connected clients
+ * Get number of registered sessions.
  */
-int llist_get_nicknames(list_entry *list_start, char **nicks)
+int llist_get_count(void)
 {
-	list_entry *cur;
+	return __atomic_load_n(&client_count, __ATOMIC_RELAXED);
+}
 
-	cur = list_start;
 
+/*
+ * Calls fn for every registered session with its record. Returns the 
+ * number of sessions visited. Records are valid until the caller passes
+ * its next quiescent state.
+ */
+int llist_walk(void (*fn)(list_entry *entry, void *arg), void *arg)
+{
+	nick_table *table = __atomic_load_n(&nick_index, __ATOMIC_ACQUIRE);
+	list_entry *cur = NULL;
+	unsigned int i = 0;
 	int count = 0;
-	
-	while (cur != NULL)
+
+	for (i = 0; i < table->size; i++)
 	{
-		/* Lock entry */
-		pthread_mutex_lock(cur->mutex);
-		
-		/* Display client info */
-		if (cur->client_info != NULL)
+		cur = __atomic_load_n(&table->slots[i], __ATOMIC_ACQUIRE);
+		if ((cur != NULL) && (cur != NICK_TOMBSTONE))
 		{
-			strncpy(nicks[count++], cur->client_info->nickname, 20);
+			fn(cur, arg);
+			count++;
 		}
-		
-		/* Unlock entry */
-		pthread_mutex_unlock(cur->mutex);
-		
-		/* Load next entry */
-		cur = cur->next;
 	}
 	
 	return count;
@@ -17,29 +17,68 @@
  *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
  *****************************************************************************/
  
-#include <pthread.h>
+#ifndef LLIST2_H
+#define LLIST2_H
+
 #include "bool.h"
+#include "outq.h"
+#include "framer.h"
+#include "flood.h"
+#include "timer.h"
+
+/* Session flags */
+#define CLIENT_DIRTY    0x01      /* Output queued, needs a flush */
+#define CLIENT_CLOSED   0x02      /* Disconnected, about to be freed */
+#define CLIENT_LAGGED   0x04      /* Send queue overflowed, output skipped */
+#define CLIENT_KICKED   0x08      /* To be disconnected */
+#define CLIENT_PAUSED   0x10      /* Over its input budget, not read */
 
 typedef struct client_info
 {
 	int sockfd;
 	char nickname[20];
 	struct sockaddr_in address;
+	framer framer;                /* Incomplete line received so far */
+	unsigned long conn_id;        /* Unique id of the session */
+	int worker_id;                /* Worker owning the socket */
+	int worker_slot;              /* Index in the client set of the worker */
+	int room;                     /* Room the user is in, -1 if none */
+	int room_slot;                /* Index in the member set of the room */
+	int flags;
+	outq outq;                    /* Output waiting for the socket */
+	unsigned long skipped;        /* Messages skipped while lagged */
+	unsigned long lines;          /* Lines received */
+	unsigned long lines_seen;     /* Lines at the last stats update */
+	bucket flood[FLOOD_BUCKETS];  /* Input budgets */
+	unsigned long long flood_notice;  /* Last flood notice sent, ms */
+	unsigned long long last_input;    /* Last line received, ms */
+	unsigned long long last_ping;     /* Last ping sent, ms */
+	unsigned long long last_drain;    /* Output last made progress, ms */
+	timer idle_timer;             /* Idle disconnect and pings */
+	timer stall_timer;            /* Output not draining */
+	timer pause_timer;            /* End of a flood pause */
+	struct client_info *next_dead;
 } client_info;
 
+/* Registry record of a session. Records are immutable once published,
+ * a rename publishes a new one. Readers take no locks, see epoch.h for 
+ * how long the pointers they find stay valid.
+ */
 typedef struct list_entry
 {
 	struct client_info *client_info;
-	pthread_mutex_t *mutex;
-	struct list_entry *next;
+	unsigned int hash;            /* Hash of the nickname */
+	char nickname[20];
 } list_entry;
 
-void llist_init(list_entry *list_start);
-int llist_insert(list_entry *list_start, client_info *element);
-int llist_remove_by_sockfd(list_entry *list_start, int sockfd);
-list_entry* llist_find_by_sockfd(list_entry *list_start, int sockfd);
-list_entry* llist_find_by_nickname(list_entry *list_start, char *nickname);
-int llist_change_by_sockfd(list_entry *list_start, client_info *element, int sockfd);
-int llist_show(list_entry *list_start);
-int llist_get_count(list_entry *list_start);
-int llist_get_nicknames(list_entry *list_start, char** nicks);
+void llist_init(void);
+int llist_insert(client_info *element);
+int llist_remove(client_info *element);
+client_info* llist_find_by_sockfd(int sockfd);
+client_info* llist_find_by_nickname(char *nickname);
+int llist_rename(client_info *element, char *nickname);
+int llist_show(void);
+int llist_get_count(void);
+int llist_walk(void (*fn)(list_entry *entry, void *arg), void *arg);
+
+#endif /* LLIST2_H */
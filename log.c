@@ -19,47 +19,351 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <stdarg.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include "log.h"
 
-/* static reduces this variables scope to file scope.
- * This variable is global, but only throughout this file.
+#define LOG_BATCH_SIZE 65536      /* Bytes written at once by the writer */
+
+/* A message waiting in the ring. seq tells producers and the writer who
+ * owns the slot (bounded MPSC queue after D. Vyukov).
+ */
+typedef struct log_record
+{
+	unsigned long seq;
+	int loglevel;
+	time_t time;
+	char text[LOG_LINE_MAX];
+} log_record;
+
+/* Formatted time of day, refreshed once per second */
+typedef struct log_clock
+{
+	time_t time;
+	char timestr[20];
+} log_clock;
+
+int log_level = LOG_INFO;
+
+/* Async mode. Producers claim slots by advancing ring_tail, the writer
+ * thread consumes them in order from ring_head. The writer waits on
+ * wake_fd while the ring is empty.
+ */
+static int async_enabled = 0;
+static int async_stop = 0;
+static pthread_t writer_thread;
+static int wake_fd = -1;
+static log_record *ring = NULL;
+static unsigned long ring_tail = 0;
+static unsigned long ring_head = 0;
+static unsigned long records_written = 0;
+static unsigned long records_dropped = 0;
+
+static __thread log_clock thread_clock;
+
+static const char* log_timestr(log_clock *clock, time_t now);
+static const char* log_levelstr(int loglevel);
+static void log_push(int loglevel, const char *format, va_list args);
+static void log_wake(void);
+static void* log_writer(void *arg);
+
+
+/*
+ * Returns the formatted time, formatting it only when the second has 
+ * changed.
+ */
+static const char* log_timestr(log_clock *clock, time_t now)
+{
+	struct tm tm;
+
+	if (now != clock->time)
+	{
+		localtime_r(&now, &tm);
+		strftime(clock->timestr, sizeof(clock->timestr), "%Y-%m-%d %H:%M:%S", &tm);
+		clock->time = now;
+	}
+
+	return clock->timestr;
+}
+
+
+/*
+ * Returns the tag of a log level.
  */
-static int global_loglevel = LOG_INFO;
+static const char* log_levelstr(int loglevel)
+{
+	switch (loglevel)
+	{
+		case LOG_ERROR: return "E";
+		case LOG_INFO: return "I";
+		case LOG_DEBUG: return "D";
+		default: return "I"; 
+	}
+}
+
 
-void logline(int loglevel, const char* format, ...) 
+/*
+ * Writes a log message, or queues it in async mode. Use the logline 
+ * macro rather than calling this directly.
+ */
+void log_message(int loglevel, const char* format, ...) 
 {
 	va_list args;
 		
-	if (loglevel <= global_loglevel)
+	if (loglevel <= log_level)
 	{
-		char timestr[20];
-		char *loginfo;
-		struct tm *ptr;
-		time_t lt;
+		va_start(args, format);
+		if (__atomic_load_n(&async_enabled, __ATOMIC_ACQUIRE))
+		{
+			log_push(loglevel, format, args);
+		}
+		else
+		{
+			printf("[%s %s] ", log_timestr(&thread_clock, time(NULL)), log_levelstr(loglevel));
+			vprintf(format, args);
+			printf("\r\n");
+			fflush(stdout);
+		}
+		va_end(args);
+	}
+}
+
 
-		lt = time(NULL);
-		ptr = localtime(&lt);
-		strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", ptr);
+/*
+ * Formats a message into a free slot of the ring. The message is dropped
+ * and counted if the ring is full, callers never wait for the writer.
+ * The writer is only woken up for a message that went into an empty
+ * ring, it keeps going by itself as long as it finds more.
+ */
+static void log_push(int loglevel, const char *format, va_list args)
+{
+	log_record *rec = NULL;
+	unsigned long pos = 0;
+	unsigned long seq = 0;
+	long diff = 0;
 
-		switch (loglevel)
+	pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+	while (1)
+	{
+		rec = &ring[pos & (LOG_RING_SIZE - 1)];
+		seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+		diff = (long)(seq - pos);
+		if (diff == 0)
+		{
+			/* Slot is free, try to claim it */
+			if (__atomic_compare_exchange_n(&ring_tail, &pos, pos + 1, 0, 
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (diff < 0)
 		{
-			case LOG_ERROR: loginfo = "E"; break;
-			case LOG_INFO: loginfo = "I"; break;
-			case LOG_DEBUG: loginfo = "D"; break;
-			default: loginfo = "I"; 
+			/* Writer has not caught up yet */
+			__sync_add_and_fetch(&records_dropped, 1);
+			return;
 		}
+		else
+		{
+			pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+		}
+	}
 
-		printf("[%s %s] ", timestr, loginfo);
-		va_start(args, format);
-		vprintf(format, args);
-		va_end(args);
-		printf("\r\n");
-		fflush(stdout);
+	rec->loglevel = loglevel;
+	rec->time = time(NULL);
+	vsnprintf(rec->text, sizeof(rec->text), format, args);
+	__atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* Pairs with the fence of the writer before it waits */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring_head, __ATOMIC_RELAXED) == pos)
+		log_wake();
+}
+
+
+/*
+ * Wakes up the async writer.
+ */
+static void log_wake(void)
+{
+	uint64_t one = 1;
+
+	if (write(wake_fd, &one, sizeof(one)) != sizeof(one))
+		return;
+}
+
+
+/*
+ * Thread entry point of the async writer. Collects formatted lines in a 
+ * batch, passed as arg, and writes them with a single call. Waits for a
+ * wakeup when there is nothing to write.
+ */
+static void* log_writer(void *arg)
+{
+	struct pollfd pfd;
+	log_clock clock = { 0, "" };
+	log_record *rec = NULL;
+	char *batch = (char *)arg;
+	size_t len = 0;
+	unsigned long dropped = 0;
+	unsigned long reported = 0;
+	uint64_t count = 0;
+	int stopping = 0;
+	int n = 0;
+
+	pfd.fd = wake_fd;
+	pfd.events = POLLIN;
+
+	while (1)
+	{
+		stopping = __atomic_load_n(&async_stop, __ATOMIC_ACQUIRE);
+		len = 0;
+
+		/* Tell about records lost since the last batch */
+		dropped = __atomic_load_n(&records_dropped, __ATOMIC_RELAXED);
+		if (dropped != reported)
+		{
+			len += snprintf(batch, LOG_BATCH_SIZE, "[%s E] Log ring full, %lu messages dropped.\r\n",
+				log_timestr(&clock, time(NULL)), dropped - reported);
+			reported = dropped;
+		}
+
+		while (len + LOG_LINE_MAX + 32 < LOG_BATCH_SIZE)
+		{
+			rec = &ring[ring_head & (LOG_RING_SIZE - 1)];
+			if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != ring_head + 1)
+				break;
+
+			n = snprintf(batch + len, LOG_BATCH_SIZE - len, "[%s %s] %s\r\n",
+				log_timestr(&clock, rec->time), log_levelstr(rec->loglevel), rec->text);
+			len += n;
+
+			/* Hand the slot back to the producers */
+			__atomic_store_n(&rec->seq, ring_head + LOG_RING_SIZE, __ATOMIC_RELEASE);
+			__atomic_store_n(&ring_head, ring_head + 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&records_written, 1, __ATOMIC_RELAXED);
+		}
+
+		if (len > 0)
+		{
+			fwrite(batch, 1, len, stdout);
+			fflush(stdout);
+			continue;
+		}
+
+		if (stopping)
+			break;
+
+		/* A message published after the check below finds ring_head at
+		 * its slot and wakes the writer up, see log_push()
+		 */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		rec = &ring[ring_head & (LOG_RING_SIZE - 1)];
+		if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) == ring_head + 1)
+			continue;
+		if ((poll(&pfd, 1, -1) > 0) && (read(wake_fd, &count, sizeof(count)) < 0))
+			count = 0;
+	}
+
+	free(batch);
+
+	return NULL;
+}
+
+
+/*
+ * Switches to asynchronous logging. From now on, messages are formatted
+ * by the calling thread into a ring and written out by a background 
+ * thread. Returns -1 if the writer could not be started, logging stays
+ * synchronous then.
+ */
+int log_start_async(void)
+{
+	sigset_t all;
+	sigset_t old;
+	char *batch = NULL;
+	unsigned long i = 0;
+	int ret = 0;
+
+	if (async_enabled)
+		return 0;
+
+	ring = (log_record *)malloc(LOG_RING_SIZE * sizeof(log_record));
+	batch = (char *)malloc(LOG_BATCH_SIZE);
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if ((ring == NULL) || (batch == NULL) || (wake_fd < 0))
+	{
+		free(ring);
+		free(batch);
+		if (wake_fd >= 0)
+			close(wake_fd);
+		ring = NULL;
+		wake_fd = -1;
+		return -1;
+	}
+	for (i = 0; i < LOG_RING_SIZE; i++)
+		ring[i].seq = i;
+	ring_head = 0;
+	ring_tail = 0;
+	async_stop = 0;
+	fflush(stdout);
+
+	/* Signals are left to the other threads, the writer must be able to
+	 * finish while shutdown is handled.
+	 */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&writer_thread, NULL, log_writer, batch);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0)
+	{
+		free(ring);
+		free(batch);
+		close(wake_fd);
+		ring = NULL;
+		wake_fd = -1;
+		return -1;
 	}
+
+	__atomic_store_n(&async_enabled, 1, __ATOMIC_RELEASE);
+
+	/* Whatever is buffered must not get lost when the server exits */
+	atexit(log_stop_async);
+
+	return 0;
 }
 
+
+/*
+ * Writes out everything still buffered and returns to synchronous 
+ * logging.
+ */
+void log_stop_async(void)
+{
+	if (!__atomic_load_n(&async_enabled, __ATOMIC_ACQUIRE))
+		return;
+
+	__atomic_store_n(&async_enabled, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&async_stop, 1, __ATOMIC_RELEASE);
+	log_wake();
+	pthread_join(writer_thread, NULL);
+}
+
+
+/*
+ * Reports how many records the async logger has written and dropped.
+ */
+void log_get_stats(log_stats *stats)
+{
+	stats->written = __atomic_load_n(&records_written, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&records_dropped, __ATOMIC_RELAXED);
+}
+
+
 /*
  * This function sets the loglevel of the logger.
  */
@@ -67,7 +371,7 @@ void set_loglevel(int loglevel)
 {
 	if ((loglevel == LOG_ERROR) || (loglevel == LOG_INFO) || (loglevel == LOG_DEBUG))
 	{
-		global_loglevel = loglevel;
+		log_level = loglevel;
 	}
 }
 
@@ -24,7 +24,40 @@
 #define LOG_INFO  2
 #define LOG_DEBUG 3
 
-void logline(int loglevel, const char* format, ...);
+#define LOG_RING_SIZE  4096       /* Records buffered in async mode, power of 2 */
+#define LOG_LINE_MAX   1024       /* Max. length of a message */
+
+/* Counters of the async logger */
+typedef struct log_stats
+{
+	unsigned long written;        /* Records written out */
+	unsigned long dropped;        /* Records lost because the ring was full */
+} log_stats;
+
+/* Most verbose level compiled in. Release builds leave DEBUG messages 
+ * out entirely, see the Makefile.
+ */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+
+/* Current log level, see set_loglevel() */
+extern int log_level;
+
+#define log_enabled(loglevel) \
+	(((loglevel) <= LOG_COMPILE_LEVEL) && ((loglevel) <= log_level))
+
+/* Logs a message. The level is checked before any of the arguments is
+ * evaluated, so disabled messages cost a compare, compiled out ones 
+ * nothing.
+ */
+#define logline(loglevel, ...) \
+	do { if (log_enabled(loglevel)) log_message((loglevel), __VA_ARGS__); } while (0)
+
+void log_message(int loglevel, const char* format, ...) __attribute__((format(printf, 2, 3)));
 void set_loglevel(int loglevel);
+int log_start_async(void);
+void log_stop_async(void);
+void log_get_stats(log_stats *stats);
 
 #endif /* LOG_H */
@@ -0,0 +1,439 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "metrics.h"
+#include "log.h"
+
+/* Bucket limits of the exposed histograms */
+static const unsigned long long time_buckets[] = 
+{
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+	500000, 1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 
+	100000000, 250000000, 500000000, 1000000000, 0
+};
+static const unsigned long long size_buckets[] = 
+{
+	1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 
+	50000, 100000, 0
+};
+
+/* Exposed histograms, by METRIC_* index */
+static const struct
+{
+	const char *name;
+	const char *help;
+	const unsigned long long *buckets;
+	double scale;                 /* Converts recorded values to the unit */
+} hist_defs[METRIC_HISTS] =
+{
+	{ "chatsrv_parse_seconds", "Time spent parsing a command.", time_buckets, 1e-9 },
+	{ "chatsrv_fanout_seconds", "Time spent queueing a broadcast for the sessions of a worker.", time_buckets, 1e-9 },
+	{ "chatsrv_send_seconds", "Time spent writing out the queue of a session.", time_buckets, 1e-9 },
+	{ "chatsrv_fanout_recipients", "Sessions of a worker a broadcast was queued for.", size_buckets, 1 }
+};
+
+int metrics_enabled = 0;
+
+/* Threads count here before they register */
+static metrics_block unregistered;
+__thread metrics_block *metrics_local = &unregistered;
+
+static metrics_block *blocks[METRICS_MAX_THREADS];
+static int block_count = 0;
+
+/* Owned by the metrics thread */
+static int listen_fd = -1;
+static unsigned long long sum_counters[METRIC_COUNTERS];
+static hist sum_hists[METRIC_HISTS];
+static unsigned long long last_accepts = 0;
+static unsigned long long accept_rate = 0;
+
+static int open_listener(int port);
+static void metrics_collect(void);
+static long long read_tcp_ext(const char *name);
+static void metrics_write_page(FILE *out);
+static void metrics_serve(int fd);
+static void* metrics_thread(void *arg);
+
+
+/*
+ * Gives the calling thread a metrics block of its own, unless it has one
+ * already. Counters are kept even without the metrics page, the shared 
+ * stats segment is fed from them as well.
+ */
+void metrics_register(void)
+{
+	metrics_block *b = NULL;
+	int slot = 0;
+	int i = 0;
+
+	if (metrics_local != &unregistered)
+		return;
+
+	if (posix_memalign((void **)&b, 64, sizeof(metrics_block)) != 0)
+	{
+		logline(LOG_ERROR, "metrics_register(): Out of memory.");
+		return;
+	}
+	memset(b, 0, sizeof(metrics_block));
+	for (i = 0; i < METRIC_HISTS; i++)
+		hist_init(&b->hists[i]);
+
+	slot = __sync_fetch_and_add(&block_count, 1);
+	if (slot >= METRICS_MAX_THREADS)
+	{
+		logline(LOG_ERROR, "metrics_register(): Too many threads.");
+		free(b);
+		return;
+	}
+	__atomic_store_n(&blocks[slot], b, __ATOMIC_RELEASE);
+	metrics_local = b;
+}
+
+
+/*
+ * Starts serving metrics on a loopback port. fd is a listener inherited 
+ * from a previous process on a hot upgrade, -1 to bind one. Returns -1 
+ * on errors.
+ */
+int metrics_start(int port, int fd)
+{
+	pthread_t thread;
+
+	listen_fd = (fd >= 0) ? fd : open_listener(port);
+	if (listen_fd < 0)
+		return -1;
+
+	metrics_enabled = 1;
+	if (pthread_create(&thread, NULL, metrics_thread, NULL) != 0)
+	{
+		metrics_enabled = 0;
+		close(listen_fd);
+		return -1;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
+
+
+/*
+ * Binds a listener to a loopback port. Returns -1 on errors.
+ */
+static int open_listener(int port)
+{
+	struct sockaddr_in addr;
+	int optval = 1;
+	int fd = 0;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+	{
+		logline(LOG_DEBUG, "metrics_start(): Error calling socket(): %s", strerror(errno));
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) || (listen(fd, 8) != 0))
+	{
+		logline(LOG_DEBUG, "metrics_start(): Error binding port %d: %s", port, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+/*
+ * Returns the listener of the metrics page, -1 if there is none.
+ */
+int metrics_get_listener(void)
+{
+	return listen_fd;
+}
+
+
+/*
+ * Adds up the blocks of all threads. Values are read while their owners
+ * keep counting, so a histogram may be a few samples behind its count.
+ */
+static void metrics_collect(void)
+{
+	metrics_block *b = NULL;
+	int count = __atomic_load_n(&block_count, __ATOMIC_ACQUIRE);
+	int i = 0;
+	int j = 0;
+	int k = 0;
+
+	memset(sum_counters, 0, sizeof(sum_counters));
+	for (j = 0; j < METRIC_HISTS; j++)
+		hist_init(&sum_hists[j]);
+
+	if (count > METRICS_MAX_THREADS)
+		count = METRICS_MAX_THREADS;
+	for (i = 0; i < count; i++)
+	{
+		b = __atomic_load_n(&blocks[i], __ATOMIC_ACQUIRE);
+		if (b == NULL)
+			continue;
+
+		for (j = 0; j < METRIC_COUNTERS; j++)
+			sum_counters[j] += __atomic_load_n(&b->counters[j], __ATOMIC_RELAXED);
+		for (j = 0; j < METRIC_HISTS; j++)
+		{
+			for (k = 0; k < HIST_BUCKETS; k++)
+				sum_hists[j].counts[k] += __atomic_load_n(&b->hists[j].counts[k], __ATOMIC_RELAXED);
+			sum_hists[j].count += __atomic_load_n(&b->hists[j].count, __ATOMIC_RELAXED);
+			sum_hists[j].sum += __atomic_load_n(&b->hists[j].sum, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+
+/*
+ * Writes the collected metrics in the Prometheus text format.
+ */
+static void metrics_write_page(FILE *out)
+{
+	const unsigned long long *bucket = NULL;
+	unsigned long long accepts = sum_counters[METRIC_ACCEPTS];
+	unsigned long long disconnects = sum_counters[METRIC_DISCONNECTS];
+	unsigned long long opened = accepts + sum_counters[METRIC_TAKEN_OVER];
+	long long overflows = read_tcp_ext("ListenOverflows");
+	long long drops = read_tcp_ext("ListenDrops");
+	int i = 0;
+
+	fprintf(out, "# HELP chatsrv_connections Chat sessions currently open.\n");
+	fprintf(out, "# TYPE chatsrv_connections gauge\n");
+	fprintf(out, "chatsrv_connections %llu\n", (opened > disconnects) ? opened - disconnects : 0);
+	fprintf(out, "# HELP chatsrv_connections_total Connections accepted.\n");
+	fprintf(out, "# TYPE chatsrv_connections_total counter\n");
+	fprintf(out, "chatsrv_connections_total %llu\n", accepts);
+	fprintf(out, "# HELP chatsrv_accepts_per_second Connections accepted during the last second.\n");
+	fprintf(out, "# TYPE chatsrv_accepts_per_second gauge\n");
+	fprintf(out, "chatsrv_accepts_per_second %llu\n", accept_rate);
+	fprintf(out, "# HELP chatsrv_accept_drops_total Connections closed right after accepting, over the session limit or out of descriptors.\n");
+	fprintf(out, "# TYPE chatsrv_accept_drops_total counter\n");
+	fprintf(out, "chatsrv_accept_drops_total %llu\n", sum_counters[METRIC_ACCEPT_DROPS]);
+	if (overflows >= 0)
+	{
+		fprintf(out, "# HELP chatsrv_listen_overflows_total Connections the kernel dropped with a full accept queue, all listeners of the host.\n");
+		fprintf(out, "# TYPE chatsrv_listen_overflows_total counter\n");
+		fprintf(out, "chatsrv_listen_overflows_total %lld\n", overflows);
+	}
+	if (drops >= 0)
+	{
+		fprintf(out, "# HELP chatsrv_listen_drops_total Connection attempts the kernel dropped before accepting, all listeners of the host.\n");
+		fprintf(out, "# TYPE chatsrv_listen_drops_total counter\n");
+		fprintf(out, "chatsrv_listen_drops_total %lld\n", drops);
+	}
+	fprintf(out, "# HELP chatsrv_messages_received_total Lines received from clients.\n");
+	fprintf(out, "# TYPE chatsrv_messages_received_total counter\n");
+	fprintf(out, "chatsrv_messages_received_total %llu\n", sum_counters[METRIC_MSGS_IN]);
+	fprintf(out, "# HELP chatsrv_messages_sent_total Messages queued to clients.\n");
+	fprintf(out, "# TYPE chatsrv_messages_sent_total counter\n");
+	fprintf(out, "chatsrv_messages_sent_total %llu\n", sum_counters[METRIC_MSGS_OUT]);
+	fprintf(out, "# HELP chatsrv_bytes_received_total Bytes read from client sockets.\n");
+	fprintf(out, "# TYPE chatsrv_bytes_received_total counter\n");
+	fprintf(out, "chatsrv_bytes_received_total %llu\n", sum_counters[METRIC_BYTES_IN]);
+	fprintf(out, "# HELP chatsrv_bytes_sent_total Bytes written to client sockets.\n");
+	fprintf(out, "# TYPE chatsrv_bytes_sent_total counter\n");
+	fprintf(out, "chatsrv_bytes_sent_total %llu\n", sum_counters[METRIC_BYTES_OUT]);
+	fprintf(out, "# HELP chatsrv_broadcasts_total Messages broadcast to a room.\n");
+	fprintf(out, "# TYPE chatsrv_broadcasts_total counter\n");
+	fprintf(out, "chatsrv_broadcasts_total %llu\n", sum_counters[METRIC_BROADCASTS]);
+	fprintf(out, "# HELP chatsrv_flood_pauses_total Times reading from a session was paused over its input budget.\n");
+	fprintf(out, "# TYPE chatsrv_flood_pauses_total counter\n");
+	fprintf(out, "chatsrv_flood_pauses_total %llu\n", sum_counters[METRIC_FLOOD_PAUSES]);
+	fprintf(out, "# HELP chatsrv_flood_drops_total Lines dropped over a flood budget.\n");
+	fprintf(out, "# TYPE chatsrv_flood_drops_total counter\n");
+	fprintf(out, "chatsrv_flood_drops_total %llu\n", sum_counters[METRIC_FLOOD_DROPS]);
+	fprintf(out, "# HELP chatsrv_timeouts_total Sessions closed for idling or stalled output.\n");
+	fprintf(out, "# TYPE chatsrv_timeouts_total counter\n");
+	fprintf(out, "chatsrv_timeouts_total %llu\n", sum_counters[METRIC_TIMEOUTS]);
+	fprintf(out, "# HELP chatsrv_sessions_taken_over_total Sessions taken over from a previous process.\n");
+	fprintf(out, "# TYPE chatsrv_sessions_taken_over_total counter\n");
+	fprintf(out, "chatsrv_sessions_taken_over_total %llu\n", sum_counters[METRIC_TAKEN_OVER]);
+	fprintf(out, "# HELP chatsrv_commands_total Lines received, by command.\n");
+	fprintf(out, "# TYPE chatsrv_commands_total counter\n");
+	for (i = 0; i < CMD_COUNT; i++)
+		fprintf(out, "chatsrv_commands_total{command=\"%s\"} %llu\n", 
+			cmd_get_name(i), sum_counters[METRIC_CMD_BASE + i]);
+
+	for (i = 0; i < METRIC_HISTS; i++)
+	{
+		fprintf(out, "# HELP %s %s\n", hist_defs[i].name, hist_defs[i].help);
+		fprintf(out, "# TYPE %s histogram\n", hist_defs[i].name);
+		for (bucket = hist_defs[i].buckets; *bucket != 0; bucket++)
+			fprintf(out, "%s_bucket{le=\"%g\"} %llu\n", hist_defs[i].name, 
+				*bucket * hist_defs[i].scale, hist_count_below(&sum_hists[i], *bucket));
+		fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", hist_defs[i].name, sum_hists[i].count);
+		fprintf(out, "%s_sum %g\n", hist_defs[i].name, sum_hists[i].sum * hist_defs[i].scale);
+		fprintf(out, "%s_count %llu\n", hist_defs[i].name, sum_hists[i].count);
+	}
+}
+
+
+/*
+ * Reads a TcpExt counter of the kernel from /proc/net/netstat, which 
+ * lists the names on one line and their values on the next. Returns -1 
+ * if the counter is not available.
+ */
+static long long read_tcp_ext(const char *name)
+{
+	char names[4096];
+	char values[4096];
+	char *name_save = NULL;
+	char *value_save = NULL;
+	char *n = NULL;
+	char *v = NULL;
+	long long result = -1;
+	FILE *f = NULL;
+
+	f = fopen("/proc/net/netstat", "r");
+	if (f == NULL)
+		return -1;
+
+	while ((fgets(names, sizeof names, f) != NULL) && (fgets(values, sizeof values, f) != NULL))
+	{
+		if (strncmp(names, "TcpExt:", 7) != 0)
+			continue;
+
+		n = strtok_r(names, " \n", &name_save);
+		v = strtok_r(values, " \n", &value_save);
+		while ((n != NULL) && (v != NULL))
+		{
+			if (strcmp(n, name) == 0)
+			{
+				result = strtoll(v, NULL, 10);
+				break;
+			}
+			n = strtok_r(NULL, " \n", &name_save);
+			v = strtok_r(NULL, " \n", &value_save);
+		}
+		break;
+	}
+	fclose(f);
+
+	return result;
+}
+
+
+/*
+ * Answers a single request. Anything but GET /metrics is not found.
+ */
+static void metrics_serve(int fd)
+{
+	struct timeval timeout = { 1, 0 };
+	char request[512];
+	char *page = NULL;
+	size_t page_len = 0;
+	char header[160];
+	FILE *out = NULL;
+	ssize_t len = 0;
+	int header_len = 0;
+
+	/* Slow clients must not hold up the next scrape for long */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	len = recv(fd, request, sizeof(request) - 1, 0);
+	if (len <= 0)
+		return;
+	request[len] = '\0';
+
+	if ((strncmp(request, "GET /metrics ", 13) != 0) && (strncmp(request, "GET / ", 6) != 0))
+	{
+		header_len = snprintf(header, sizeof(header), 
+			"HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+		send(fd, header, header_len, MSG_NOSIGNAL);
+		return;
+	}
+
+	out = open_memstream(&page, &page_len);
+	if (out == NULL)
+		return;
+	metrics_collect();
+	metrics_write_page(out);
+	fclose(out);
+
+	header_len = snprintf(header, sizeof(header), 
+		"HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %lu\r\nConnection: close\r\n\r\n", (unsigned long)page_len);
+	if (send(fd, header, header_len, MSG_NOSIGNAL) == header_len)
+		send(fd, page, page_len, MSG_NOSIGNAL);
+	free(page);
+}
+
+
+/*
+ * Thread entry point. Serves scrapes one at a time and samples the 
+ * accept rate once per second.
+ */
+static void* metrics_thread(void *arg)
+{
+	struct pollfd pfd;
+	time_t last_sample = time(NULL);
+	time_t now = 0;
+	int fd = -1;
+
+	pfd.fd = listen_fd;
+	pfd.events = POLLIN;
+
+	while (1)
+	{
+		if (poll(&pfd, 1, 1000) > 0)
+		{
+			fd = accept(listen_fd, NULL, NULL);
+			if (fd >= 0)
+			{
+				metrics_serve(fd);
+				close(fd);
+			}
+		}
+
+		now = time(NULL);
+		if (now != last_sample)
+		{
+			metrics_collect();
+			accept_rate = (sum_counters[METRIC_ACCEPTS] - last_accepts) / (now - last_sample);
+			last_accepts = sum_counters[METRIC_ACCEPTS];
+			last_sample = now;
+		}
+	}
+
+	return NULL;
+}
@@ -0,0 +1,109 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <time.h>
+#include "hist.h"
+#include "cmd.h"
+
+#define METRICS_MAX_THREADS 72   /* Workers plus helper threads */
+
+/* Counters */
+#define METRIC_ACCEPTS      0     /* Connections accepted */
+#define METRIC_DISCONNECTS  1     /* Sessions ended */
+#define METRIC_MSGS_IN      2     /* Lines received from clients */
+#define METRIC_MSGS_OUT     3     /* Messages queued to clients */
+#define METRIC_BYTES_IN     4
+#define METRIC_BYTES_OUT    5
+#define METRIC_BROADCASTS   6
+#define METRIC_FLOOD_PAUSES 7     /* Reads paused over the input budget */
+#define METRIC_FLOOD_DROPS  8     /* Lines dropped over a budget */
+#define METRIC_TIMEOUTS     9     /* Sessions closed for idling or stalled output */
+#define METRIC_TAKEN_OVER   10    /* Sessions taken over on a hot upgrade */
+#define METRIC_ACCEPT_DROPS 11    /* Connections closed right after accepting */
+#define METRIC_CMD_BASE     12    /* One counter per command type */
+#define METRIC_COUNTERS     (METRIC_CMD_BASE + CMD_COUNT)
+
+/* Histograms */
+#define METRIC_PARSE_TIME   0     /* Parsing a command, ns */
+#define METRIC_FANOUT_TIME  1     /* Queueing a broadcast for a worker's sessions, ns */
+#define METRIC_SEND_TIME    2     /* Writing out the queue of one session, ns */
+#define METRIC_FANOUT_SIZE  3     /* Sessions a worker queued a broadcast for */
+#define METRIC_HISTS        4
+
+/* Metrics of one thread. Only the owner writes to it, without any 
+ * locks or atomic read-modify-write operations. Scrapes add up the 
+ * blocks of all threads.
+ */
+typedef struct metrics_block
+{
+	unsigned long long counters[METRIC_COUNTERS];
+	hist hists[METRIC_HISTS];
+} __attribute__((aligned(64))) metrics_block;
+
+extern int metrics_enabled;
+extern __thread metrics_block *metrics_local;
+
+/* Counts an event of the calling thread. Counters are kept all the 
+ * time, timings and histograms only while metrics_enabled is set.
+ */
+#define metric_add(counter, n) \
+	__atomic_store_n(&metrics_local->counters[(counter)], \
+		metrics_local->counters[(counter)] + (n), __ATOMIC_RELAXED)
+#define metric_inc(counter) metric_add((counter), 1)
+
+/*
+ * Returns a timestamp in ns for metric_time(), or 0 if metrics are off.
+ */
+static inline unsigned long long metric_clock(void)
+{
+	struct timespec ts;
+
+	if (!metrics_enabled)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Records the time passed since start, taken by metric_clock().
+ */
+static inline void metric_time(int h, unsigned long long start)
+{
+	if (metrics_enabled)
+		hist_record(&metrics_local->hists[h], metric_clock() - start);
+}
+
+/*
+ * Records a value.
+ */
+static inline void metric_record(int h, unsigned long long value)
+{
+	if (metrics_enabled)
+		hist_record(&metrics_local->hists[h], value);
+}
+
+void metrics_register(void);
+int metrics_start(int port, int fd);
+int metrics_get_listener(void);
+
+#endif /* METRICS_H */
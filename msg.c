@@ -0,0 +1,162 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "msg.h"
+#include "pool.h"
+
+#define MSG_SIZE_CLASSES  6
+
+/* Messages are taken from pools by total size, 64 to 2048 bytes. Bigger
+ * ones come from malloc.
+ */
+static pool msg_pools[MSG_SIZE_CLASSES] = 
+{
+	POOL_INITIALIZER("msg64", 64),
+	POOL_INITIALIZER("msg128", 128),
+	POOL_INITIALIZER("msg256", 256),
+	POOL_INITIALIZER("msg512", 512),
+	POOL_INITIALIZER("msg1024", 1024),
+	POOL_INITIALIZER("msg2048", 2048)
+};
+
+static msg* msg_alloc(size_t len);
+
+
+/*
+ * Allocates a message with room for len bytes of text and a terminating
+ * zero. The caller owns the only reference.
+ */
+static msg* msg_alloc(size_t len)
+{
+	size_t size = sizeof(msg) + len + 1;
+	msg *m = NULL;
+	int i = 0;
+
+	while ((i < MSG_SIZE_CLASSES) && (msg_pools[i].size < size))
+		i++;
+
+	if (i < MSG_SIZE_CLASSES)
+		m = (msg *)pool_alloc(&msg_pools[i]);
+	else
+		m = (msg *)malloc(size);
+	if (m == NULL)
+		return NULL;
+
+	m->refs = 1;
+	m->size_class = (i < MSG_SIZE_CLASSES) ? i : -1;
+	m->len = len;
+
+	return m;
+}
+
+
+/*
+ * Creates a message holding a copy of the data. The caller owns the only 
+ * reference. Returns NULL if out of memory.
+ */
+msg* msg_create(const char *data, size_t len)
+{
+	msg *m = NULL;
+
+	m = msg_alloc(len);
+	if (m == NULL)
+		return NULL;
+
+	memcpy(m->data, data, len);
+	m->data[len] = '\0';
+
+	return m;
+}
+
+
+/*
+ * Creates a message from a printf style format. The length is taken from
+ * vsnprintf, the text is never scanned again. Returns NULL if out of 
+ * memory.
+ */
+msg* msg_vformat(const char *format, va_list args)
+{
+	msg *m = NULL;
+	va_list copy;
+	char buffer[1024];
+	int len = 0;
+
+	/* Most messages fit the stack buffer, format directly otherwise */
+	va_copy(copy, args);
+	len = vsnprintf(buffer, sizeof(buffer), format, copy);
+	va_end(copy);
+	if (len < 0)
+		return NULL;
+
+	if ((size_t)len < sizeof(buffer))
+		return msg_create(buffer, len);
+
+	m = msg_alloc(len);
+	if (m == NULL)
+		return NULL;
+
+	vsnprintf(m->data, len + 1, format, args);
+
+	return m;
+}
+
+
+/*
+ * Same as msg_vformat, taking the arguments directly.
+ */
+msg* msg_format(const char *format, ...)
+{
+	msg *m = NULL;
+	va_list args;
+
+	va_start(args, format);
+	m = msg_vformat(format, args);
+	va_end(args);
+
+	return m;
+}
+
+
+/*
+ * Takes another reference to a message. References may be taken and
+ * dropped by any worker.
+ */
+msg* msg_get(msg *m)
+{
+	__sync_add_and_fetch(&m->refs, 1);
+	return m;
+}
+
+
+/*
+ * Drops a reference, freeing the message with the last one.
+ */
+void msg_put(msg *m)
+{
+	if (__sync_sub_and_fetch(&m->refs, 1) != 0)
+		return;
+
+	if (m->size_class >= 0)
+		pool_free(&msg_pools[m->size_class], m);
+	else
+		free(m);
+}
@@ -0,0 +1,45 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef MSG_H
+#define MSG_H
+
+#include <stddef.h>
+#include <stdarg.h>
+
+/* An immutable, formatted message. A broadcast is formatted once and the
+ * same message is referenced from the send queue of every recipient, and
+ * from the handoffs to other workers. It is freed when the last reference
+ * is dropped.
+ */
+typedef struct msg
+{
+	int refs;                    /* Changed atomically, see msg_get/msg_put */
+	int size_class;              /* Pool the message came from, -1 for none */
+	size_t len;
+	char data[];
+} msg;
+
+msg* msg_create(const char *data, size_t len);
+msg* msg_vformat(const char *format, va_list args);
+msg* msg_format(const char *format, ...);
+msg* msg_get(msg *m);
+void msg_put(msg *m);
+
+#endif /* MSG_H */
@@ -0,0 +1,205 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include "outq.h"
+#include "pool.h"
+
+static pool chunk_pool = POOL_INITIALIZER("outq_chunk", sizeof(outq_chunk));
+
+
+/*
+ * Frees a chunk and drops its message reference.
+ */
+static void outq_free_chunk(outq_chunk *chunk)
+{
+	msg_put(chunk->msg);
+	pool_free(&chunk_pool, chunk);
+}
+
+
+/*
+ * Initializes an empty queue.
+ */
+void outq_init(outq *q)
+{
+	q->head = NULL;
+	q->tail = NULL;
+	q->head_off = 0;
+	q->bytes = 0;
+	q->chunks = 0;
+}
+
+
+/*
+ * Appends a message to the queue, taking a reference to it. The payload
+ * is not copied. Returns -1 if out of memory.
+ */
+int outq_push(outq *q, msg *m)
+{
+	outq_chunk *chunk = NULL;
+
+	chunk = (outq_chunk *)pool_alloc(&chunk_pool);
+	if (chunk == NULL)
+		return -1;
+
+	chunk->next = NULL;
+	chunk->msg = msg_get(m);
+
+	if (q->tail != NULL)
+		q->tail->next = chunk;
+	else
+		q->head = chunk;
+	q->tail = chunk;
+	q->bytes += m->len;
+	q->chunks++;
+
+	return 0;
+}
+
+
+/*
+ * Drops the oldest chunks until at most limit bytes are queued. A head 
+ * chunk that has been written partially is kept, so the peer never sees
+ * a message cut in half. Returns the number of chunks dropped.
+ */
+int outq_drop_oldest(outq *q, size_t limit)
+{
+	outq_chunk *keep = NULL;
+	outq_chunk *chunk = NULL;
+	int dropped = 0;
+
+	/* Detach a partially written head */
+	if ((q->head != NULL) && (q->head_off > 0))
+	{
+		keep = q->head;
+		q->head = keep->next;
+		if (q->head == NULL)
+			q->tail = NULL;
+		q->bytes -= keep->msg->len - q->head_off;
+		q->chunks--;
+	}
+
+	while ((q->head != NULL) && 
+		(q->bytes + (keep != NULL ? keep->msg->len - q->head_off : 0) > limit))
+	{
+		chunk = q->head;
+		q->head = chunk->next;
+		if (q->head == NULL)
+			q->tail = NULL;
+		q->bytes -= chunk->msg->len;
+		q->chunks--;
+		outq_free_chunk(chunk);
+		dropped++;
+	}
+
+	/* Put the partially written head back in place */
+	if (keep != NULL)
+	{
+		keep->next = q->head;
+		q->head = keep;
+		if (q->tail == NULL)
+			q->tail = keep;
+		q->bytes += keep->msg->len - q->head_off;
+		q->chunks++;
+	}
+	else
+	{
+		q->head_off = 0;
+	}
+
+	return dropped;
+}
+
+
+/*
+ * Describes up to max queued chunks in an iovec array, suitable for a 
+ * single writev() or sendmsg(). Returns the number of entries used.
+ */
+int outq_fill_iov(outq *q, struct iovec *iov, int max)
+{
+	outq_chunk *chunk = q->head;
+	int n = 0;
+
+	while ((chunk != NULL) && (n < max))
+	{
+		if (n == 0)
+		{
+			iov[n].iov_base = chunk->msg->data + q->head_off;
+			iov[n].iov_len = chunk->msg->len - q->head_off;
+		}
+		else
+		{
+			iov[n].iov_base = chunk->msg->data;
+			iov[n].iov_len = chunk->msg->len;
+		}
+		n++;
+		chunk = chunk->next;
+	}
+
+	return n;
+}
+
+
+/*
+ * Removes len written bytes from the front of the queue.
+ */
+void outq_consume(outq *q, size_t len)
+{
+	outq_chunk *chunk = NULL;
+	size_t left = 0;
+
+	while ((len > 0) && (q->head != NULL))
+	{
+		chunk = q->head;
+		left = chunk->msg->len - q->head_off;
+		if (len < left)
+		{
+			q->head_off += len;
+			q->bytes -= len;
+			return;
+		}
+
+		len -= left;
+		q->bytes -= left;
+		q->head = chunk->next;
+		if (q->head == NULL)
+			q->tail = NULL;
+		q->head_off = 0;
+		q->chunks--;
+		outq_free_chunk(chunk);
+	}
+}
+
+
+/*
+ * Discards everything still queued.
+ */
+void outq_clear(outq *q)
+{
+	outq_chunk *chunk = NULL;
+
+	while (q->head != NULL)
+	{
+		chunk = q->head;
+		q->head = chunk->next;
+		outq_free_chunk(chunk);
+	}
+	outq_init(q);
+}
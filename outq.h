@@ -0,0 +1,55 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include "msg.h"
+
+#define OUTQ_IOV_MAX    16        /* Max. chunks written with one call */
+
+/* A queued message. The message itself is shared with other queues. */
+typedef struct outq_chunk
+{
+	struct outq_chunk *next;
+	msg *msg;
+} outq_chunk;
+
+/* Bounded queue of bytes waiting to be written to a socket. The head 
+ * chunk may have been written partially, head_off tells how far.
+ */
+typedef struct outq
+{
+	outq_chunk *head;
+	outq_chunk *tail;
+	size_t head_off;
+	size_t bytes;                /* Bytes still to be written */
+	int chunks;
+} outq;
+
+void outq_init(outq *q);
+int outq_push(outq *q, msg *m);
+int outq_drop_oldest(outq *q, size_t limit);
+int outq_fill_iov(outq *q, struct iovec *iov, int max);
+void outq_consume(outq *q, size_t len);
+void outq_clear(outq *q);
+
+#endif /* OUTQ_H */
@@ -0,0 +1,246 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include "pool.h"
+#include "log.h"
+
+/* Free objects kept by a thread for one pool */
+typedef struct pool_cache
+{
+	void *head;
+	int count;
+} pool_cache;
+
+/* All pools in use, for statistics */
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static pool *pools[POOL_MAX];
+static int pool_count = 0;
+
+static __thread pool_cache thread_cache[POOL_MAX];
+
+static void* pool_refill(pool *p);
+static int pool_grow(pool *p);
+static size_t pool_object_size(pool *p);
+
+
+/*
+ * Size of a pool slot. Objects are aligned to 16 bytes and must be able
+ * to hold the free list link.
+ */
+static size_t pool_object_size(pool *p)
+{
+	size_t size = p->size;
+
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+
+	return (size + 15) & ~(size_t)15;
+}
+
+
+/*
+ * Carves a new slab into free objects. Caller holds the pool lock. 
+ * Returns -1 if out of memory.
+ */
+static int pool_grow(pool *p)
+{
+	size_t size = pool_object_size(p);
+	size_t count = POOL_SLAB_SIZE / size;
+	char *slab = NULL;
+	size_t i = 0;
+
+	if (count < 8)
+		count = 8;
+
+	slab = (char *)malloc(count * size);
+	if (slab == NULL)
+		return -1;
+
+	for (i = 0; i < count; i++)
+	{
+		*(void **)(slab + i * size) = p->free_list;
+		p->free_list = slab + i * size;
+	}
+	p->free_count += count;
+	p->capacity += count;
+	p->slabs++;
+
+	return 0;
+}
+
+
+/*
+ * Moves a batch of free objects to the cache of the calling thread and 
+ * returns one of them. Registers the pool on first use. Returns NULL if
+ * out of memory.
+ */
+static void* pool_refill(pool *p)
+{
+	pool_cache *cache = NULL;
+	void *obj = NULL;
+	void *next = NULL;
+	int i = 0;
+
+	pthread_mutex_lock(&p->lock);
+
+	if (p->id < 0)
+	{
+		pthread_mutex_lock(&pools_lock);
+		if (pool_count >= POOL_MAX)
+		{
+			pthread_mutex_unlock(&pools_lock);
+			pthread_mutex_unlock(&p->lock);
+			logline(LOG_ERROR, "pool_refill(): Too many pools, cannot use pool %s.", p->name);
+			return NULL;
+		}
+		pools[pool_count] = p;
+		__atomic_store_n(&p->id, pool_count, __ATOMIC_RELEASE);
+		__atomic_store_n(&pool_count, pool_count + 1, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&pools_lock);
+	}
+
+	if ((p->free_count < POOL_BATCH) && (pool_grow(p) != 0) && (p->free_count == 0))
+	{
+		pthread_mutex_unlock(&p->lock);
+		return NULL;
+	}
+
+	/* One object for the caller, the rest of the batch for later */
+	cache = &thread_cache[p->id];
+	obj = p->free_list;
+	p->free_list = *(void **)obj;
+	p->free_count--;
+	for (i = 1; (i < POOL_BATCH) && (p->free_list != NULL); i++)
+	{
+		next = *(void **)p->free_list;
+		*(void **)p->free_list = cache->head;
+		cache->head = p->free_list;
+		cache->count++;
+		p->free_list = next;
+		p->free_count--;
+	}
+
+	pthread_mutex_unlock(&p->lock);
+
+	return obj;
+}
+
+
+/*
+ * Allocates an object. Returns NULL if out of memory.
+ */
+void* pool_alloc(pool *p)
+{
+	pool_cache *cache = NULL;
+	void *obj = NULL;
+	int id = __atomic_load_n(&p->id, __ATOMIC_ACQUIRE);
+
+	if (id >= 0)
+	{
+		cache = &thread_cache[id];
+		if (cache->head != NULL)
+		{
+			obj = cache->head;
+			cache->head = *(void **)obj;
+			cache->count--;
+			return obj;
+		}
+	}
+
+	return pool_refill(p);
+}
+
+
+/*
+ * Returns an object to the pool it was allocated from. The calling 
+ * thread caches it, a full cache hands a batch back to the pool.
+ */
+void pool_free(pool *p, void *obj)
+{
+	pool_cache *cache = &thread_cache[p->id];
+	void *next = NULL;
+	int i = 0;
+
+	*(void **)obj = cache->head;
+	cache->head = obj;
+	cache->count++;
+
+	if (cache->count <= POOL_CACHE_MAX)
+		return;
+
+	pthread_mutex_lock(&p->lock);
+	for (i = 0; i < POOL_BATCH; i++)
+	{
+		obj = cache->head;
+		next = *(void **)obj;
+		*(void **)obj = p->free_list;
+		p->free_list = obj;
+		cache->head = next;
+	}
+	cache->count -= POOL_BATCH;
+	p->free_count += POOL_BATCH;
+	pthread_mutex_unlock(&p->lock);
+}
+
+
+/*
+ * Reports the occupancy of up to max pools. Takes no locks, so it may be
+ * called from anywhere, and the figures of a pool may be slightly out of
+ * step with each other. Returns the number of pools reported.
+ */
+int pool_get_stats(pool_stats *stats, int max)
+{
+	pool *p = NULL;
+	int count = 0;
+	int i = 0;
+
+	count = __atomic_load_n(&pool_count, __ATOMIC_ACQUIRE);
+	for (i = 0; (i < count) && (i < max); i++)
+	{
+		p = pools[i];
+		stats[i].name = p->name;
+		stats[i].size = p->size;
+		stats[i].slabs = __atomic_load_n(&p->slabs, __ATOMIC_RELAXED);
+		stats[i].capacity = __atomic_load_n(&p->capacity, __ATOMIC_RELAXED);
+		stats[i].free = __atomic_load_n(&p->free_count, __ATOMIC_RELAXED);
+		stats[i].used = stats[i].capacity - stats[i].free;
+	}
+
+	return i;
+}
+
+
+/*
+ * Logs the occupancy of all pools.
+ */
+void pool_log_stats(void)
+{
+	pool_stats stats[POOL_MAX];
+	int count = 0;
+	int i = 0;
+
+	count = pool_get_stats(stats, POOL_MAX);
+	for (i = 0; i < count; i++)
+	{
+		logline(LOG_INFO, "Pool %s: %lu bytes/object, %lu slabs, %lu objects, %lu used or cached, %lu free",
+			stats[i].name, (unsigned long)stats[i].size, stats[i].slabs, stats[i].capacity, 
+			stats[i].used, stats[i].free);
+	}
+}
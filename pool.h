@@ -0,0 +1,69 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define POOL_MAX          32        /* Max. number of pools */
+#define POOL_SLAB_SIZE    65536     /* Bytes allocated at once */
+#define POOL_BATCH        32        /* Objects moved to or from a thread */
+#define POOL_CACHE_MAX    128       /* Objects a thread keeps for itself */
+
+/* A pool of equally sized objects, carved from slabs that are never given
+ * back. Each thread keeps a small cache of free objects per pool, so 
+ * most allocations and frees take no lock. Objects may be freed by any
+ * thread.
+ */
+typedef struct pool
+{
+	const char *name;
+	size_t size;                  /* Object size as requested */
+	int id;                       /* Index of the thread caches, -1 until first use */
+	pthread_mutex_t lock;         /* Protects everything below */
+	void *free_list;              /* Objects not cached by any thread */
+	unsigned long free_count;
+	unsigned long slabs;
+	unsigned long capacity;       /* Objects carved from slabs */
+} pool;
+
+#define POOL_INITIALIZER(pool_name, object_size) \
+	{ .name = (pool_name), .size = (object_size), .id = -1, \
+	  .lock = PTHREAD_MUTEX_INITIALIZER, .free_list = NULL, \
+	  .free_count = 0, .slabs = 0, .capacity = 0 }
+
+/* Occupancy of a pool */
+typedef struct pool_stats
+{
+	const char *name;
+	size_t size;
+	unsigned long slabs;
+	unsigned long capacity;
+	unsigned long free;           /* Not handed out to any thread */
+	unsigned long used;           /* In use or cached by a thread */
+} pool_stats;
+
+void* pool_alloc(pool *p);
+void pool_free(pool *p, void *obj);
+int pool_get_stats(pool_stats *stats, int max);
+void pool_log_stats(void);
+
+#endif /* POOL_H */
@@ -0,0 +1,288 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <string.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "room.h"
+#include "llist2.h"
+
+/* Room table. Joining and leaving are rare compared to messages, so they
+ * are serialized by a single mutex. Delivery does not take it.
+ */
+static room rooms[MAX_ROOMS];
+static pthread_mutex_t rooms_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * Sets up the lobby, which always exists.
+ */
+void room_init(void)
+{
+	int i = 0;
+
+	for (i = 0; i < MAX_ROOMS; i++)
+		history_init(&rooms[i].history);
+	strcpy(rooms[ROOM_LOBBY].name, ROOM_LOBBY_NAME);
+}
+
+
+/*
+ * Removes a session from its room. Rooms other than the lobby are freed
+ * once their last member is gone. Must be called with the mutex held.
+ */
+static void leave_locked(client_info *ci)
+{
+	room *r = NULL;
+	client_set *set = NULL;
+	int slot = ci->room_slot;
+
+	if (ci->room < 0)
+		return;
+
+	r = &rooms[ci->room];
+	set = &r->local[ci->worker_id];
+	if ((slot >= 0) && (slot < set->count) && (set->items[slot] == ci))
+	{
+		set->count--;
+		set->items[slot] = set->items[set->count];
+		set->items[slot]->room_slot = slot;
+	}
+	r->members--;
+	__atomic_store_n(&r->worker_members[ci->worker_id], r->worker_members[ci->worker_id] - 1, __ATOMIC_RELAXED);
+
+	/* Messages still on their way to the room are dropped */
+	if ((r->members == 0) && (ci->room != ROOM_LOBBY))
+	{
+		r->name[0] = '\0';
+		__atomic_store_n(&r->generation, r->generation + 1, __ATOMIC_RELEASE);
+		history_clear(&r->history);
+	}
+
+	ci->room = -1;
+	ci->room_slot = -1;
+}
+
+
+/*
+ * Moves a session into a room, creating the room if needed. Must be 
+ * called by the worker owning the session. Returns the id of the room, or
+ * -1 if the name is invalid or all rooms are in use.
+ */
+int room_join(client_info *ci, const char *name, size_t len)
+{
+	room *r = NULL;
+	int free_id = -1;
+	int created = 0;
+	int id = -1;
+	int slot = 0;
+	int i = 0;
+
+	if ((len == 0) || (len > MAX_ROOM_LEN))
+		return -1;
+
+	pthread_mutex_lock(&rooms_mutex);
+	for (i = 0; i < MAX_ROOMS; i++)
+	{
+		if (rooms[i].name[0] == '\0')
+		{
+			if (free_id < 0)
+				free_id = i;
+		}
+		else if ((strncmp(rooms[i].name, name, len) == 0) && (rooms[i].name[len] == '\0'))
+		{
+			id = i;
+			break;
+		}
+	}
+
+	if ((id >= 0) && (id == ci->room))
+	{
+		pthread_mutex_unlock(&rooms_mutex);
+		return id;
+	}
+
+	if (id < 0)
+	{
+		if (free_id < 0)
+		{
+			pthread_mutex_unlock(&rooms_mutex);
+			return -1;
+		}
+		id = free_id;
+		memcpy(rooms[id].name, name, len);
+		rooms[id].name[len] = '\0';
+		created = 1;
+	}
+
+	r = &rooms[id];
+	slot = client_set_add(&r->local[ci->worker_id], ci);
+	if (slot < 0)
+	{
+		/* Only a room created for this session goes again, never the lobby */
+		if (created)
+			r->name[0] = '\0';
+		pthread_mutex_unlock(&rooms_mutex);
+		return -1;
+	}
+
+	leave_locked(ci);
+	ci->room = id;
+	ci->room_slot = slot;
+	r->members++;
+	__atomic_store_n(&r->worker_members[ci->worker_id], r->worker_members[ci->worker_id] + 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&rooms_mutex);
+
+	return id;
+}
+
+
+/*
+ * Removes a session from its room when it disconnects. Must be called by
+ * the worker owning the session.
+ */
+void room_leave(client_info *ci)
+{
+	pthread_mutex_lock(&rooms_mutex);
+	leave_locked(ci);
+	pthread_mutex_unlock(&rooms_mutex);
+}
+
+
+/*
+ * Looks up a room by name without joining it. Returns its id, or -1 if 
+ * no room of that name is in use. If generation is not NULL, it receives
+ * the generation of the room, read together with the name, so that 
+ * threads not owning a member can tell when the slot has been reused.
+ */
+int room_find(const char *name, size_t len, unsigned long *generation)
+{
+	int id = -1;
+	int i = 0;
+
+	if ((len == 0) || (len > MAX_ROOM_LEN))
+		return -1;
+
+	pthread_mutex_lock(&rooms_mutex);
+	for (i = 0; i < MAX_ROOMS; i++)
+	{
+		if ((rooms[i].name[0] != '\0') && (strncmp(rooms[i].name, name, len) == 0) && (rooms[i].name[len] == '\0'))
+		{
+			id = i;
+			if (generation != NULL)
+				*generation = rooms[i].generation;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&rooms_mutex);
+
+	return id;
+}
+
+
+/*
+ * Checks whether a worker owns members of a room. Lock-free, a member who
+ * is just joining may be missed.
+ */
+int room_has_members(int id, int worker_id)
+{
+	return __atomic_load_n(&rooms[id].worker_members[worker_id], __ATOMIC_RELAXED) > 0;
+}
+
+
+/*
+ * Returns the generation of a room, which changes when the room is freed.
+ */
+unsigned long room_get_generation(int id)
+{
+	return __atomic_load_n(&rooms[id].generation, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Returns the members of a room owned by a worker. Only the worker itself
+ * may use the set.
+ */
+client_set* room_get_members(int id, int worker_id)
+{
+	return &rooms[id].local[worker_id];
+}
+
+
+/*
+ * Returns the name of a room. Only valid for the room of a session owned
+ * by the calling worker, which keeps the room alive.
+ */
+const char* room_get_name(int id)
+{
+	return rooms[id].name;
+}
+
+
+/*
+ * Returns the history of a room. Same rules as for room_get_name().
+ */
+history* room_get_history(int id)
+{
+	return &rooms[id].history;
+}
+
+
+/*
+ * Keeps a message in the history of a room, unless the room has been 
+ * freed since generation was taken. For threads not owning a member, the
+ * room cannot go away meanwhile as its slot is checked under the mutex.
+ */
+int room_append_history(int id, unsigned long generation, struct msg *m)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&rooms_mutex);
+	if (rooms[id].generation == generation)
+	{
+		history_append(&rooms[id].history, m);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&rooms_mutex);
+
+	return ret;
+}
+
+
+/*
+ * Calls a function for every room in use. The room table is locked in 
+ * the meantime, so the function must not join or leave rooms.
+ */
+int room_walk(void (*fn)(const char *name, int members, void *arg), void *arg)
+{
+	int count = 0;
+	int i = 0;
+
+	pthread_mutex_lock(&rooms_mutex);
+	for (i = 0; i < MAX_ROOMS; i++)
+	{
+		if (rooms[i].name[0] == '\0')
+			continue;
+		fn(rooms[i].name, rooms[i].members, arg);
+		count++;
+	}
+	pthread_mutex_unlock(&rooms_mutex);
+
+	return count;
+}
@@ -0,0 +1,60 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef ROOM_H
+#define ROOM_H
+
+#include <stddef.h>
+#include "worker.h"
+#include "history.h"
+
+#define MAX_ROOMS       256       /* Max. number of rooms in use at once */
+#define MAX_ROOM_LEN    19        /* Max. length of a room name */
+#define ROOM_LOBBY      0         /* Room every user starts in */
+#define ROOM_LOBBY_NAME "lobby"
+
+struct client_info;
+
+/* A chat room. Members are kept per worker, so that a worker delivering 
+ * a message only walks its own members of the room. Each set is only 
+ * ever changed by the worker owning it.
+ */
+typedef struct room
+{
+	char name[MAX_ROOM_LEN + 1];  /* Empty if the slot is free */
+	unsigned long generation;     /* Bumped whenever the slot is reused */
+	int members;                  /* Members across all workers */
+	int worker_members[MAX_WORKERS];  /* Members per worker */
+	client_set local[MAX_WORKERS];    /* Members per worker */
+	history history;              /* Recent chat lines */
+} room;
+
+void room_init(void);
+int room_join(struct client_info *ci, const char *name, size_t len);
+void room_leave(struct client_info *ci);
+int room_find(const char *name, size_t len, unsigned long *generation);
+int room_has_members(int id, int worker_id);
+unsigned long room_get_generation(int id);
+client_set* room_get_members(int id, int worker_id);
+const char* room_get_name(int id);
+history* room_get_history(int id);
+int room_append_history(int id, unsigned long generation, struct msg *m);
+int room_walk(void (*fn)(const char *name, int members, void *arg), void *arg);
+
+#endif /* ROOM_H */
@@ -0,0 +1,328 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <string.h>
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+typedef size_t (*scan_fn)(scan_state *st, const unsigned char *p, size_t len);
+
+static size_t scan_scalar(scan_state *st, const unsigned char *p, size_t len);
+#ifdef SCAN_X86
+static size_t scan_sse2(scan_state *st, const unsigned char *p, size_t len);
+static size_t scan_avx2(scan_state *st, const unsigned char *p, size_t len);
+#endif
+
+/* Implementations, best one last */
+static const struct
+{
+	const char *name;
+	scan_fn fn;
+} impls[] =
+{
+	{ "scalar", scan_scalar },
+#ifdef SCAN_X86
+	{ "sse2", scan_sse2 },
+	{ "avx2", scan_avx2 },
+#endif
+	{ NULL, NULL }
+};
+
+static int impl = 0;
+
+
+/*
+ * Returns true if the CPU can run an implementation.
+ */
+static int scan_supported(const char *name)
+{
+	if (strcmp(name, "scalar") == 0)
+		return 1;
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+	if (strcmp(name, "sse2") == 0)
+		return __builtin_cpu_supports("sse2");
+	if (strcmp(name, "avx2") == 0)
+		return __builtin_cpu_supports("avx2");
+#endif
+	return 0;
+}
+
+
+/*
+ * Picks the fastest implementation the CPU supports. Must be called 
+ * before lines are scanned by more than one thread.
+ */
+void scan_init(void)
+{
+	int i = 0;
+
+	for (i = 0; impls[i].name != NULL; i++)
+	{
+		if (scan_supported(impls[i].name))
+			impl = i;
+	}
+}
+
+
+/*
+ * Selects an implementation by name. Returns -1 if it is unknown or not
+ * supported by the CPU.
+ */
+int scan_select(const char *name)
+{
+	int i = 0;
+
+	for (i = 0; impls[i].name != NULL; i++)
+	{
+		if ((strcmp(impls[i].name, name) == 0) && scan_supported(name))
+		{
+			impl = i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+
+/*
+ * Returns the name of the implementation in use.
+ */
+const char* scan_get_impl(void)
+{
+	return impls[impl].name;
+}
+
+
+/*
+ * Returns the name of the implementation at index, or NULL past the 
+ * last one.
+ */
+const char* scan_get_impl_name(int index)
+{
+	return impls[index].name;
+}
+
+
+/*
+ * Prepares the state for a new line.
+ */
+void scan_reset(scan_state *st)
+{
+	memset(st, 0, sizeof(scan_state));
+}
+
+
+/*
+ * Scans data up to the end of the current line. Returns the offset of 
+ * the terminating \n, or len if the line does not end within data. 
+ * Problems found on the way are added to st->flags.
+ */
+size_t scan_line(scan_state *st, const char *data, size_t len)
+{
+	return impls[impl].fn(st, (const unsigned char *)data, len);
+}
+
+
+/*
+ * Checks a single byte. Allowed are printable ASCII, tabs, a \r right 
+ * before the \n and well-formed UTF-8 without C1 controls. Returns 1 if
+ * the byte ends the line.
+ */
+static inline int scan_byte(scan_state *st, unsigned char c)
+{
+	if (st->cr)
+	{
+		st->cr = 0;
+		if (c != '\n')
+			st->flags |= SCAN_CONTROL;
+	}
+
+	if (st->need > 0)
+	{
+		if ((c >= st->lo) && (c <= st->hi))
+		{
+			/* U+0080 to U+009F are control characters as well */
+			if ((st->lead == 0xc2) && (c < 0xa0))
+				st->flags |= SCAN_CONTROL;
+			st->need--;
+			st->lo = 0x80;
+			st->hi = 0xbf;
+			st->lead = 0;
+			return 0;
+		}
+
+		/* Sequence cut short, look at the byte on its own */
+		st->flags |= SCAN_UTF8;
+		st->need = 0;
+	}
+
+	if ((c >= 0x20) && (c < 0x7f))
+		return 0;
+
+	if (c < 0x80)
+	{
+		if (c == '\n')
+			return 1;
+		if (c == '\r')
+			st->cr = 1;
+		else if (c != '\t')
+			st->flags |= SCAN_CONTROL;
+		return 0;
+	}
+
+	/* Lead byte. The range of the following byte excludes overlong 
+	 * forms, surrogates and code points beyond U+10FFFF.
+	 */
+	st->lead = c;
+	st->lo = 0x80;
+	st->hi = 0xbf;
+	if ((c >= 0xc2) && (c <= 0xdf))
+		st->need = 1;
+	else if ((c >= 0xe0) && (c <= 0xef))
+	{
+		st->need = 2;
+		if (c == 0xe0)
+			st->lo = 0xa0;
+		else if (c == 0xed)
+			st->hi = 0x9f;
+	}
+	else if ((c >= 0xf0) && (c <= 0xf4))
+	{
+		st->need = 3;
+		if (c == 0xf0)
+			st->lo = 0x90;
+		else if (c == 0xf4)
+			st->hi = 0x8f;
+	}
+	else
+		st->flags |= SCAN_UTF8;
+
+	return 0;
+}
+
+
+/*
+ * Byte by byte, for CPUs without vector units.
+ */
+static size_t scan_scalar(scan_state *st, const unsigned char *p, size_t len)
+{
+	size_t i = 0;
+
+	for (i = 0; i < len; i++)
+	{
+		if (scan_byte(st, p[i]))
+			return i;
+	}
+
+	return len;
+}
+
+
+#ifdef SCAN_X86
+
+/*
+ * Skips blocks of 16 bytes of printable ASCII, which make up most chat
+ * traffic. Everything else, including \n, is handed to scan_byte().
+ */
+__attribute__((target("sse2")))
+static size_t scan_sse2(scan_state *st, const unsigned char *p, size_t len)
+{
+	const __m128i space = _mm_set1_epi8(0x20);
+	const __m128i del = _mm_set1_epi8(0x7f);
+	__m128i v;
+	size_t i = 0;
+	int mask = 0;
+
+	while (i < len)
+	{
+		/* Signed compares catch bytes from 0x80 on as well */
+		if ((st->need == 0) && !st->cr)
+		{
+			while (i + 16 <= len)
+			{
+				v = _mm_loadu_si128((const __m128i *)(p + i));
+				mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(v, space), 
+					_mm_cmpeq_epi8(v, del)));
+				if (mask != 0)
+				{
+					i += __builtin_ctz(mask);
+					break;
+				}
+				i += 16;
+			}
+			if (i >= len)
+				break;
+		}
+
+		if (scan_byte(st, p[i]))
+			return i;
+		i++;
+	}
+
+	return len;
+}
+
+
+/*
+ * Same as scan_sse2(), 32 bytes at a time.
+ */
+__attribute__((target("avx2")))
+static size_t scan_avx2(scan_state *st, const unsigned char *p, size_t len)
+{
+	const __m256i space = _mm256_set1_epi8(0x20);
+	const __m256i del = _mm256_set1_epi8(0x7f);
+	__m256i v;
+	size_t i = 0;
+	unsigned int mask = 0;
+
+	while (i < len)
+	{
+		if ((st->need == 0) && !st->cr)
+		{
+			while (i + 32 <= len)
+			{
+				v = _mm256_loadu_si256((const __m256i *)(p + i));
+				mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(
+					_mm256_cmpgt_epi8(space, v), _mm256_cmpeq_epi8(v, del)));
+				if (mask != 0)
+				{
+					i += __builtin_ctz(mask);
+					break;
+				}
+				i += 32;
+			}
+			if (i >= len)
+				break;
+		}
+
+		if (scan_byte(st, p[i]))
+			return i;
+		i++;
+	}
+
+	return len;
+}
+
+#endif /* SCAN_X86 */
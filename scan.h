@@ -0,0 +1,49 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+/* Problems found on a line */
+#define SCAN_CONTROL    0x01      /* Control or escape characters */
+#define SCAN_UTF8       0x02      /* Invalid UTF-8 */
+
+/* State of a line being scanned. Lines may arrive in pieces, the state
+ * carries over from one piece to the next.
+ */
+typedef struct scan_state
+{
+	int flags;                    /* SCAN_* found so far */
+	unsigned int need;            /* Continuation bytes still expected */
+	unsigned char lo;             /* Range of the next continuation byte */
+	unsigned char hi;
+	unsigned char lead;           /* Lead byte of the current sequence */
+	unsigned char cr;             /* Last byte was a \r */
+} scan_state;
+
+void scan_init(void);
+int scan_select(const char *name);
+const char* scan_get_impl(void);
+const char* scan_get_impl_name(int index);
+void scan_reset(scan_state *st);
+size_t scan_line(scan_state *st, const char *data, size_t len);
+
+#endif /* SCAN_H */
@@ -0,0 +1,170 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+static stats_segment *segment = NULL;
+static char segment_name[32];
+
+
+/*
+ * Creates the shared segment for a server on the given port. Returns -1
+ * on errors.
+ */
+int stats_open(int port, int workers)
+{
+	int fd = -1;
+
+	snprintf(segment_name, sizeof(segment_name), STATS_NAME_FMT, port);
+	fd = shm_open(segment_name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, sizeof(stats_segment)) != 0)
+	{
+		close(fd);
+		shm_unlink(segment_name);
+		return -1;
+	}
+
+	segment = (stats_segment *)mmap(NULL, sizeof(stats_segment), PROT_READ | PROT_WRITE, 
+		MAP_SHARED, fd, 0);
+	close(fd);
+	if (segment == MAP_FAILED)
+	{
+		segment = NULL;
+		shm_unlink(segment_name);
+		return -1;
+	}
+
+	segment->version = STATS_VERSION;
+	segment->pid = getpid();
+	segment->workers = workers;
+	segment->started = time(NULL);
+	__atomic_store_n(&segment->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+
+/*
+ * Removes the shared segment.
+ */
+void stats_close(void)
+{
+	if (segment == NULL)
+		return;
+
+	shm_unlink(segment_name);
+	munmap(segment, sizeof(stats_segment));
+	segment = NULL;
+}
+
+
+/*
+ * Returns the part of the segment a worker publishes to, or NULL if 
+ * there is no segment.
+ */
+stats_worker* stats_slot(int worker_id)
+{
+	if ((segment == NULL) || (worker_id >= STATS_MAX_WORKERS))
+		return NULL;
+
+	return &segment->worker[worker_id];
+}
+
+
+/*
+ * Starts an update. Readers ignore what they copy until it has ended.
+ */
+void stats_write_begin(stats_worker *sw)
+{
+	__atomic_store_n(&sw->seq, sw->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+/*
+ * Ends an update.
+ */
+void stats_write_end(stats_worker *sw)
+{
+	__atomic_store_n(&sw->seq, sw->seq + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Maps the segment of a server on the given port for reading. Returns 
+ * NULL if there is none.
+ */
+stats_segment* stats_attach(int port)
+{
+	stats_segment *seg = NULL;
+	char name[32];
+	int fd = -1;
+
+	snprintf(name, sizeof(name), STATS_NAME_FMT, port);
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+
+	seg = (stats_segment *)mmap(NULL, sizeof(stats_segment), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (seg == MAP_FAILED)
+		return NULL;
+
+	if ((__atomic_load_n(&seg->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC) || 
+		(seg->version != STATS_VERSION))
+	{
+		munmap(seg, sizeof(stats_segment));
+		return NULL;
+	}
+
+	return seg;
+}
+
+
+/*
+ * Takes a consistent copy of what a worker has published. Returns -1 if
+ * the worker kept updating, e.g. because it died in the middle of it.
+ */
+int stats_read(const stats_worker *sw, stats_worker *copy)
+{
+	unsigned int before = 0;
+	unsigned int after = 0;
+	int tries = 0;
+
+	for (tries = 0; tries < 1000; tries++)
+	{
+		before = __atomic_load_n(&sw->seq, __ATOMIC_ACQUIRE);
+		memcpy(copy, (const void *)sw, sizeof(stats_worker));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&sw->seq, __ATOMIC_RELAXED);
+		if (!(before & 1) && (before == after))
+			return 0;
+	}
+
+	return -1;
+}
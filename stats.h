@@ -0,0 +1,81 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef STATS_H
+#define STATS_H
+
+#define STATS_MAGIC       0x43485354  /* "CHST" */
+#define STATS_VERSION     2
+#define STATS_MAX_WORKERS 64
+#define STATS_TOP_TALKERS 10          /* Busiest sessions per worker */
+#define STATS_NAME_FMT    "/chatsrv-%d"  /* Segment name, by chat port */
+
+/* A session that sent many lines lately */
+typedef struct stats_talker
+{
+	char nickname[20];
+	unsigned int lines;           /* Lines sent during the last interval */
+} stats_talker;
+
+/* Published by one worker. The sequence number is odd while the worker
+ * updates the rest, readers retry until they see the same even number 
+ * before and after copying.
+ */
+typedef struct stats_worker
+{
+	unsigned int seq;
+	unsigned int talker_count;
+	unsigned long long updated;   /* CLOCK_MONOTONIC, ns */
+	unsigned long long interval;  /* Since the previous update, ns */
+	unsigned long long sessions;
+	unsigned long long accepts;
+	unsigned long long msgs_in;
+	unsigned long long msgs_out;
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+	unsigned long long queued_bytes;   /* Output waiting for all sessions */
+	unsigned long long queued_sessions;
+	unsigned long long max_queue;      /* Longest send queue, bytes */
+	unsigned long long lagged;
+	unsigned long long paused;         /* Sessions over their input budget */
+	unsigned long long flood_pauses;
+	unsigned long long flood_drops;
+	stats_talker talkers[STATS_TOP_TALKERS];
+} __attribute__((aligned(64))) stats_worker;
+
+/* Layout of the shared segment */
+typedef struct stats_segment
+{
+	unsigned int magic;
+	unsigned int version;
+	int pid;
+	int workers;
+	long long started;            /* time() */
+	stats_worker worker[STATS_MAX_WORKERS];
+} stats_segment;
+
+int stats_open(int port, int workers);
+void stats_close(void);
+stats_worker* stats_slot(int worker_id);
+void stats_write_begin(stats_worker *sw);
+void stats_write_end(stats_worker *sw);
+stats_segment* stats_attach(int port);
+int stats_read(const stats_worker *sw, stats_worker *copy);
+
+#endif /* STATS_H */
@@ -0,0 +1,294 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <time.h>
+#include "timer.h"
+#include "bool.h"
+
+static void link_timer(timer *head, timer *t);
+static void unlink_timer(timer *t);
+static void place(timer_wheel *tw, timer *t);
+static unsigned int cascade(timer_wheel *tw, int level);
+
+
+/*
+ * Returns the time in ms, as used by the wheels.
+ */
+unsigned long long timer_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+
+/*
+ * Sets up an empty wheel, starting at a time in ms.
+ */
+void timer_wheel_init(timer_wheel *tw, unsigned long long now)
+{
+	int i = 0;
+	int j = 0;
+
+	tw->now = now / TIMER_TICK_MS;
+	tw->count = 0;
+	for (i = 0; i < TIMER_LEVELS; i++)
+	{
+		for (j = 0; j < TIMER_SLOTS; j++)
+		{
+			tw->slots[i][j].next = &tw->slots[i][j];
+			tw->slots[i][j].prev = &tw->slots[i][j];
+		}
+	}
+}
+
+
+/*
+ * Sets up a timer calling fn(arg) when it expires. It is not armed yet.
+ */
+void timer_init(timer *t, void (*fn)(void *arg), void *arg)
+{
+	t->next = NULL;
+	t->prev = NULL;
+	t->expires = 0;
+	t->fn = fn;
+	t->arg = arg;
+}
+
+
+/*
+ * Appends a timer to a slot.
+ */
+static void link_timer(timer *head, timer *t)
+{
+	t->prev = head->prev;
+	t->next = head;
+	head->prev->next = t;
+	head->prev = t;
+}
+
+
+/*
+ * Takes a timer off its slot.
+ */
+static void unlink_timer(timer *t)
+{
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = NULL;
+	t->prev = NULL;
+}
+
+
+/*
+ * Puts a timer into the slot covering its expiry. The further away it
+ * is, the higher the level.
+ */
+static void place(timer_wheel *tw, timer *t)
+{
+	unsigned long long delta = t->expires - tw->now;
+	int level = 0;
+
+	if (delta >= (1ULL << (TIMER_BITS * TIMER_LEVELS)))
+	{
+		delta = (1ULL << (TIMER_BITS * TIMER_LEVELS)) - 1;
+		t->expires = tw->now + delta;
+	}
+
+	while (delta >= (1ULL << (TIMER_BITS * (level + 1))))
+		level++;
+
+	link_timer(&tw->slots[level][(t->expires >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1)], t);
+}
+
+
+/*
+ * Arms a timer to expire in ms from the current time of the wheel, but
+ * not before the next tick. An armed timer is moved.
+ */
+void timer_set(timer_wheel *tw, timer *t, unsigned long ms)
+{
+	unsigned long long ticks = (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+	if (t->next != NULL)
+		unlink_timer(t);
+	else
+		tw->count++;
+
+	t->expires = tw->now + ((ticks > 0) ? ticks : 1);
+	place(tw, t);
+}
+
+
+/*
+ * Disarms a timer. Does nothing if it is not armed.
+ */
+void timer_cancel(timer_wheel *tw, timer *t)
+{
+	if (t->next == NULL)
+		return;
+
+	unlink_timer(t);
+	tw->count--;
+}
+
+
+/*
+ * Returns TRUE if a timer is armed.
+ */
+int timer_pending(const timer *t)
+{
+	return t->next != NULL;
+}
+
+
+/*
+ * Returns the current time of a wheel in ms. Cheaper than a clock read,
+ * and accurate to a tick after timer_run().
+ */
+unsigned long long timer_now(const timer_wheel *tw)
+{
+	return tw->now * TIMER_TICK_MS;
+}
+
+
+/*
+ * Moves the timers of the current slot of a level down. Returns the 
+ * index of the slot, 0 means the level above is due as well.
+ */
+static unsigned int cascade(timer_wheel *tw, int level)
+{
+	unsigned int index = (tw->now >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1);
+	timer *head = &tw->slots[level][index];
+	timer *t = NULL;
+
+	while (head->next != head)
+	{
+		t = head->next;
+		unlink_timer(t);
+		place(tw, t);
+	}
+
+	return index;
+}
+
+
+/*
+ * Advances a wheel to a time in ms and calls the timers expired by then.
+ * Timers may arm or cancel any timer of the wheel, themselves included.
+ */
+void timer_run(timer_wheel *tw, unsigned long long now)
+{
+	unsigned long long target = now / TIMER_TICK_MS;
+	timer expired;
+	timer *head = NULL;
+	timer *t = NULL;
+	int level = 0;
+
+	while (tw->now < target)
+	{
+		tw->now++;
+
+		/* Skip ahead over a stretch of empty ticks */
+		if (tw->count == 0)
+		{
+			tw->now = target;
+			break;
+		}
+
+		if ((tw->now & (TIMER_SLOTS - 1)) == 0)
+		{
+			for (level = 1; (level < TIMER_LEVELS) && (cascade(tw, level) == 0); level++)
+				;
+		}
+
+		/* Detach the slot first, timers called may rearm into it */
+		head = &tw->slots[0][tw->now & (TIMER_SLOTS - 1)];
+		if (head->next == head)
+			continue;
+		expired.next = head->next;
+		expired.prev = head->prev;
+		expired.next->prev = &expired;
+		expired.prev->next = &expired;
+		head->next = head;
+		head->prev = head;
+
+		while (expired.next != &expired)
+		{
+			t = expired.next;
+			unlink_timer(t);
+			tw->count--;
+			t->fn(t->arg);
+		}
+	}
+}
+
+
+/*
+ * Returns the number of ms until the wheel needs to run again, -1 if no
+ * timer is armed. Timers of higher levels count from the time they move
+ * down a level.
+ */
+long timer_next(const timer_wheel *tw)
+{
+	unsigned long long best = 0;
+	unsigned long long at = 0;
+	unsigned long long span = 0;
+	const timer *head = NULL;
+	int level = 0;
+	int i = 0;
+
+	if (tw->count == 0)
+		return -1;
+
+	for (i = 1; i <= TIMER_SLOTS; i++)
+	{
+		head = &tw->slots[0][(tw->now + i) & (TIMER_SLOTS - 1)];
+		if (head->next != head)
+		{
+			best = tw->now + i;
+			break;
+		}
+	}
+
+	for (level = 1; level < TIMER_LEVELS; level++)
+	{
+		span = 1ULL << (TIMER_BITS * level);
+		at = ((tw->now >> (TIMER_BITS * level)) + 1) << (TIMER_BITS * level);
+		for (i = 0; i < TIMER_SLOTS; i++, at += span)
+		{
+			if ((best != 0) && (at >= best))
+				break;
+			head = &tw->slots[level][(at >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1)];
+			if (head->next != head)
+			{
+				best = at;
+				break;
+			}
+		}
+	}
+
+	if (best == 0)
+		return -1;
+
+	return (long)((best - tw->now) * TIMER_TICK_MS);
+}
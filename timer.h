@@ -0,0 +1,62 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#define TIMER_TICK_MS   10        /* Resolution of the wheel */
+#define TIMER_BITS      6
+#define TIMER_SLOTS     (1 << TIMER_BITS)  /* Slots per level */
+#define TIMER_LEVELS    4         /* Spans 64^4 ticks, about 46 hours */
+
+/* A timer embedded in the object it belongs to. Arming, cancelling and 
+ * expiring are O(1), the wheel never allocates.
+ */
+typedef struct timer
+{
+	struct timer *next;           /* NULL while not armed */
+	struct timer *prev;
+	unsigned long long expires;   /* Tick */
+	void (*fn)(void *arg);
+	void *arg;
+} timer;
+
+/* Hierarchical timing wheel. Level 0 has a slot per tick, every higher 
+ * level a slot per 64 slots of the level below. Timers of higher levels
+ * move down as their slot comes up, until they expire from level 0.
+ * Owned by one thread, no locking.
+ */
+typedef struct timer_wheel
+{
+	unsigned long long now;       /* Last tick processed */
+	unsigned long count;          /* Timers armed */
+	timer slots[TIMER_LEVELS][TIMER_SLOTS];  /* List heads */
+} timer_wheel;
+
+unsigned long long timer_clock(void);
+void timer_wheel_init(timer_wheel *tw, unsigned long long now);
+void timer_init(timer *t, void (*fn)(void *arg), void *arg);
+void timer_set(timer_wheel *tw, timer *t, unsigned long ms);
+void timer_cancel(timer_wheel *tw, timer *t);
+int timer_pending(const timer *t);
+unsigned long long timer_now(const timer_wheel *tw);
+void timer_run(timer_wheel *tw, unsigned long long now);
+long timer_next(const timer_wheel *tw);
+
+#endif /* TIMER_H */
@@ -0,0 +1,235 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "upgrade.h"
+#include "log.h"
+
+/* Descriptor of the upgrade socket in a new process */
+#define UPGRADE_FD        3
+
+static void close_from(int first, long max_fd);
+
+
+/*
+ * Starts the binary named by argv[0] with the same arguments, handing it
+ * one end of a socket pair. Returns the other end, on which the state is
+ * sent, or -1 on errors. Sends and receives on it time out after 
+ * UPGRADE_TIMEOUT seconds, in case the new process hangs.
+ */
+int upgrade_spawn(char **argv, pid_t *pid)
+{
+	struct timeval timeout;
+	char value[16];
+	long max_fd = sysconf(_SC_OPEN_MAX);
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0)
+		return -1;
+
+	timeout.tv_sec = UPGRADE_TIMEOUT;
+	timeout.tv_usec = 0;
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	/* Set up front, nothing but async-signal-safe calls may follow fork() */
+	snprintf(value, sizeof(value), "%d", UPGRADE_FD);
+	if (setenv(UPGRADE_ENV, value, 1) != 0)
+	{
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+
+	*pid = fork();
+	if (*pid == 0)
+	{
+		/* Only the socket pair and the standard streams are passed on, 
+		 * sessions must not be held open by stray copies
+		 */
+		if (sv[1] == UPGRADE_FD)
+			fcntl(UPGRADE_FD, F_SETFD, 0);
+		else if (dup2(sv[1], UPGRADE_FD) < 0)
+			_exit(127);
+		close_from(UPGRADE_FD + 1, max_fd);
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+	unsetenv(UPGRADE_ENV);
+	close(sv[1]);
+
+	if (*pid < 0)
+	{
+		close(sv[0]);
+		return -1;
+	}
+
+	return sv[0];
+}
+
+
+/*
+ * Closes all descriptors from first on, in a child about to exec.
+ */
+static void close_from(int first, long max_fd)
+{
+	int fd = 0;
+
+#ifdef SYS_close_range
+	if (syscall(SYS_close_range, first, ~0U, 0) == 0)
+		return;
+#endif
+	for (fd = first; fd < max_fd; fd++)
+		close(fd);
+}
+
+
+/*
+ * Returns the upgrade socket if the process has been started by a hot 
+ * upgrade, -1 otherwise.
+ */
+int upgrade_inherited(void)
+{
+	char *value = getenv(UPGRADE_ENV);
+	int fd = 0;
+
+	if (value == NULL)
+		return -1;
+
+	fd = atoi(value);
+	unsetenv(UPGRADE_ENV);
+	if ((fd < 0) || (fcntl(fd, F_GETFD) < 0))
+		return -1;
+
+	/* Later upgrades of this process must not inherit it */
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	return fd;
+}
+
+
+/*
+ * Sends a record with len bytes of data and, unless fd is -1, a 
+ * descriptor. Returns -1 on errors.
+ */
+int upgrade_send(int sock, upgrade_record *rec, const void *data, size_t len, int fd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cmsg = NULL;
+	struct msghdr hdr;
+	struct iovec iov[2];
+
+	if (len > UPGRADE_DATA_MAX)
+		return -1;
+
+	rec->version = UPGRADE_VERSION;
+	rec->len = len;
+	iov[0].iov_base = rec;
+	iov[0].iov_len = sizeof(upgrade_record);
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = len;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_iov = iov;
+	hdr.msg_iovlen = (len > 0) ? 2 : 1;
+	if (fd >= 0)
+	{
+		memset(control, 0, sizeof(control));
+		hdr.msg_control = control;
+		hdr.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&hdr);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	if (sendmsg(sock, &hdr, MSG_NOSIGNAL) != (ssize_t)(sizeof(upgrade_record) + len))
+	{
+		logline(LOG_DEBUG, "upgrade_send(): Error calling sendmsg(): %s", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Receives a record. Its data goes to data, which has room for 
+ * UPGRADE_DATA_MAX bytes, a descriptor sent along to fd, which is -1 
+ * otherwise. Returns -1 on errors, if the other end has gone or sent a 
+ * record of another version.
+ */
+int upgrade_recv(int sock, upgrade_record *rec, char *data, int *fd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cmsg = NULL;
+	struct msghdr hdr;
+	struct iovec iov[2];
+	ssize_t ret = 0;
+
+	iov[0].iov_base = rec;
+	iov[0].iov_len = sizeof(upgrade_record);
+	iov[1].iov_base = data;
+	iov[1].iov_len = UPGRADE_DATA_MAX;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_iov = iov;
+	hdr.msg_iovlen = 2;
+	hdr.msg_control = control;
+	hdr.msg_controllen = sizeof(control);
+
+	*fd = -1;
+	ret = recvmsg(sock, &hdr, MSG_CMSG_CLOEXEC);
+	if (ret < 0)
+	{
+		logline(LOG_DEBUG, "upgrade_recv(): Error calling recvmsg(): %s", strerror(errno));
+		return -1;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&hdr, cmsg))
+	{
+		if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS))
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+
+	if ((ret < (ssize_t)sizeof(upgrade_record)) || (rec->version != UPGRADE_VERSION) || 
+		(rec->len != (size_t)ret - sizeof(upgrade_record)) || (hdr.msg_flags & MSG_TRUNC))
+	{
+		if (*fd >= 0)
+			close(*fd);
+		*fd = -1;
+		return -1;
+	}
+	rec->nickname[sizeof(rec->nickname) - 1] = '\0';
+	rec->room[sizeof(rec->room) - 1] = '\0';
+
+	return 0;
+}
@@ -0,0 +1,66 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include "room.h"
+
+#define UPGRADE_VERSION   1         /* Bumped whenever the records change */
+#define UPGRADE_ENV       "CHATSRV_UPGRADE_FD"  /* Tells a new process where its state comes from */
+#define UPGRADE_TIMEOUT   10        /* Seconds a new process has to take over */
+#define UPGRADE_DATA_MAX  16384     /* Max. bytes of data sent with a record */
+
+/* Record types. A hot upgrade sends HELLO, the listeners and an END, then
+ * the sessions, each followed by its queued output, the room histories 
+ * and another END. The new process answers READY once it has taken over.
+ */
+#define UPGRADE_HELLO     1         /* First record, carries the version */
+#define UPGRADE_LISTENER  2         /* Listener of a worker */
+#define UPGRADE_METRICS   3         /* Listener of the metrics page */
+#define UPGRADE_LINK      4         /* Listener for links from other nodes */
+#define UPGRADE_CLIENT    5         /* A session, data is its incomplete line */
+#define UPGRADE_OUTPUT    6         /* Output queued for the last session */
+#define UPGRADE_HISTORY   7         /* A line of the history of a room */
+#define UPGRADE_END       8         /* End of a group of records */
+#define UPGRADE_READY     9         /* The new process serves the sessions */
+
+/* State handed to a new process, one record per message. Records of
+ * listeners and sessions carry their descriptor along.
+ */
+typedef struct upgrade_record
+{
+	int type;
+	int version;
+	int worker;                   /* Worker owning the listener or session */
+	int discarding;               /* Skipping the rest of a too long line */
+	char nickname[20];
+	char room[MAX_ROOM_LEN + 1];
+	struct sockaddr_in address;
+	size_t len;                   /* Bytes of data following the record */
+} upgrade_record;
+
+int upgrade_spawn(char **argv, pid_t *pid);
+int upgrade_inherited(void);
+int upgrade_send(int sock, upgrade_record *rec, const void *data, size_t len, int fd);
+int upgrade_recv(int sock, upgrade_record *rec, char *data, int *fd);
+
+#endif /* UPGRADE_H */
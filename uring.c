@@ -0,0 +1,374 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "uring.h"
+#include "log.h"
+#include "bool.h"
+
+#ifdef HAVE_IO_URING
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+struct uring
+{
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_entries;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned sq_local_tail;      /* Next free submission slot */
+	unsigned pending;            /* Queued, not yet completed entries */
+	void *sq_ptr;
+	void *cq_ptr;
+	size_t sq_size;
+	size_t cq_size;
+	size_t sqes_size;
+};
+
+
+/*
+ * Checks whether the kernel supports the opcodes used by the ring.
+ */
+static int uring_probe(int fd)
+{
+	struct io_uring_probe *probe = NULL;
+	size_t size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	int ok = FALSE;
+
+	probe = (struct io_uring_probe *)calloc(1, size);
+	if (probe == NULL)
+		return FALSE;
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0)
+	{
+		ok = (probe->last_op >= IORING_OP_RECV) &&
+			(probe->ops[IORING_OP_SEND].flags & IO_URING_OP_SUPPORTED) &&
+			(probe->ops[IORING_OP_SENDMSG].flags & IO_URING_OP_SUPPORTED) &&
+			(probe->ops[IORING_OP_RECV].flags & IO_URING_OP_SUPPORTED);
+	}
+	free(probe);
+
+	return ok;
+}
+
+
+/*
+ * Sets up a ring with the given number of submission entries. Returns
+ * NULL if the kernel lacks io_uring or does not allow its use.
+ */
+uring* uring_create(unsigned entries)
+{
+	struct io_uring_params p;
+	uring *r = NULL;
+
+	r = (uring *)calloc(1, sizeof(uring));
+	if (r == NULL)
+		return NULL;
+	memset(&p, 0, sizeof(p));
+
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+	{
+		logline(LOG_DEBUG, "uring_create(): io_uring_setup() failed: %s", strerror(errno));
+		free(r);
+		return NULL;
+	}
+	if (!uring_probe(r->fd))
+	{
+		logline(LOG_DEBUG, "uring_create(): Kernel does not support IORING_OP_SEND/SENDMSG/RECV");
+		close(r->fd);
+		free(r);
+		return NULL;
+	}
+
+	/* Map submission and completion rings. Newer kernels share a single
+	 * mapping for both.
+	 */
+	r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (r->cq_size > r->sq_size)
+			r->sq_size = r->cq_size;
+		r->cq_size = r->sq_size;
+	}
+
+	r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+		r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED)
+		goto fail;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		r->cq_ptr = r->sq_ptr;
+	}
+	else
+	{
+		r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+			r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ptr == MAP_FAILED)
+			goto fail_sq;
+	}
+
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+		r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto fail_cq;
+
+	r->sq_head = (unsigned *)((char *)r->sq_ptr + p.sq_off.head);
+	r->sq_tail = (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+	r->sq_mask = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+	r->sq_entries = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_entries);
+	r->sq_array = (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+	r->cq_head = (unsigned *)((char *)r->cq_ptr + p.cq_off.head);
+	r->cq_tail = (unsigned *)((char *)r->cq_ptr + p.cq_off.tail);
+	r->cq_mask = (unsigned *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+	r->sq_local_tail = *r->sq_tail;
+
+	return r;
+
+fail_cq:
+	if (r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_size);
+fail_sq:
+	munmap(r->sq_ptr, r->sq_size);
+fail:
+	logline(LOG_DEBUG, "uring_create(): Error calling mmap(): %s", strerror(errno));
+	close(r->fd);
+	free(r);
+	return NULL;
+}
+
+
+/*
+ * Releases a ring. Pending entries must have been completed before.
+ */
+void uring_destroy(uring *r)
+{
+	if (r == NULL)
+		return;
+
+	munmap(r->sqes, r->sqes_size);
+	if (r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_size);
+	munmap(r->sq_ptr, r->sq_size);
+	close(r->fd);
+	free(r);
+}
+
+
+/*
+ * Returns the next free submission entry, or NULL if the submission
+ * queue is full and must be submitted first. Entries are only handed out
+ * as long as their completions are guaranteed to fit the completion queue,
+ * which is at least twice as large.
+ */
+static struct io_uring_sqe* uring_get_sqe(uring *r)
+{
+	unsigned head = 0;
+	unsigned idx = 0;
+	struct io_uring_sqe *sqe = NULL;
+
+	head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	if ((r->sq_local_tail - head >= *r->sq_entries) || (r->pending >= *r->sq_entries))
+		return NULL;
+
+	idx = r->sq_local_tail & *r->sq_mask;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[idx] = idx;
+	r->sq_local_tail++;
+	r->pending++;
+
+	return sqe;
+}
+
+
+/*
+ * Queues a send of the buffer to a socket. The buffer must stay valid
+ * until uring_submit_and_wait() returns. Returns -1 if the queue is full.
+ */
+int uring_prep_send(uring *r, int fd, const void *buf, size_t len, unsigned long long user_data)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(r);
+
+	if (sqe == NULL)
+		return -1;
+
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+	sqe->user_data = user_data;
+
+	return 0;
+}
+
+
+/*
+ * Queues a sendmsg() of the message to a socket. The message header and
+ * everything it points to must stay valid until uring_submit_and_wait() 
+ * returns. Returns -1 if the queue is full.
+ */
+int uring_prep_sendmsg(uring *r, int fd, const struct msghdr *msg, unsigned long long user_data)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(r);
+
+	if (sqe == NULL)
+		return -1;
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+	sqe->user_data = user_data;
+
+	return 0;
+}
+
+
+/*
+ * Queues a receive from a socket into the buffer. Returns -1 if the queue
+ * is full.
+ */
+int uring_prep_recv(uring *r, int fd, void *buf, size_t len, unsigned long long user_data)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(r);
+
+	if (sqe == NULL)
+		return -1;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->msg_flags = MSG_DONTWAIT;
+	sqe->user_data = user_data;
+
+	return 0;
+}
+
+
+/*
+ * Submits all queued entries with a single system call, waits for their 
+ * completions and reports each of them through the callback. The callback
+ * must not queue new entries. Returns the number of completions or -1 on 
+ * error.
+ */
+int uring_submit_and_wait(uring *r, uring_complete_fn complete, void *arg)
+{
+	unsigned to_submit = 0;
+	unsigned head = 0;
+	unsigned tail = 0;
+	int done = 0;
+	int ret = 0;
+	struct io_uring_cqe *cqe = NULL;
+
+	if (r->pending == 0)
+		return 0;
+
+	/* Publish queued entries to the kernel */
+	to_submit = r->sq_local_tail - *r->sq_tail;
+	__atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+
+	while (r->pending > 0)
+	{
+		ret = syscall(__NR_io_uring_enter, r->fd, to_submit, r->pending, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			logline(LOG_ERROR, "Error calling io_uring_enter(): %s", strerror(errno));
+			return -1;
+		}
+		to_submit -= ret;
+
+		/* Reap completions */
+		head = *r->cq_head;
+		tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+		while (head != tail)
+		{
+			cqe = &r->cqes[head & *r->cq_mask];
+			if (complete != NULL)
+				complete(arg, cqe->user_data, cqe->res);
+			head++;
+			r->pending--;
+			done++;
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return done;
+}
+
+#else /* HAVE_IO_URING */
+
+struct uring
+{
+	int unused;
+};
+
+uring* uring_create(unsigned entries)
+{
+	logline(LOG_DEBUG, "uring_create(): Built without io_uring support");
+	return NULL;
+}
+
+void uring_destroy(uring *r)
+{
+}
+
+int uring_prep_send(uring *r, int fd, const void *buf, size_t len, unsigned long long user_data)
+{
+	return -1;
+}
+
+int uring_prep_sendmsg(uring *r, int fd, const struct msghdr *msg, unsigned long long user_data)
+{
+	return -1;
+}
+
+int uring_prep_recv(uring *r, int fd, void *buf, size_t len, unsigned long long user_data)
+{
+	return -1;
+}
+
+int uring_submit_and_wait(uring *r, uring_complete_fn complete, void *arg)
+{
+	return -1;
+}
+
+#endif /* HAVE_IO_URING */
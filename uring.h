@@ -0,0 +1,47 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+
+struct msghdr;
+
+#define URING_ENTRIES    1024    /* Submission queue size per worker */
+
+/* A minimal io_uring instance, used to batch socket sends and receives
+ * into few io_uring_enter() calls. Socket operations never wait for the
+ * socket to become ready, like on a non-blocking socket they complete
+ * with -EAGAIN instead. Rings are not thread-safe, each worker owns one.
+ * Without HAVE_IO_URING, uring_create() always fails and the caller keeps
+ * using plain syscalls.
+ */
+typedef struct uring uring;
+
+typedef void (*uring_complete_fn)(void *arg, unsigned long long user_data, int res);
+
+uring* uring_create(unsigned entries);
+void uring_destroy(uring *r);
+int uring_prep_send(uring *r, int fd, const void *buf, size_t len, unsigned long long user_data);
+int uring_prep_sendmsg(uring *r, int fd, const struct msghdr *msg, unsigned long long user_data);
+int uring_prep_recv(uring *r, int fd, void *buf, size_t len, unsigned long long user_data);
+int uring_submit_and_wait(uring *r, uring_complete_fn complete, void *arg);
+
+#endif /* URING_H */
@@ -0,0 +1,321 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include "worker.h"
+#include "msg.h"
+#include "pool.h"
+#include "llist2.h"
+#include "log.h"
+
+static pool handoff_pool = POOL_INITIALIZER("handoff", sizeof(handoff));
+
+
+/*
+ * Creates a worker with its own epoll instance and wakeup eventfd. The
+ * caller registers the listener and the wakeup fd with the epoll set.
+ */
+worker* worker_create(int id, int listen_fd)
+{
+	worker *w = NULL;
+
+	w = (worker *)malloc(sizeof(worker));
+	if (w == NULL)
+		return NULL;
+	memset(w, 0, sizeof(worker));
+	w->id = id;
+	w->listen_fd = listen_fd;
+	w->cpu = -1;
+	pthread_mutex_init(&w->inbox_mutex, NULL);
+	timer_wheel_init(&w->timers, timer_clock());
+
+	w->epoll_fd = epoll_create1(0);
+	if (w->epoll_fd < 0)
+	{
+		free(w);
+		return NULL;
+	}
+
+	w->wake_fd = eventfd(0, EFD_NONBLOCK);
+	if (w->wake_fd < 0)
+	{
+		close(w->epoll_fd);
+		free(w);
+		return NULL;
+	}
+
+	return w;
+}
+
+
+/*
+ * Pins the calling thread, which must be the thread running the worker,
+ * to the given CPU.
+ */
+int worker_pin(worker *w, int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		return -1;
+
+	w->cpu = cpu;
+	logline(LOG_DEBUG, "worker_pin(): Worker %d pinned to CPU %d", w->id, cpu);
+
+	return 0;
+}
+
+
+/*
+ * Returns the n-th CPU the process is allowed to run on, wrapping around
+ * if there are fewer CPUs than n.
+ */
+int worker_get_cpu(int n)
+{
+	cpu_set_t set;
+	int count = 0;
+	int cpu = 0;
+
+	if (sched_getaffinity(0, sizeof(set), &set) != 0)
+		return -1;
+
+	count = CPU_COUNT(&set);
+	if (count == 0)
+		return -1;
+	n = n % count;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if (CPU_ISSET(cpu, &set))
+		{
+			if (n == 0)
+				return cpu;
+			n--;
+		}
+	}
+
+	return -1;
+}
+
+
+/*
+ * Allocates a handoff referencing a formatted message, if any. Returns 
+ * NULL if out of memory.
+ */
+handoff* handoff_create(int type, msg *m)
+{
+	handoff *h = NULL;
+
+	h = (handoff *)pool_alloc(&handoff_pool);
+	if (h == NULL)
+		return NULL;
+
+	h->type = type;
+	h->sockfd = -1;
+	h->conn_id = 0;
+	h->room = -1;
+	h->generation = 0;
+	h->msg = (m != NULL) ? msg_get(m) : NULL;
+	h->next = NULL;
+
+	return h;
+}
+
+
+/*
+ * Frees a handoff and drops its message reference.
+ */
+void handoff_free(handoff *h)
+{
+	if (h->msg != NULL)
+		msg_put(h->msg);
+	pool_free(&handoff_pool, h);
+}
+
+
+/*
+ * Appends a handoff to the inbox of a worker. The worker is only woken up
+ * if its inbox was empty, further handoffs are picked up in the same run.
+ */
+void worker_post(worker *w, handoff *h)
+{
+	int was_empty = FALSE;
+
+	h->next = NULL;
+
+	pthread_mutex_lock(&w->inbox_mutex);
+	was_empty = (w->inbox_head == NULL);
+	if (w->inbox_tail != NULL)
+		w->inbox_tail->next = h;
+	else
+		w->inbox_head = h;
+	w->inbox_tail = h;
+	pthread_mutex_unlock(&w->inbox_mutex);
+
+	if (was_empty)
+		worker_wake(w);
+}
+
+
+/*
+ * Makes the worker return from waiting for events.
+ */
+void worker_wake(worker *w)
+{
+	uint64_t one = 1;
+
+	if (write(w->wake_fd, &one, sizeof(one)) != sizeof(one))
+		logline(LOG_DEBUG, "worker_wake(): Could not wake worker %d", w->id);
+}
+
+
+/*
+ * Detaches all pending handoffs from the inbox of the worker and returns 
+ * them in posting order. The caller owns and frees the returned list.
+ */
+handoff* worker_take_inbox(worker *w)
+{
+	handoff *head = NULL;
+	uint64_t count = 0;
+
+	/* Reset wakeup counter */
+	if (read(w->wake_fd, &count, sizeof(count)) < 0)
+		count = 0;
+
+	pthread_mutex_lock(&w->inbox_mutex);
+	head = w->inbox_head;
+	w->inbox_head = NULL;
+	w->inbox_tail = NULL;
+	pthread_mutex_unlock(&w->inbox_mutex);
+
+	return head;
+}
+
+
+/*
+ * Appends a session to a set and returns its index, or -1 if out of
+ * memory.
+ */
+int client_set_add(client_set *set, client_info *ci)
+{
+	client_info **items = NULL;
+	int capacity = 0;
+
+	if (set->count == set->capacity)
+	{
+		capacity = (set->capacity == 0) ? 64 : set->capacity * 2;
+		items = (client_info **)realloc(set->items, capacity * sizeof(client_info *));
+		if (items == NULL)
+			return -1;
+		set->items = items;
+		set->capacity = capacity;
+	}
+	set->items[set->count] = ci;
+
+	return set->count++;
+}
+
+
+/*
+ * Adds a session to the set of sessions owned by the worker.
+ */
+int worker_add_client(worker *w, client_info *ci)
+{
+	int slot = 0;
+
+	slot = client_set_add(&w->clients, ci);
+	if (slot < 0)
+		return -1;
+
+	ci->worker_id = w->id;
+	ci->worker_slot = slot;
+
+	return 0;
+}
+
+
+/*
+ * Removes a session from the worker. The last session takes over the
+ * freed slot, so removal is O(1).
+ */
+void worker_remove_client(worker *w, client_info *ci)
+{
+	int slot = ci->worker_slot;
+	client_set *set = &w->clients;
+
+	if ((slot < 0) || (slot >= set->count) || (set->items[slot] != ci))
+		return;
+
+	set->count--;
+	set->items[slot] = set->items[set->count];
+	set->items[slot]->worker_slot = slot;
+	ci->worker_slot = -1;
+}
+
+
+/*
+ * Remembers that a session has queued output, which is flushed at the end
+ * of the current loop iteration.
+ */
+void worker_mark_dirty(worker *w, client_info *ci)
+{
+	if (ci->flags & CLIENT_DIRTY)
+		return;
+
+	if (client_set_add(&w->dirty, ci) >= 0)
+		ci->flags |= CLIENT_DIRTY;
+}
+
+
+/*
+ * Remembers a session to be disconnected at the end of the current loop
+ * iteration. Disconnecting right away is not an option while a broadcast
+ * walks the client set.
+ */
+void worker_mark_kicked(worker *w, client_info *ci)
+{
+	if (ci->flags & (CLIENT_KICKED | CLIENT_CLOSED))
+		return;
+
+	if (client_set_add(&w->kicked, ci) >= 0)
+		ci->flags |= CLIENT_KICKED;
+}
+
+
+/*
+ * Hands a disconnected session over to be freed at the end of the current 
+ * loop iteration, when no pending event or list refers to it any longer.
+ */
+void worker_mark_dead(worker *w, client_info *ci)
+{
+	ci->flags |= CLIENT_CLOSED;
+	ci->next_dead = w->dead;
+	w->dead = ci;
+}
@@ -0,0 +1,100 @@
+/******************************************************************************
+ *    Copyright 2012 André Gasser
+ *
+ *    This file is part of CHATSRV.
+ *
+ *    CHATSRV is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    CHATSRV is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with CHATSRV. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include "timer.h"
+
+#define MAX_WORKERS       64
+
+/* Handoff types */
+#define HANDOFF_BROADCAST 1    /* Deliver to the members of a room */
+#define HANDOFF_PRIVATE   2    /* Deliver to a single session */
+#define HANDOFF_RENAME    3    /* Give a session a nickname of its own */
+
+struct client_info;
+struct msg;
+struct uring;
+struct msghdr;
+struct iovec;
+
+/* An unordered set of sessions */
+typedef struct client_set
+{
+	struct client_info **items;
+	int count;
+	int capacity;
+} client_set;
+
+/* A message passed from one worker to another. Each worker only ever 
+ * writes to the sockets it owns, everything else goes through the inbox
+ * of the owning worker.
+ */
+typedef struct handoff
+{
+	int type;
+	int sockfd;                  /* Recipient of a private message */
+	unsigned long conn_id;       /* Guards against reused socket ids */
+	int room;                    /* Recipients of a broadcast */
+	unsigned long generation;    /* Guards against reused rooms */
+	struct msg *msg;             /* Shared message, one reference held */
+	struct handoff *next;
+} handoff;
+
+typedef struct worker
+{
+	int id;
+	int epoll_fd;
+	int listen_fd;
+	int wake_fd;                 /* eventfd, signalled on new handoffs */
+	int cpu;                     /* CPU to pin to, -1 if unpinned */
+	pthread_t thread;
+	pthread_mutex_t inbox_mutex;
+	handoff *inbox_head;
+	handoff *inbox_tail;
+	client_set clients;              /* Sessions owned by this worker */
+	client_set dirty;                /* Sessions with output to flush */
+	client_set kicked;               /* Sessions to disconnect */
+	struct client_info *dead;        /* Sessions to free */
+	timer_wheel timers;              /* Timeouts of the sessions */
+	struct uring *ring;              /* io_uring, NULL for plain syscalls */
+	char *recv_buffers;              /* Receive buffers for batched reads */
+	struct msghdr *send_msgs;        /* Message headers for batched sends */
+	struct iovec *send_iovs;         /* I/O vectors for batched sends */
+} worker;
+
+worker* worker_create(int id, int listen_fd);
+int worker_pin(worker *w, int cpu);
+int worker_get_cpu(int n);
+handoff* handoff_create(int type, struct msg *m);
+void handoff_free(handoff *h);
+void worker_post(worker *w, handoff *h);
+void worker_wake(worker *w);
+handoff* worker_take_inbox(worker *w);
+int worker_add_client(worker *w, struct client_info *ci);
+void worker_remove_client(worker *w, struct client_info *ci);
+void worker_mark_dirty(worker *w, struct client_info *ci);
+void worker_mark_kicked(worker *w, struct client_info *ci);
+void worker_mark_dead(worker *w, struct client_info *ci);
+int client_set_add(client_set *set, struct client_info *ci);
+
+#endif /* WORKER_H */